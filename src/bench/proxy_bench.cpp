@@ -0,0 +1,779 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/chrono.hpp>
+#include <boost/atomic.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+
+#include "net/tcp_proxy.h"
+#include "core/histogram.h"
+#include "core/log.h"
+
+namespace {
+
+///
+/// @brief Defines the clock used to measure the benchmark.
+///
+typedef boost::chrono::steady_clock bench_clock;
+
+///
+/// @brief Defines a shared_ptr for a socket.
+///
+typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+///
+/// @brief This structure holds the benchmark parameters.
+///
+typedef struct bench_config_
+{
+    ///
+    /// @brief Holds the backend mode: "echo" answers every message, "sink"
+    /// only acknowledges the end of the stream.
+    ///
+    std::string mode_;
+
+    ///
+    /// @brief Holds the number of concurrent client connections.
+    ///
+    unsigned connections_;
+
+    ///
+    /// @brief Holds the number of messages sent by every connection.
+    ///
+    uint64_t messages_;
+
+    ///
+    /// @brief Holds the size of every message.
+    ///
+    size_t message_size_;
+
+    ///
+    /// @brief Holds the number of short connections opened to measure the
+    /// connection rate.
+    ///
+    unsigned connect_count_;
+
+    ///
+    /// @brief Holds the number of threads running the proxy.
+    ///
+    unsigned threads_;
+
+    ///
+    /// @brief Holds the initial read buffer size of the proxy.
+    ///
+    size_t buffer_size_;
+
+    ///
+    /// @brief Holds the minimum read buffer size of the proxy.
+    ///
+    size_t buffer_min_size_;
+
+    ///
+    /// @brief Holds the maximum read buffer size of the proxy.
+    ///
+    size_t buffer_max_size_;
+
+    ///
+    /// @brief Enables the zero-copy relay of the proxy.
+    ///
+    bool zero_copy_;
+
+    ///
+    /// @brief Enables the io_uring relay of the proxy.
+    ///
+    bool io_uring_;
+
+    ///
+    /// @brief Holds the port the proxy listens on.
+    ///
+    std::string proxy_port_;
+
+    ///
+    /// @brief Holds the port the backend listens on.
+    ///
+    std::string backend_port_;
+
+    ///
+    /// @brief Holds the size of the proxy upstream pool.
+    ///
+    uint64_t upstream_pool_size_;
+
+} bench_config;
+
+///
+/// @brief This class is the benchmark backend. It serves every connection
+/// with a blocking thread, so it stays out of the proxy io_service.
+///
+class backend :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Constructor. Binds the listening socket.
+    ///
+    /// @param config The benchmark parameters.
+    ///
+    explicit backend(
+            const bench_config& config) :
+        acceptor_(io_service_),
+        config_(config),
+        sink_(false),
+        stopping_(false)
+    {
+        boost::asio::ip::tcp::endpoint endpoint(
+                    boost::asio::ip::address::from_string("127.0.0.1"),
+                    static_cast<unsigned short>(
+                        std::atoi(config.backend_port_.c_str())));
+
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(
+                    boost::asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+
+        accept_thread_ = boost::thread(boost::bind(&backend::accept, this));
+    }
+
+    ///
+    /// @brief Destructor. Stops accepting and waits for the connections.
+    ///
+    virtual ~backend()
+    {
+        stopping_ = true;
+
+        // wakes up the blocking accept
+        boost::system::error_code ignored;
+        boost::asio::ip::tcp::socket socket(io_service_);
+        socket.connect(acceptor_.local_endpoint(), ignored);
+
+        accept_thread_.join();
+        threads_.join_all();
+    }
+
+    ///
+    /// @brief Selects how the next connections are served.
+    ///
+    /// @param sink True for the sink mode, false for the echo mode.
+    ///
+    void set_sink(
+            bool sink)
+    {
+        sink_ = sink;
+    }
+
+protected:
+
+    ///
+    /// @brief Accepts connections until the backend is destroyed.
+    ///
+    void accept()
+    {
+        while (!stopping_)
+        {
+            socket_ptr socket =
+                    boost::make_shared<boost::asio::ip::tcp::socket>(
+                        io_service_);
+
+            boost::system::error_code ec;
+            acceptor_.accept(*socket, ec);
+
+            if (ec || stopping_)
+                break;
+
+            threads_.create_thread(
+                        boost::bind(&backend::serve, this, socket));
+        }
+    }
+
+    ///
+    /// @brief Serves one connection until the peer closes it. The mode is
+    /// chosen by the first read, since the proxy may open its connections
+    /// ahead of the clients.
+    ///
+    /// @param socket The connection.
+    ///
+    void serve(
+            socket_ptr socket)
+    {
+        std::vector<char> buffer(65536);
+        uint64_t expected = config_.messages_ * config_.message_size_;
+        boost::system::error_code ec;
+        int sink = -1;
+
+        for (;;)
+        {
+            size_t n = socket->read_some(boost::asio::buffer(buffer), ec);
+
+            if (ec)
+                break;
+
+            if (sink < 0)
+                sink = sink_.load();
+
+            if (!sink)
+            {
+                boost::asio::write(*socket, boost::asio::buffer(buffer, n), ec);
+            }
+            else if (expected <= n)
+            {
+                // the whole stream arrived, acknowledges it with one byte
+                expected = 0;
+                boost::asio::write(*socket, boost::asio::buffer(buffer, 1), ec);
+            }
+            else
+            {
+                expected -= n;
+            }
+
+            if (ec)
+                break;
+        }
+    }
+
+    ///
+    /// @brief Holds the io_service used by the blocking sockets.
+    ///
+    boost::asio::io_service io_service_;
+
+    ///
+    /// @brief Holds the listening socket.
+    ///
+    boost::asio::ip::tcp::acceptor acceptor_;
+
+    ///
+    /// @brief Holds the benchmark parameters.
+    ///
+    bench_config config_;
+
+    ///
+    /// @brief Flag indicating whether the next connections are sinks.
+    ///
+    boost::atomic<bool> sink_;
+
+    ///
+    /// @brief Flag indicating whether the backend is stopping.
+    ///
+    boost::atomic<bool> stopping_;
+
+    ///
+    /// @brief Holds the thread accepting the connections.
+    ///
+    boost::thread accept_thread_;
+
+    ///
+    /// @brief Holds the threads serving the connections.
+    ///
+    boost::thread_group threads_;
+};
+
+///
+/// @brief Connects a blocking socket to the proxy.
+///
+void connect(
+        boost::asio::ip::tcp::socket& socket,
+        const bench_config& config)
+{
+    socket.connect(
+                boost::asio::ip::tcp::endpoint(
+                    boost::asio::ip::address::from_string("127.0.0.1"),
+                    static_cast<unsigned short>(
+                        std::atoi(config.proxy_port_.c_str()))));
+
+    socket.set_option(boost::asio::ip::tcp::no_delay(true));
+}
+
+///
+/// @brief Runs one client of the throughput phase.
+///
+void run_stream(
+        const bench_config& config,
+        boost::barrier& barrier,
+        core::histogram& latency,
+        boost::atomic<uint64_t>& failures)
+{
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::socket socket(io_service);
+    std::vector<char> message(config.message_size_, 'x');
+    std::vector<char> reply(config.message_size_);
+
+    try
+    {
+        connect(socket, config);
+    }
+    catch (std::exception&)
+    {
+        ++failures;
+        barrier.wait();
+        return;
+    }
+
+    barrier.wait();
+
+    try
+    {
+        if (config.mode_ == "sink")
+        {
+            for (uint64_t i = 0; i < config.messages_; ++i)
+                boost::asio::write(socket, boost::asio::buffer(message));
+
+            boost::asio::read(socket, boost::asio::buffer(reply, 1));
+            return;
+        }
+
+        for (uint64_t i = 0; i < config.messages_; ++i)
+        {
+            bench_clock::time_point start = bench_clock::now();
+
+            boost::asio::write(socket, boost::asio::buffer(message));
+            boost::asio::read(socket, boost::asio::buffer(reply));
+
+            latency.record(
+                        boost::chrono::duration_cast<
+                            boost::chrono::nanoseconds>(
+                            bench_clock::now() - start).count());
+        }
+    }
+    catch (std::exception&)
+    {
+        ++failures;
+    }
+}
+
+///
+/// @brief Runs one client of the connection rate phase.
+///
+void run_connect(
+        const bench_config& config,
+        unsigned count,
+        core::histogram& latency,
+        boost::atomic<uint64_t>& failures)
+{
+    boost::asio::io_service io_service;
+    char byte = 'x';
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        bench_clock::time_point start = bench_clock::now();
+
+        try
+        {
+            boost::asio::ip::tcp::socket socket(io_service);
+
+            connect(socket, config);
+            boost::asio::write(socket, boost::asio::buffer(&byte, 1));
+            boost::asio::read(socket, boost::asio::buffer(&byte, 1));
+        }
+        catch (std::exception&)
+        {
+            ++failures;
+            continue;
+        }
+
+        latency.record(
+                    boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+                        bench_clock::now() - start).count());
+    }
+}
+
+///
+/// @brief Gets the seconds elapsed between two time points.
+///
+double seconds(
+        const bench_clock::time_point& start,
+        const bench_clock::time_point& stop)
+{
+    return boost::chrono::duration_cast<boost::chrono::duration<double> >(
+                stop - start).count();
+}
+
+///
+/// @brief Writes the summary of a histogram as a JSON object, in
+/// microseconds.
+///
+void write_latency(
+        std::ostream& out,
+        core::histogram& latency)
+{
+    core::histogram::info summary = latency.get_info();
+
+    out << "{ \"count\": " << summary.count_
+        << ", \"p50_us\": " << summary.p50_ / 1e3
+        << ", \"p99_us\": " << summary.p99_ / 1e3
+        << ", \"p999_us\": " << summary.p999_ / 1e3
+        << ", \"max_us\": " << summary.max_ / 1e3 << " }";
+}
+
+///
+/// @brief Waits until the proxy accepts connections.
+///
+bool wait_listening(
+        const bench_config& config)
+{
+    boost::asio::io_service io_service;
+
+    for (int i = 0; i < 200; ++i)
+    {
+        try
+        {
+            boost::asio::ip::tcp::socket socket(io_service);
+            connect(socket, config);
+
+            return true;
+        }
+        catch (std::exception&)
+        {
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+        }
+    }
+
+    return false;
+}
+
+} // namespace
+
+///
+/// @brief This function setups all program options.
+///
+/// @param desc The option description that will be written with all options.
+///
+void add_options(
+        boost::program_options::options_description& desc)
+{
+    namespace po = boost::program_options;
+
+    desc.add_options()
+            ("help,h",
+             "this help message");
+
+    desc.add_options()
+            ("mode",
+             po::value<std::string>()->default_value("echo"),
+             "backend mode (echo|sink)");
+
+    desc.add_options()
+            ("connections,c",
+             po::value<unsigned>()->default_value(16),
+             "number of concurrent connections");
+
+    desc.add_options()
+            ("messages,m",
+             po::value<uint64_t>()->default_value(1000),
+             "number of messages sent by every connection");
+
+    desc.add_options()
+            ("message-size,s",
+             po::value<size_t>()->default_value(4096),
+             "message size");
+
+    desc.add_options()
+            ("connect-count",
+             po::value<unsigned>()->default_value(1000),
+             "number of short connections used to measure the connection "
+             "rate (0 - disabled)");
+
+    desc.add_options()
+            ("threads,t",
+             po::value<unsigned>()->default_value(1),
+             "number of threads used to run the proxy");
+
+    desc.add_options()
+            ("buffer-size,b",
+             po::value<size_t>()->default_value(8192),
+             "initial read buffer size of the proxy");
+
+    desc.add_options()
+            ("buffer-min-size",
+             po::value<size_t>()->default_value(1024),
+             "minimum read buffer size of the proxy");
+
+    desc.add_options()
+            ("buffer-max-size",
+             po::value<size_t>()->default_value(65536),
+             "maximum read buffer size of the proxy");
+
+    desc.add_options()
+            ("zero-copy",
+             po::value<bool>()->default_value(true),
+             "relay with splice (0|1)");
+
+    desc.add_options()
+            ("io-uring",
+             po::value<bool>()->default_value(false),
+             "relay through io_uring (0|1)");
+
+    desc.add_options()
+            ("upstream-pool-size",
+             po::value<uint64_t>()->default_value(0),
+             "connections to the backend kept open by the proxy");
+
+    desc.add_options()
+            ("proxy-port",
+             po::value<std::string>()->default_value("19180"),
+             "port the proxy listens on");
+
+    desc.add_options()
+            ("backend-port",
+             po::value<std::string>()->default_value("19181"),
+             "port the backend listens on");
+
+    desc.add_options()
+            ("log-level,l",
+             po::value<std::string>()->default_value("warning"),
+             "log level (trace|debug|info|warning|error|fatal");
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        boost::program_options::variables_map vm;
+        boost::program_options::options_description desc("allowed options");
+
+        add_options(desc);
+
+        boost::program_options::store(
+                    boost::program_options::parse_command_line(
+                        argc,
+                        argv,
+                        desc),
+                    vm);
+
+        if (vm.count("help"))
+        {
+            std::cout << desc << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        core::logging::init("", vm["log-level"].as<std::string>());
+
+        bench_config config;
+
+        config.mode_ = vm["mode"].as<std::string>();
+        config.connections_ = std::max(1u, vm["connections"].as<unsigned>());
+        config.messages_ = vm["messages"].as<uint64_t>();
+        config.message_size_ = std::max<size_t>(
+                    1, vm["message-size"].as<size_t>());
+        config.connect_count_ = vm["connect-count"].as<unsigned>();
+        config.threads_ = std::max(1u, vm["threads"].as<unsigned>());
+        config.buffer_size_ = vm["buffer-size"].as<size_t>();
+        config.buffer_min_size_ = vm["buffer-min-size"].as<size_t>();
+        config.buffer_max_size_ = vm["buffer-max-size"].as<size_t>();
+        config.zero_copy_ = vm["zero-copy"].as<bool>();
+        config.io_uring_ = vm["io-uring"].as<bool>();
+        config.proxy_port_ = vm["proxy-port"].as<std::string>();
+        config.backend_port_ = vm["backend-port"].as<std::string>();
+        config.upstream_pool_size_ = vm["upstream-pool-size"].as<uint64_t>();
+
+        if (config.mode_ != "echo" && config.mode_ != "sink")
+            throw std::invalid_argument("invalid mode " + config.mode_);
+
+        backend echo_backend(config);
+
+        net::tcp_proxy::config proxy_config;
+
+        proxy_config.name_ = "bench";
+        proxy_config.shost_ = "127.0.0.1";
+        proxy_config.sport_ = config.proxy_port_;
+        proxy_config.dhost_ = "127.0.0.1";
+        proxy_config.dport_ = config.backend_port_;
+        proxy_config.client_delay_ = 0;
+        proxy_config.server_delay_ = 0;
+        proxy_config.client_rate_ = 0;
+        proxy_config.client_burst_ = 0;
+        proxy_config.server_rate_ = 0;
+        proxy_config.server_burst_ = 0;
+        proxy_config.aggregate_client_rate_ = 0;
+        proxy_config.aggregate_client_burst_ = 0;
+        proxy_config.aggregate_server_rate_ = 0;
+        proxy_config.aggregate_server_burst_ = 0;
+        proxy_config.buffer_size_ = config.buffer_size_;
+        proxy_config.buffer_min_size_ = config.buffer_min_size_;
+        proxy_config.buffer_max_size_ = config.buffer_max_size_;
+        proxy_config.buffer_pool_size_ = 256;
+        proxy_config.high_watermark_ = 262144;
+        proxy_config.low_watermark_ = 65536;
+        proxy_config.timeout_ = 0;
+        proxy_config.timeout_tick_ = 100000;
+        proxy_config.connect_timeout_ = 10000000;
+        proxy_config.connect_stagger_ = 250000;
+        proxy_config.listen_backlog_ = 0;
+        proxy_config.accept_count_ = 4;
+        proxy_config.accept_batch_ = 16;
+        proxy_config.max_sessions_ = 0;
+        proxy_config.max_buffered_bytes_ = 0;
+        proxy_config.message_dump_ = "none";
+        proxy_config.capture_file_size_ = 0;
+        proxy_config.upstream_pool_size_ = config.upstream_pool_size_;
+        proxy_config.upstream_pool_max_idle_ = 30000000;
+        proxy_config.resolve_ttl_ = 30000000;
+        proxy_config.balance_ = "round-robin";
+        proxy_config.zero_copy_ = config.zero_copy_;
+        proxy_config.io_uring_ = config.io_uring_;
+        proxy_config.io_uring_entries_ = 1024;
+        proxy_config.io_uring_buffers_ = 1024;
+        proxy_config.client_socket_ = net::socket_profile::options();
+        proxy_config.upstream_socket_ = net::socket_profile::options();
+        proxy_config.reuse_port_ = false;
+        proxy_config.shard_ = 0;
+        proxy_config.listener_ = -1;
+
+        boost::asio::io_service io_service;
+        boost::scoped_ptr<boost::asio::io_service::work> work(
+                    new boost::asio::io_service::work(io_service));
+        boost::thread_group proxy_threads;
+
+        net::tcp_proxy::ptr proxy =
+                boost::make_shared<net::tcp_proxy>(
+                    boost::ref(io_service), proxy_config);
+
+        proxy->start();
+
+        for (unsigned i = 0; i < config.threads_; ++i)
+        {
+            proxy_threads.create_thread(
+                        boost::bind(&boost::asio::io_service::run,
+                                    &io_service));
+        }
+
+        if (!wait_listening(config))
+            throw std::runtime_error("the proxy is not listening");
+
+        boost::atomic<uint64_t> failures(0);
+
+        // connection rate phase, always against the echo backend
+        core::histogram connect_latency;
+        double connect_seconds = 0;
+
+        if (config.connect_count_)
+        {
+            boost::thread_group clients;
+            bench_clock::time_point start = bench_clock::now();
+
+            for (unsigned i = 0; i < config.connections_; ++i)
+            {
+                unsigned count = config.connect_count_ / config.connections_ +
+                        (i < config.connect_count_ % config.connections_);
+
+                clients.create_thread(
+                            boost::bind(&run_connect, boost::cref(config),
+                                        count, boost::ref(connect_latency),
+                                        boost::ref(failures)));
+            }
+
+            clients.join_all();
+            connect_seconds = seconds(start, bench_clock::now());
+        }
+
+        // throughput phase
+        echo_backend.set_sink(config.mode_ == "sink");
+
+        core::histogram message_latency;
+        boost::barrier barrier(config.connections_ + 1);
+        boost::thread_group clients;
+
+        for (unsigned i = 0; i < config.connections_; ++i)
+        {
+            clients.create_thread(
+                        boost::bind(&run_stream, boost::cref(config),
+                                    boost::ref(barrier),
+                                    boost::ref(message_latency),
+                                    boost::ref(failures)));
+        }
+
+        barrier.wait();
+        bench_clock::time_point start = bench_clock::now();
+
+        clients.join_all();
+        double stream_seconds = seconds(start, bench_clock::now());
+
+        proxy->stop();
+        work.reset();
+        proxy_threads.join_all();
+
+        // echo traffic crosses the proxy twice
+        const uint64_t bytes = config.connections_ * config.messages_ *
+                config.message_size_ *
+                (config.mode_ == "echo" ? 2 : 1);
+
+        std::ostream& out = std::cout;
+
+        out << std::fixed << std::setprecision(3)
+            << "{\n"
+            << "  \"config\": { \"mode\": \"" << config.mode_ << "\""
+            << ", \"connections\": " << config.connections_
+            << ", \"messages\": " << config.messages_
+            << ", \"message_size\": " << config.message_size_
+            << ", \"connect_count\": " << config.connect_count_
+            << ", \"threads\": " << config.threads_
+            << ", \"buffer_size\": " << config.buffer_size_
+            << ", \"buffer_min_size\": " << config.buffer_min_size_
+            << ", \"buffer_max_size\": " << config.buffer_max_size_
+            << ", \"zero_copy\": " << (config.zero_copy_ ? "true" : "false")
+            << ", \"io_uring\": " << (config.io_uring_ ? "true" : "false")
+            << ", \"upstream_pool_size\": " << config.upstream_pool_size_
+            << " },\n"
+            << "  \"throughput\": { \"bytes\": " << bytes
+            << ", \"seconds\": " << stream_seconds
+            << ", \"mb_per_s\": " << bytes / stream_seconds / 1e6 << " },\n"
+            << "  \"message_latency\": ";
+
+        write_latency(out, message_latency);
+
+        out << ",\n"
+            << "  \"connections\": { \"count\": "
+            << connect_latency.get_info().count_
+            << ", \"seconds\": " << connect_seconds
+            << ", \"per_s\": "
+            << (connect_seconds > 0 ?
+                    connect_latency.get_info().count_ / connect_seconds : 0)
+            << " },\n"
+            << "  \"connection_latency\": ";
+
+        write_latency(out, connect_latency);
+
+        out << ",\n"
+            << "  \"proxy_tx_latency\": ";
+
+        write_latency(out, proxy->get_metrics()->tx_latency_);
+
+        out << ",\n"
+            << "  \"proxy_rx_latency\": ";
+
+        write_latency(out, proxy->get_metrics()->rx_latency_);
+
+        out << ",\n"
+            << "  \"proxy_connect_latency\": ";
+
+        write_latency(out, proxy->get_metrics()->connect_latency_);
+
+        out << ",\n"
+            << "  \"failures\": " << failures.load() << "\n"
+            << "}" << std::endl;
+
+        return failures.load() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "std::exception: " << e.what() << std::endl;
+
+        return EXIT_FAILURE;
+    }
+}
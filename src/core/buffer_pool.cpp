@@ -0,0 +1,141 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <stdexcept>
+
+#include <boost/make_shared.hpp>
+
+#include "core/buffer_pool.h"
+using namespace core;
+
+buffer_pool::buffer_pool(
+        size_t min_size,
+        size_t max_size,
+        size_t max_free) :
+    min_size_(min_size),
+    max_size_(max_size),
+    classes_(1),
+    max_free_(max_free),
+    hits_(0),
+    misses_(0),
+    discards_(0)
+{
+    if (!min_size_ || min_size_ > max_size_)
+        throw std::invalid_argument("invalid buffer sizes");
+
+    // the last class holds the maximum size even if it is not a power of
+    // two times the minimum
+    for (size_t size = min_size_; size < max_size_; size <<= 1)
+        ++classes_;
+}
+
+buffer_pool::~buffer_pool()
+{
+}
+
+size_t buffer_pool::class_of(
+        size_t size) const
+{
+    size_t index = 0;
+
+    for (size_t class_size = min_size_;
+         class_size < size && index + 1 < classes_;
+         class_size <<= 1)
+    {
+        ++index;
+    }
+
+    return index;
+}
+
+buffer_pool::free_list& buffer_pool::get_free_list(
+        size_t index)
+{
+    free_lists* lists = static_cast<free_lists*>(registry_.get());
+
+    if (lists)
+        return (*lists)[index];
+
+    boost::shared_ptr<free_lists> list =
+            boost::make_shared<free_lists>(classes_);
+
+    for (size_t i = 0; i < classes_; ++i)
+        (*list)[i].reserve(max_free_);
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        free_lists_.push_back(list);
+    }
+
+    registry_.set(list.get());
+
+    return (*list)[index];
+}
+
+buffer_pool::buffer_ptr buffer_pool::acquire(
+        size_t size)
+{
+    free_list& free = get_free_list(class_of(size));
+
+    if (!free.empty())
+    {
+        buffer_ptr buffer;
+        buffer.swap(free.back());
+        free.pop_back();
+        hits_.fetch_add(1, boost::memory_order_relaxed);
+
+        return buffer;
+    }
+
+    misses_.fetch_add(1, boost::memory_order_relaxed);
+
+    return boost::make_shared<uint8_t[]>(get_class_size(size));
+}
+
+void buffer_pool::release(
+        const buffer_ptr& buffer,
+        size_t size)
+{
+    if (!buffer)
+        return;
+
+    free_list& free = get_free_list(class_of(size));
+
+    if (free.size() < max_free_)
+        free.push_back(buffer);
+    else
+        discards_.fetch_add(1, boost::memory_order_relaxed);
+}
+
+size_t buffer_pool::get_class_size(
+        size_t size) const
+{
+    const size_t index = class_of(size);
+
+    return index + 1 < classes_ ? min_size_ << index : max_size_;
+}
+
+size_t buffer_pool::get_min_size() const
+{
+    return min_size_;
+}
+
+size_t buffer_pool::get_max_size() const
+{
+    return max_size_;
+}
+
+buffer_pool::info buffer_pool::get_info()
+{
+    info pool_info;
+
+    pool_info.hits_ = hits_.load(boost::memory_order_relaxed);
+    pool_info.misses_ = misses_.load(boost::memory_order_relaxed);
+    pool_info.discards_ = discards_.load(boost::memory_order_relaxed);
+
+    return pool_info;
+}
@@ -0,0 +1,234 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/atomic.hpp>
+
+#include "core/thread_registry.h"
+
+///
+/// @brief This namespace is used by all core classes.
+///
+namespace core {
+
+///
+/// @brief This class keeps free lists of buffers that can be borrowed and
+/// returned, avoiding one allocation per read.
+///
+/// The buffers come in size classes, from the minimum size doubling up to the
+/// maximum size, and every class has its own free list. Every thread has its
+/// own free lists, so borrowing and returning a buffer takes no lock. A
+/// buffer borrowed by one thread and returned by another one simply moves to
+/// the free list of the latter.
+///
+class buffer_pool :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<buffer_pool> ptr;
+
+    ///
+    /// @brief Defines the buffer type handed out by the pool.
+    ///
+    typedef boost::shared_ptr<uint8_t[]> buffer_ptr;
+
+    ///
+    /// @brief This structure defines counters for collecting statistical
+    /// information.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of buffers served from the free list.
+        ///
+        uint64_t hits_;
+
+        ///
+        /// @brief Holds the number of buffers that had to be allocated.
+        ///
+        uint64_t misses_;
+
+        ///
+        /// @brief Holds the number of buffers released while the free list
+        /// was full.
+        ///
+        uint64_t discards_;
+
+    } info;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param min_size The size in bytes of the smallest buffers.
+    /// @param max_size The size in bytes of the largest buffers.
+    /// @param max_free The maximum number of idle buffers of each size kept
+    /// by each thread.
+    ///
+    /// @throw std::invalid_argument If the minimum size is 0 or greater than
+    /// the maximum size.
+    ///
+    buffer_pool(
+            size_t min_size,
+            size_t max_size,
+            size_t max_free);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~buffer_pool();
+
+    ///
+    /// @brief Borrows a buffer from the pool. A new buffer is allocated if
+    /// the free list of its size class is empty.
+    ///
+    /// @param size The minimum size in bytes.
+    ///
+    /// @return A buffer with get_class_size(size) bytes.
+    ///
+    buffer_ptr acquire(
+            size_t size);
+
+    ///
+    /// @brief Returns a buffer to the pool. The caller must not touch the
+    /// buffer contents after this call.
+    ///
+    /// @param buffer The buffer previously borrowed from this pool.
+    /// @param size The size in bytes it was borrowed with.
+    ///
+    void release(
+            const buffer_ptr& buffer,
+            size_t size);
+
+    ///
+    /// @brief Gets the size of the smallest class able to hold a number of
+    /// bytes.
+    ///
+    /// @param size The number of bytes.
+    ///
+    /// @return The class size in bytes, never above the maximum size.
+    ///
+    size_t get_class_size(
+            size_t size) const;
+
+    ///
+    /// @brief Gets the size of the smallest buffers.
+    ///
+    /// @return The size in bytes.
+    ///
+    size_t get_min_size() const;
+
+    ///
+    /// @brief Gets the size of the largest buffers.
+    ///
+    /// @return The size in bytes.
+    ///
+    size_t get_max_size() const;
+
+    ///
+    /// @brief Gets statistical information.
+    ///
+    /// @return A copy of the pool counters.
+    ///
+    info get_info();
+
+protected:
+
+    ///
+    /// @brief Holds the size of the smallest buffers.
+    ///
+    size_t min_size_;
+
+    ///
+    /// @brief Holds the size of the largest buffers.
+    ///
+    size_t max_size_;
+
+    ///
+    /// @brief Holds the number of size classes.
+    ///
+    size_t classes_;
+
+    ///
+    /// @brief Holds the maximum number of idle buffers per class and thread.
+    ///
+    size_t max_free_;
+
+    ///
+    /// @brief Defines a list of idle buffers.
+    ///
+    typedef std::vector<buffer_ptr> free_list;
+
+    ///
+    /// @brief Defines the free lists of one thread, one per size class.
+    ///
+    typedef std::vector<free_list> free_lists;
+
+    ///
+    /// @brief Maps a size to its class.
+    ///
+    /// @param size The number of bytes.
+    ///
+    /// @return The index of the smallest class able to hold them.
+    ///
+    size_t class_of(
+            size_t size) const;
+
+    ///
+    /// @brief Gets a free list of the calling thread, creating the lists on
+    /// the first call.
+    ///
+    /// @param index The size class.
+    ///
+    /// @return The free list of the class for the calling thread.
+    ///
+    free_list& get_free_list(
+            size_t index);
+
+    ///
+    /// @brief Holds the free lists of the calling thread.
+    ///
+    thread_registry registry_;
+
+    ///
+    /// @brief Holds the free lists of every thread that used the pool.
+    ///
+    std::vector<boost::shared_ptr<free_lists> > free_lists_;
+
+    ///
+    /// @brief Holds the number of buffers served from a free list.
+    ///
+    boost::atomic<uint64_t> hits_;
+
+    ///
+    /// @brief Holds the number of buffers that had to be allocated.
+    ///
+    boost::atomic<uint64_t> misses_;
+
+    ///
+    /// @brief Holds the number of buffers released while the free list was
+    /// full.
+    ///
+    boost::atomic<uint64_t> discards_;
+
+    ///
+    /// @brief Mutex used to synchronize the creation of the free lists.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace core
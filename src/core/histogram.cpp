@@ -0,0 +1,170 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <cmath>
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "core/histogram.h"
+using namespace core;
+
+namespace {
+
+///
+/// @brief Defines the number of bits of a value kept by its bucket. Every
+/// power of two is split in 2^(SUB_BITS - 1) linear buckets, so a bucket is
+/// at most 1/128 of its values wide.
+///
+const unsigned SUB_BITS = 8;
+
+///
+/// @brief Defines the largest value recorded.
+///
+const uint64_t MAX_VALUE = uint64_t(1) << 40;
+
+///
+/// @brief Defines the number of buckets needed up to MAX_VALUE.
+///
+const size_t BUCKET_COUNT =
+        (40 - SUB_BITS + 1) * (size_t(1) << (SUB_BITS - 1)) +
+        (size_t(1) << (SUB_BITS - 1)) + 1;
+
+} // namespace
+
+histogram::histogram()
+{
+}
+
+histogram::~histogram()
+{
+}
+
+size_t histogram::index_of(
+        uint64_t value)
+{
+    if (value < (uint64_t(1) << SUB_BITS))
+        return static_cast<size_t>(value);
+
+    const unsigned msb = 63 - __builtin_clzll(value);
+    const unsigned shift = msb - (SUB_BITS - 1);
+
+    return (size_t(shift) << (SUB_BITS - 1)) +
+            static_cast<size_t>(value >> shift);
+}
+
+uint64_t histogram::value_of(
+        size_t index)
+{
+    if (index < (size_t(1) << SUB_BITS))
+        return index;
+
+    const unsigned shift = static_cast<unsigned>(index >> (SUB_BITS - 1)) - 1;
+    const uint64_t mantissa = (index & ((size_t(1) << (SUB_BITS - 1)) - 1)) +
+            (uint64_t(1) << (SUB_BITS - 1));
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+boost::atomic<uint64_t>* histogram::get_buckets()
+{
+    boost::atomic<uint64_t>* registered =
+            static_cast<boost::atomic<uint64_t>*>(registry_.get());
+
+    if (registered)
+        return registered;
+
+    boost::shared_ptr<buckets> list = boost::make_shared<buckets>(
+                new boost::atomic<uint64_t>[BUCKET_COUNT]);
+
+    for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        (*list)[i].store(0, boost::memory_order_relaxed);
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        thread_buckets_.push_back(list);
+    }
+
+    registry_.set(list->get());
+
+    return list->get();
+}
+
+void histogram::record(
+        uint64_t value)
+{
+    boost::atomic<uint64_t>& bucket =
+            get_buckets()[index_of(value < MAX_VALUE ? value : MAX_VALUE)];
+
+    // only the calling thread writes to its buckets, the atomic just keeps
+    // the concurrent merges from reading a torn value
+    bucket.store(bucket.load(boost::memory_order_relaxed) + 1,
+                 boost::memory_order_relaxed);
+}
+
+void histogram::merge(
+        counts& merged)
+{
+    if (merged.empty())
+        merged.resize(BUCKET_COUNT);
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    for (size_t i = 0; i < thread_buckets_.size(); ++i)
+    {
+        for (size_t j = 0; j < BUCKET_COUNT; ++j)
+        {
+            merged[j] += (*thread_buckets_[i])[j].load(
+                        boost::memory_order_relaxed);
+        }
+    }
+}
+
+histogram::info histogram::get_info()
+{
+    counts merged;
+
+    merge(merged);
+
+    return summarize(merged);
+}
+
+histogram::info histogram::summarize(
+        const counts& merged)
+{
+    info summary = info();
+
+    for (size_t i = 0; i < merged.size(); ++i)
+        summary.count_ += merged[i];
+
+    if (!summary.count_)
+        return summary;
+
+    const double quantiles[] = { 0.5, 0.99, 0.999 };
+    uint64_t* values[] = { &summary.p50_, &summary.p99_, &summary.p999_ };
+
+    size_t q = 0;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < merged.size(); ++i)
+    {
+        if (!merged[i])
+            continue;
+
+        seen += merged[i];
+
+        while (q < 3 &&
+               seen >= std::ceil(quantiles[q] * summary.count_))
+        {
+            *values[q++] = value_of(i);
+        }
+
+        summary.max_ = value_of(i);
+    }
+
+    return summary;
+}
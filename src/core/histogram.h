@@ -0,0 +1,163 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/atomic.hpp>
+
+#include "core/thread_registry.h"
+
+///
+/// @brief This namespace is used by all core classes.
+///
+namespace core {
+
+///
+/// @brief This class records the distribution of a value, such as a latency
+/// in nanoseconds, in log-linear buckets with a relative error below 1%.
+///
+/// Every thread records into its own set of buckets, without locks or atomic
+/// read-modify-write operations. The sets are merged when the distribution is
+/// read.
+///
+class histogram :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines the merged bucket counts.
+    ///
+    typedef std::vector<uint64_t> counts;
+
+    ///
+    /// @brief This structure holds a summary of the distribution.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of values recorded.
+        ///
+        uint64_t count_;
+
+        ///
+        /// @brief Holds the median.
+        ///
+        uint64_t p50_;
+
+        ///
+        /// @brief Holds the 99th percentile.
+        ///
+        uint64_t p99_;
+
+        ///
+        /// @brief Holds the 99.9th percentile.
+        ///
+        uint64_t p999_;
+
+        ///
+        /// @brief Holds the largest value recorded.
+        ///
+        uint64_t max_;
+
+    } info;
+
+    ///
+    /// @brief Constructor.
+    ///
+    histogram();
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~histogram();
+
+    ///
+    /// @brief Records a value. Values above 2^40 are recorded as 2^40.
+    ///
+    /// @param value The value.
+    ///
+    void record(
+            uint64_t value);
+
+    ///
+    /// @brief Adds the counts of every thread to a merged set.
+    ///
+    /// @param merged The merged counts. It is resized if it is empty.
+    ///
+    void merge(
+            counts& merged);
+
+    ///
+    /// @brief Gets a summary of the distribution recorded so far.
+    ///
+    /// @return The summary.
+    ///
+    info get_info();
+
+    ///
+    /// @brief Summarizes merged counts.
+    ///
+    /// @param merged The counts, as filled by merge().
+    ///
+    /// @return The summary.
+    ///
+    static info summarize(
+            const counts& merged);
+
+protected:
+
+    ///
+    /// @brief Defines the buckets of one thread. They are only written by
+    /// their thread and read by merge().
+    ///
+    typedef boost::scoped_array<boost::atomic<uint64_t> > buckets;
+
+    ///
+    /// @brief Gets the buckets of the calling thread, creating them on the
+    /// first call.
+    ///
+    /// @return The buckets of the calling thread.
+    ///
+    boost::atomic<uint64_t>* get_buckets();
+
+    ///
+    /// @brief Maps a value to its bucket.
+    ///
+    static size_t index_of(
+            uint64_t value);
+
+    ///
+    /// @brief Maps a bucket to the highest value it holds.
+    ///
+    static uint64_t value_of(
+            size_t index);
+
+    ///
+    /// @brief Holds the buckets of the calling thread.
+    ///
+    thread_registry registry_;
+
+    ///
+    /// @brief Holds the buckets of every thread that recorded a value.
+    ///
+    std::vector<boost::shared_ptr<buckets> > thread_buckets_;
+
+    ///
+    /// @brief Mutex used to synchronize the creation and the merge of the
+    /// buckets.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace core
@@ -0,0 +1,261 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <algorithm>
+#include <cctype>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+
+#include "core/message_dumper.h"
+using namespace core;
+
+namespace {
+
+///
+/// @brief This structure holds the lookup tables used by the formatter.
+///
+struct dump_tables
+{
+    ///
+    /// @brief Constructor. Fills the tables.
+    ///
+    dump_tables()
+    {
+        static const char DIGITS[] = "0123456789abcdef";
+
+        for (int i = 0; i < 256; ++i)
+        {
+            hex_[i][0] = DIGITS[i >> 4];
+            hex_[i][1] = DIGITS[i & 0xf];
+            ascii_[i] = std::isgraph(i) ? static_cast<char>(i) : '.';
+        }
+    }
+
+    ///
+    /// @brief Holds the two hexadecimal digits of every byte.
+    ///
+    char hex_[256][2];
+
+    ///
+    /// @brief Holds the ASCII column character of every byte.
+    ///
+    char ascii_[256];
+};
+
+const dump_tables TABLES;
+
+} // namespace
+
+message_dumper::message_dumper(
+        size_t capacity) :
+    logger_(boost::log::keywords::channel = "core.message_dumper"),
+    enqueue_pos_(0),
+    dequeue_pos_(0),
+    dumped_(0),
+    dropped_(0),
+    stopping_(false)
+{
+    size_t size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+
+    slots_.reset(new slot[size]);
+    mask_ = size - 1;
+
+    for (size_t i = 0; i < size; ++i)
+        slots_[i].sequence_.store(i, boost::memory_order_relaxed);
+
+    LOG_DEBUG() << "ring capacity=[" << size << "]";
+
+    thread_ = boost::thread(boost::bind(&message_dumper::run, this));
+}
+
+message_dumper::~message_dumper()
+{
+    stop();
+}
+
+bool message_dumper::dump(
+        const channel_ptr& channel,
+        format dump_format,
+        const uint8_t* buffer,
+        size_t size)
+{
+    size_t pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    slot* s;
+
+    for (;;)
+    {
+        s = &slots_[pos & mask_];
+
+        size_t sequence = s->sequence_.load(boost::memory_order_acquire);
+        intptr_t diff =
+                static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+        if (diff == 0)
+        {
+            if (enqueue_pos_.compare_exchange_weak(
+                        pos, pos + 1, boost::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            dropped_.fetch_add(1, boost::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            pos = enqueue_pos_.load(boost::memory_order_relaxed);
+        }
+    }
+
+    s->channel_ = channel;
+    s->format_ = dump_format;
+    s->bytes_.assign(buffer, buffer + size);
+    s->sequence_.store(pos + 1, boost::memory_order_release);
+
+    return true;
+}
+
+void message_dumper::stop()
+{
+    stopping_.store(true, boost::memory_order_release);
+
+    if (thread_.joinable())
+        thread_.join();
+}
+
+message_dumper::info message_dumper::get_info()
+{
+    info dumper_info;
+
+    dumper_info.dumped_ = dumped_.load(boost::memory_order_relaxed);
+    dumper_info.dropped_ = dropped_.load(boost::memory_order_relaxed);
+
+    return dumper_info;
+}
+
+void message_dumper::format_hex(
+        const uint8_t* buffer,
+        size_t size,
+        std::string& out)
+{
+    // address, hexadecimal and ASCII columns of one line
+    char line[8 + 4 + 16 * 3 + 3 + 16 + 1];
+
+    out.reserve(out.size() + 1 + (size / 16 + 1) * sizeof(line));
+    out += '\n';
+
+    for (size_t offset = 0; offset < size; offset += 16)
+    {
+        const size_t count = std::min<size_t>(16, size - offset);
+        char* p = line;
+
+        for (int shift = 28; shift >= 0; shift -= 4)
+            *p++ = TABLES.hex_[(offset >> shift) & 0xf][1];
+
+        for (int i = 0; i < 4; ++i)
+            *p++ = ' ';
+
+        for (size_t i = 0; i < 16; ++i)
+        {
+            if (i < count)
+            {
+                *p++ = TABLES.hex_[buffer[offset + i]][0];
+                *p++ = TABLES.hex_[buffer[offset + i]][1];
+            }
+            else
+            {
+                *p++ = ' ';
+                *p++ = ' ';
+            }
+
+            *p++ = ' ';
+        }
+
+        for (int i = 0; i < 3; ++i)
+            *p++ = ' ';
+
+        for (size_t i = 0; i < count; ++i)
+            *p++ = TABLES.ascii_[buffer[offset + i]];
+
+        if (count == 16)
+            *p++ = '\n';
+
+        out.append(line, p);
+    }
+}
+
+void message_dumper::run()
+{
+    LOG_DEBUG() << "started";
+
+    while (!stopping_.load(boost::memory_order_acquire))
+    {
+        if (!process_one())
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+    }
+
+    while (process_one())
+        ;
+
+    LOG_DEBUG() << "stopped";
+}
+
+bool message_dumper::process_one()
+{
+    size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    slot* s;
+
+    for (;;)
+    {
+        s = &slots_[pos & mask_];
+
+        size_t sequence = s->sequence_.load(boost::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) -
+                static_cast<intptr_t>(pos + 1);
+
+        if (diff == 0)
+        {
+            if (dequeue_pos_.compare_exchange_weak(
+                        pos, pos + 1, boost::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = dequeue_pos_.load(boost::memory_order_relaxed);
+        }
+    }
+
+    text_.clear();
+
+    if (s->format_ == hex)
+    {
+        format_hex(s->bytes_.data(), s->bytes_.size(), text_);
+    }
+    else
+    {
+        text_ += "message=[";
+        text_.append(s->bytes_.begin(), s->bytes_.end());
+        text_ += ']';
+    }
+
+    BOOST_LOG_CHANNEL_SEV(logger_, *s->channel_, boost::log::trivial::debug)
+            << text_;
+
+    s->channel_.reset();
+    s->sequence_.store(pos + mask_ + 1, boost::memory_order_release);
+
+    dumped_.fetch_add(1, boost::memory_order_relaxed);
+
+    return true;
+}
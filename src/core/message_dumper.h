@@ -0,0 +1,225 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "core/log.h"
+
+///
+/// @brief This namespace is used by all core classes.
+///
+namespace core {
+
+///
+/// @brief This class formats and logs message dumps on a dedicated thread.
+///
+/// The io threads copy the messages into a bounded lock-free ring and return
+/// immediately. When the ring is full the message is dropped and counted
+/// instead of slowing down the traffic.
+///
+class message_dumper :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<message_dumper> ptr;
+
+    ///
+    /// @brief Defines a shared_ptr for the channel a dump is logged to.
+    ///
+    typedef boost::shared_ptr<const std::string> channel_ptr;
+
+    ///
+    /// @brief Defines the dump formats.
+    ///
+    typedef enum format_
+    {
+        hex,        ///< Hexadecimal and ASCII columns.
+        ascii       ///< Raw ASCII text.
+    } format;
+
+    ///
+    /// @brief This structure defines counters for collecting statistical
+    /// information.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of messages dumped.
+        ///
+        uint64_t dumped_;
+
+        ///
+        /// @brief Holds the number of messages dropped because the ring was
+        /// full.
+        ///
+        uint64_t dropped_;
+
+    } info;
+
+    ///
+    /// @brief Constructor. Starts the worker thread.
+    ///
+    /// @param capacity The number of messages the ring can hold. It is rounded
+    /// up to a power of two.
+    ///
+    explicit message_dumper(
+            size_t capacity);
+
+    ///
+    /// @brief Destructor. Stops the worker thread.
+    ///
+    virtual ~message_dumper();
+
+    ///
+    /// @brief Queues a message to be dumped. This method never blocks.
+    ///
+    /// @param channel The log channel of the message.
+    /// @param dump_format The dump format.
+    /// @param buffer The message.
+    /// @param size The message size.
+    ///
+    /// @return False if the message was dropped.
+    ///
+    bool dump(
+            const channel_ptr& channel,
+            format dump_format,
+            const uint8_t* buffer,
+            size_t size);
+
+    ///
+    /// @brief Dumps the queued messages and stops the worker thread.
+    ///
+    void stop();
+
+    ///
+    /// @brief Gets statistical information.
+    ///
+    /// @return A copy of the dumper counters.
+    ///
+    info get_info();
+
+    ///
+    /// @brief Appends the hexadecimal representation of a buffer to a
+    /// string, sixteen bytes per line.
+    ///
+    /// @param buffer Buffer that will be formatted.
+    /// @param size Buffer size.
+    /// @param out The string the representation is appended to.
+    ///
+    static void format_hex(
+            const uint8_t* buffer,
+            size_t size,
+            std::string& out);
+
+protected:
+
+    ///
+    /// @brief This structure defines one slot of the ring.
+    ///
+    typedef struct slot_
+    {
+        ///
+        /// @brief Holds the position of the slot in the ring sequence. It
+        /// tells whether the slot is free or holds a message.
+        ///
+        boost::atomic<size_t> sequence_;
+
+        ///
+        /// @brief Holds the log channel of the message.
+        ///
+        channel_ptr channel_;
+
+        ///
+        /// @brief Holds the dump format.
+        ///
+        format format_;
+
+        ///
+        /// @brief Holds a copy of the message. Its capacity is kept between
+        /// uses so the copy does not allocate once the ring is warm.
+        ///
+        std::vector<uint8_t> bytes_;
+
+    } slot;
+
+    ///
+    /// @brief Dequeues and logs the messages until the dumper is stopped.
+    ///
+    void run();
+
+    ///
+    /// @brief Dequeues and logs one message.
+    ///
+    /// @return False if the ring was empty.
+    ///
+    bool process_one();
+
+    ///
+    /// @brief Holds the logger used by the worker thread.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Holds the ring slots.
+    ///
+    boost::scoped_array<slot> slots_;
+
+    ///
+    /// @brief Holds the mask used to map a position to a slot.
+    ///
+    size_t mask_;
+
+    ///
+    /// @brief Holds the next position to be written.
+    ///
+    boost::atomic<size_t> enqueue_pos_;
+
+    ///
+    /// @brief Holds the next position to be read.
+    ///
+    boost::atomic<size_t> dequeue_pos_;
+
+    ///
+    /// @brief Holds the number of messages dumped.
+    ///
+    boost::atomic<uint64_t> dumped_;
+
+    ///
+    /// @brief Holds the number of messages dropped.
+    ///
+    boost::atomic<uint64_t> dropped_;
+
+    ///
+    /// @brief Flag indicating whether the worker thread must stop.
+    ///
+    boost::atomic<bool> stopping_;
+
+    ///
+    /// @brief Holds the scratch string used to format the messages.
+    ///
+    std::string text_;
+
+    ///
+    /// @brief Holds the worker thread.
+    ///
+    boost::thread thread_;
+};
+
+} // namespace core
@@ -0,0 +1,85 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <boost/atomic.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "core/thread_registry.h"
+using namespace core;
+
+namespace {
+
+///
+/// @brief This structure holds a state registered by a thread.
+///
+typedef struct thread_entry_
+{
+    ///
+    /// @brief Holds the state.
+    ///
+    void* state_;
+
+    ///
+    /// @brief Holds the token of the registry, which expires with it.
+    ///
+    boost::weak_ptr<uint64_t> token_;
+
+} thread_entry;
+
+///
+/// @brief Defines the entries of a thread indexed by the registry identifier.
+///
+typedef boost::unordered_map<uint64_t, thread_entry> thread_entry_map;
+
+///
+/// @brief Generates the registry identifiers.
+///
+boost::atomic<uint64_t> next_registry_id(1);
+
+///
+/// @brief Holds the entries of the calling thread.
+///
+thread_local thread_entry_map thread_entries;
+
+} // namespace
+
+thread_registry::thread_registry() :
+    id_(next_registry_id.fetch_add(1, boost::memory_order_relaxed)),
+    token_(boost::make_shared<uint64_t>(id_))
+{
+}
+
+thread_registry::~thread_registry()
+{
+}
+
+void* thread_registry::get() const
+{
+    thread_entry_map::const_iterator it = thread_entries.find(id_);
+
+    return it != thread_entries.end() ? it->second.state_ : NULL;
+}
+
+void thread_registry::set(
+        void* state)
+{
+    // a thread registers once per object, so the full scan is rare
+    for (thread_entry_map::iterator it = thread_entries.begin();
+         it != thread_entries.end();)
+    {
+        if (it->second.token_.expired())
+            it = thread_entries.erase(it);
+        else
+            ++it;
+    }
+
+    thread_entry& entry = thread_entries[id_];
+
+    entry.state_ = state;
+    entry.token_ = token_;
+}
@@ -0,0 +1,74 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+///
+/// @brief This namespace is used by all core classes.
+///
+namespace core {
+
+///
+/// @brief This class finds the state an object keeps for the calling thread,
+/// such as the free lists of a pool, without locks.
+///
+/// Every thread has a table of the states it registered, indexed by the
+/// identifier of their registry. The identifiers are never reused, so the
+/// entry of a registry destroyed meanwhile is never matched, and it is
+/// dropped the next time its thread registers a state. The states are owned
+/// by the object, not by the registry.
+///
+class thread_registry :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Constructor.
+    ///
+    thread_registry();
+
+    ///
+    /// @brief Destructor. The entries of every thread become stale.
+    ///
+    virtual ~thread_registry();
+
+    ///
+    /// @brief Gets the state registered by the calling thread.
+    ///
+    /// @return The state, or NULL if the thread registered none.
+    ///
+    void* get() const;
+
+    ///
+    /// @brief Registers the state of the calling thread, dropping the stale
+    /// entries of the thread.
+    ///
+    /// @param state The state, kept by the caller while the registry lives.
+    ///
+    void set(
+            void* state);
+
+protected:
+
+    ///
+    /// @brief Holds the unique identifier of this registry.
+    ///
+    uint64_t id_;
+
+    ///
+    /// @brief Holds a token the entries of every thread watch, so they are
+    /// known to be stale once the registry is destroyed.
+    ///
+    boost::shared_ptr<uint64_t> token_;
+};
+
+} // namespace core
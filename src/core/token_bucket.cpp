@@ -0,0 +1,69 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/thread/lock_guard.hpp>
+
+#include "core/token_bucket.h"
+using namespace core;
+
+token_bucket::token_bucket(
+        uint64_t rate,
+        uint64_t burst) :
+    rate_(rate),
+    burst_(burst),
+    tokens_(static_cast<double>(burst)),
+    last_(boost::chrono::steady_clock::now())
+{
+    if (!rate_)
+        throw std::invalid_argument("invalid rate 0");
+}
+
+token_bucket::~token_bucket()
+{
+}
+
+void token_bucket::refill()
+{
+    const boost::chrono::steady_clock::time_point now =
+            boost::chrono::steady_clock::now();
+    const double elapsed =
+            boost::chrono::duration<double>(now - last_).count();
+
+    last_ = now;
+    tokens_ = std::min(tokens_ + elapsed * rate_,
+                       static_cast<double>(burst_));
+}
+
+uint64_t token_bucket::get_delay()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    refill();
+
+    if (tokens_ >= 0)
+        return 0;
+
+    // rounded up, so the debt is paid when the wait is over
+    return static_cast<uint64_t>(-tokens_ * 1e6 / rate_) + 1;
+}
+
+void token_bucket::consume(
+        uint64_t bytes)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    refill();
+
+    tokens_ -= static_cast<double>(bytes);
+}
+
+uint64_t token_bucket::get_burst() const
+{
+    return burst_;
+}
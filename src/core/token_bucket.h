@@ -0,0 +1,112 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+
+///
+/// @brief This namespace is used by all core classes.
+///
+namespace core {
+
+///
+/// @brief This class limits the rate of a flow of bytes.
+///
+/// The bucket fills at the rate, up to the burst size, and every byte taken
+/// drains one token. The bytes are taken after they were transferred, so the
+/// bucket may go into debt, and the next transfer must wait until the debt is
+/// paid. The average rate is kept no matter how large the transfers are.
+///
+class token_bucket :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<token_bucket> ptr;
+
+    ///
+    /// @brief Constructor. The bucket starts full.
+    ///
+    /// @param rate The rate in bytes per second. It must not be 0.
+    /// @param burst The maximum number of tokens kept.
+    ///
+    token_bucket(
+            uint64_t rate,
+            uint64_t burst);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~token_bucket();
+
+    ///
+    /// @brief Gets how long to wait before the next transfer. It is safe to
+    /// call this method from any thread.
+    ///
+    /// @return The period of time in microseconds (0 - no wait).
+    ///
+    uint64_t get_delay();
+
+    ///
+    /// @brief Takes the tokens of a transfer. It is safe to call this method
+    /// from any thread.
+    ///
+    /// @param bytes The amount of bytes transferred.
+    ///
+    void consume(
+            uint64_t bytes);
+
+    ///
+    /// @brief Gets the maximum number of tokens kept.
+    ///
+    /// @return The burst size in bytes.
+    ///
+    uint64_t get_burst() const;
+
+protected:
+
+    ///
+    /// @brief Adds the tokens earned since the last refill. Must be called
+    /// with the mutex locked.
+    ///
+    void refill();
+
+    ///
+    /// @brief Holds the rate in bytes per second.
+    ///
+    uint64_t rate_;
+
+    ///
+    /// @brief Holds the maximum number of tokens kept.
+    ///
+    uint64_t burst_;
+
+    ///
+    /// @brief Holds the tokens, negative while in debt.
+    ///
+    double tokens_;
+
+    ///
+    /// @brief Holds the time of the last refill.
+    ///
+    boost::chrono::steady_clock::time_point last_;
+
+    ///
+    /// @brief Mutex used to synchronize the access to the tokens.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace core
@@ -9,8 +9,11 @@
 #include <sstream>
 #include <cstdlib>
 #include <cstdint>
+#include <vector>
+#include <stdexcept>
 
 #include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
@@ -47,6 +50,11 @@ void add_options(
              po::value<std::string>()->default_value("none"),
              "enable message dump of messages (ascii|hex|none)");
 
+    desc.add_options()
+            ("dump-queue-size",
+             po::value<size_t>()->default_value(4096),
+             "messages waiting to be dumped above which they are dropped");
+
     desc.add_options()
             ("client-delay",
              po::value<uint64_t>()->default_value(0),
@@ -57,11 +65,158 @@ void add_options(
              po::value<uint64_t>()->default_value(0),
              "server delay (0 - disabled)");
 
+    desc.add_options()
+            ("client-rate",
+             po::value<uint64_t>()->default_value(0),
+             "client rate limit per session in bytes/s (0 - disabled)");
+
+    desc.add_options()
+            ("client-burst",
+             po::value<uint64_t>()->default_value(65536),
+             "client burst size per session in bytes");
+
+    desc.add_options()
+            ("server-rate",
+             po::value<uint64_t>()->default_value(0),
+             "server rate limit per session in bytes/s (0 - disabled)");
+
+    desc.add_options()
+            ("server-burst",
+             po::value<uint64_t>()->default_value(65536),
+             "server burst size per session in bytes");
+
+    desc.add_options()
+            ("aggregate-client-rate",
+             po::value<uint64_t>()->default_value(0),
+             "client rate limit of all sessions in bytes/s (0 - disabled)");
+
+    desc.add_options()
+            ("aggregate-client-burst",
+             po::value<uint64_t>()->default_value(65536),
+             "client burst size of all sessions in bytes");
+
+    desc.add_options()
+            ("aggregate-server-rate",
+             po::value<uint64_t>()->default_value(0),
+             "server rate limit of all sessions in bytes/s (0 - disabled)");
+
+    desc.add_options()
+            ("aggregate-server-burst",
+             po::value<uint64_t>()->default_value(65536),
+             "server burst size of all sessions in bytes");
+
     desc.add_options()
             ("timeout",
              po::value<uint64_t>()->default_value(0),
              "stop the session whenever a timeout occurs (0 - disabled)");
 
+    desc.add_options()
+            ("timeout-tick",
+             po::value<uint64_t>()->default_value(100000),
+             "period between two checks of the inactive sessions");
+
+    desc.add_options()
+            ("connect-timeout",
+             po::value<uint64_t>()->default_value(10000000),
+             "stop the session if the backend connect takes longer "
+             "(0 - disabled)");
+
+    desc.add_options()
+            ("connect-stagger",
+             po::value<uint64_t>()->default_value(250000),
+             "delay before racing the connect to the next backend endpoint");
+
+    desc.add_options()
+            ("listen-backlog",
+             po::value<uint64_t>()->default_value(0),
+             "size of the queue of connections to accept (0 - system max)");
+
+    desc.add_options()
+            ("accept-count",
+             po::value<uint64_t>()->default_value(4),
+             "number of asynchronous accepts kept pending");
+
+    desc.add_options()
+            ("accept-batch",
+             po::value<uint64_t>()->default_value(16),
+             "maximum number of connections accepted per wakeup");
+
+    desc.add_options()
+            ("max-sessions",
+             po::value<uint64_t>()->default_value(0),
+             "maximum number of concurrent sessions (0 - unlimited)");
+
+    desc.add_options()
+            ("max-buffered-bytes",
+             po::value<uint64_t>()->default_value(0),
+             "buffered bytes above which sessions stop reading "
+             "(0 - unlimited)");
+
+    desc.add_options()
+            ("zero-copy",
+             po::value<bool>()->default_value(true),
+             "relay with splice when there is no dump and no delay (0|1)");
+
+    desc.add_options()
+            ("io-uring",
+             po::value<bool>()->default_value(false),
+             "relay through io_uring instead of splice when supported (0|1)");
+
+    desc.add_options()
+            ("io-uring-entries",
+             po::value<unsigned>()->default_value(1024),
+             "submission queue entries of the io_uring relay");
+
+    desc.add_options()
+            ("io-uring-buffers",
+             po::value<unsigned>()->default_value(1024),
+             "buffers of buffer-size bytes registered by the io_uring relay");
+
+    desc.add_options()
+            ("capture-file",
+             po::value<std::string>()->default_value(""),
+             "record the traffic to pcapng files based on this path");
+
+    desc.add_options()
+            ("capture-file-size",
+             po::value<uint64_t>()->default_value(67108864),
+             "capture file size above which a new file is started (0 - off)");
+
+    desc.add_options()
+            ("upstream-pool-size",
+             po::value<uint64_t>()->default_value(0),
+             "connections to the destination kept open ahead (0 - disabled)");
+
+    desc.add_options()
+            ("upstream-pool-max-idle",
+             po::value<uint64_t>()->default_value(30000000),
+             "pooled connection idle time before it is replaced (0 - never)");
+
+    desc.add_options()
+            ("resolve-ttl",
+             po::value<uint64_t>()->default_value(30000000),
+             "time the destination endpoints are cached (0 - disabled)");
+
+    desc.add_options()
+            ("metrics-host",
+             po::value<std::string>()->default_value("localhost"),
+             "address of the metrics endpoint");
+
+    desc.add_options()
+            ("metrics-port",
+             po::value<std::string>()->default_value(""),
+             "port of the metrics endpoint (empty - disabled)");
+
+    desc.add_options()
+            ("threads,t",
+             po::value<unsigned>()->default_value(1),
+             "number of threads used to run the proxy");
+
+    desc.add_options()
+            ("sharded",
+             po::value<bool>()->default_value(false),
+             "give every thread its own io_service and acceptor (0|1)");
+
     desc.add_options()
             ("name",
              po::value<std::string>()->default_value("unnamed"),
@@ -70,7 +225,32 @@ void add_options(
     desc.add_options()
             ("buffer-size,b",
              po::value<size_t>()->default_value(8192),
-             "buffer size");
+             "initial read buffer size");
+
+    desc.add_options()
+            ("buffer-min-size",
+             po::value<size_t>()->default_value(1024),
+             "size below which the read buffers never shrink");
+
+    desc.add_options()
+            ("buffer-max-size",
+             po::value<size_t>()->default_value(65536),
+             "size above which the read buffers never grow");
+
+    desc.add_options()
+            ("buffer-pool-size",
+             po::value<size_t>()->default_value(256),
+             "maximum number of idle buffers kept by the buffer pool");
+
+    desc.add_options()
+            ("high-watermark",
+             po::value<uint64_t>()->default_value(262144),
+             "pending bytes per direction above which reads are paused");
+
+    desc.add_options()
+            ("low-watermark",
+             po::value<uint64_t>()->default_value(65536),
+             "pending bytes per direction below which reads are resumed");
 
     desc.add_options()
             ("log-settings",
@@ -101,6 +281,59 @@ void add_options(
             ("dport",
              po::value<std::string>()->default_value("http"),
              "destination service name or port");
+
+    desc.add_options()
+            ("backend",
+             po::value<std::vector<std::string> >()->composing(),
+             "backend as host:port[/weight], replaces dhost and dport "
+             "(repeatable)");
+
+    desc.add_options()
+            ("balance",
+             po::value<std::string>()->default_value("round-robin"),
+             "backend selection (round-robin|least-sessions|consistent-hash)");
+}
+
+///
+/// @brief This function parses a backend given as host:port[/weight]. An
+/// IPv6 address must be enclosed in brackets.
+///
+/// @param text The backend.
+///
+/// @return The backend configuration.
+///
+net::tcp_proxy::backend_config parse_backend(
+        const std::string& text)
+{
+    net::tcp_proxy::backend_config backend;
+    std::string address = text;
+
+    backend.weight_ = 1;
+
+    const size_t slash = address.rfind('/');
+
+    if (slash != std::string::npos)
+    {
+        backend.weight_ =
+                boost::lexical_cast<unsigned>(address.substr(slash + 1));
+        address.erase(slash);
+    }
+
+    const size_t colon = address.rfind(':');
+
+    if (colon == std::string::npos || colon + 1 == address.size())
+        throw std::invalid_argument("invalid backend " + text);
+
+    backend.host_ = address.substr(0, colon);
+    backend.port_ = address.substr(colon + 1);
+
+    if (backend.host_.size() > 1 && backend.host_[0] == '[' &&
+            backend.host_[backend.host_.size() - 1] == ']')
+    {
+        backend.host_ = backend.host_.substr(1, backend.host_.size() - 2);
+    }
+
+    return backend;
 }
 
 int main(int argc, char* argv[])
@@ -164,13 +397,73 @@ int main(int argc, char* argv[])
             config.sport_ = vm["sport"].as<std::string>();
             config.dport_ = vm["dport"].as<std::string>();
             config.buffer_size_ = vm["buffer-size"].as<size_t>();
+            config.buffer_min_size_ = vm["buffer-min-size"].as<size_t>();
+            config.buffer_max_size_ = vm["buffer-max-size"].as<size_t>();
+            config.buffer_pool_size_ = vm["buffer-pool-size"].as<size_t>();
+            config.high_watermark_ = vm["high-watermark"].as<uint64_t>();
+            config.low_watermark_ = vm["low-watermark"].as<uint64_t>();
             config.message_dump_ = vm["message-dump"].as<std::string>();
             config.client_delay_ = vm["client-delay"].as<uint64_t>();
             config.server_delay_ = vm["server-delay"].as<uint64_t>();
+            config.client_rate_ = vm["client-rate"].as<uint64_t>();
+            config.client_burst_ = vm["client-burst"].as<uint64_t>();
+            config.server_rate_ = vm["server-rate"].as<uint64_t>();
+            config.server_burst_ = vm["server-burst"].as<uint64_t>();
+            config.aggregate_client_rate_ =
+                    vm["aggregate-client-rate"].as<uint64_t>();
+            config.aggregate_client_burst_ =
+                    vm["aggregate-client-burst"].as<uint64_t>();
+            config.aggregate_server_rate_ =
+                    vm["aggregate-server-rate"].as<uint64_t>();
+            config.aggregate_server_burst_ =
+                    vm["aggregate-server-burst"].as<uint64_t>();
             config.timeout_ = vm["timeout"].as<uint64_t>();
+            config.timeout_tick_ = vm["timeout-tick"].as<uint64_t>();
+            config.connect_timeout_ = vm["connect-timeout"].as<uint64_t>();
+            config.connect_stagger_ = vm["connect-stagger"].as<uint64_t>();
+            config.listen_backlog_ = vm["listen-backlog"].as<uint64_t>();
+            config.accept_count_ = vm["accept-count"].as<uint64_t>();
+            config.accept_batch_ = vm["accept-batch"].as<uint64_t>();
+            config.max_sessions_ = vm["max-sessions"].as<uint64_t>();
+            config.max_buffered_bytes_ =
+                    vm["max-buffered-bytes"].as<uint64_t>();
+            config.zero_copy_ = vm["zero-copy"].as<bool>();
+            config.io_uring_ = vm["io-uring"].as<bool>();
+            config.io_uring_entries_ = vm["io-uring-entries"].as<unsigned>();
+            config.io_uring_buffers_ = vm["io-uring-buffers"].as<unsigned>();
+            config.capture_file_ = vm["capture-file"].as<std::string>();
+            config.capture_file_size_ =
+                    vm["capture-file-size"].as<uint64_t>();
+            config.upstream_pool_size_ =
+                    vm["upstream-pool-size"].as<uint64_t>();
+            config.upstream_pool_max_idle_ =
+                    vm["upstream-pool-max-idle"].as<uint64_t>();
+            config.resolve_ttl_ = vm["resolve-ttl"].as<uint64_t>();
+            config.balance_ = vm["balance"].as<std::string>();
+            config.client_socket_ = net::socket_profile::options();
+            config.upstream_socket_ = net::socket_profile::options();
+
+            if (vm.count("backend"))
+            {
+                const std::vector<std::string>& backends =
+                        vm["backend"].as<std::vector<std::string> >();
+
+                for (size_t i = 0; i < backends.size(); ++i)
+                    config.backends_.push_back(parse_backend(backends[i]));
+            }
+            config.reuse_port_ = false;
+            config.shard_ = 0;
+            config.listener_ = -1;
 
             manager = boost::make_shared<net::proxy_manager>();
-            manager->start(config);
+            manager->enable_metrics(
+                        vm["metrics-host"].as<std::string>(),
+                        vm["metrics-port"].as<std::string>());
+            manager->start(
+                        config,
+                        vm["threads"].as<unsigned>(),
+                        vm["sharded"].as<bool>(),
+                        vm["dump-queue-size"].as<size_t>());
         }
     }
     catch (std::exception& e)
@@ -0,0 +1,105 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "net/admission_budget.h"
+using namespace net;
+
+admission_budget::admission_budget(
+        uint64_t max_sessions,
+        uint64_t max_buffered_bytes,
+        const ptr& parent) :
+    max_sessions_(max_sessions),
+    max_buffered_bytes_(max_buffered_bytes),
+    parent_(parent),
+    sessions_(0),
+    buffered_bytes_(0)
+{
+}
+
+admission_budget::~admission_budget()
+{
+}
+
+void admission_budget::set_limits(
+        uint64_t max_sessions,
+        uint64_t max_buffered_bytes)
+{
+    max_sessions_.store(max_sessions, boost::memory_order_relaxed);
+    max_buffered_bytes_.store(max_buffered_bytes, boost::memory_order_relaxed);
+}
+
+bool admission_budget::try_acquire_session()
+{
+    const uint64_t max_sessions =
+            max_sessions_.load(boost::memory_order_relaxed);
+    const uint64_t sessions =
+            sessions_.fetch_add(1, boost::memory_order_relaxed);
+
+    if (max_sessions && sessions >= max_sessions)
+    {
+        sessions_.fetch_sub(1, boost::memory_order_relaxed);
+        return false;
+    }
+
+    if (parent_ && !parent_->try_acquire_session())
+    {
+        sessions_.fetch_sub(1, boost::memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
+
+void admission_budget::release_session()
+{
+    sessions_.fetch_sub(1, boost::memory_order_relaxed);
+
+    if (parent_)
+        parent_->release_session();
+}
+
+void admission_budget::add_buffered(
+        uint64_t bytes)
+{
+    buffered_bytes_.fetch_add(bytes, boost::memory_order_relaxed);
+
+    if (parent_)
+        parent_->add_buffered(bytes);
+}
+
+void admission_budget::remove_buffered(
+        uint64_t bytes)
+{
+    buffered_bytes_.fetch_sub(bytes, boost::memory_order_relaxed);
+
+    if (parent_)
+        parent_->remove_buffered(bytes);
+}
+
+bool admission_budget::is_buffer_full() const
+{
+    const uint64_t max_buffered_bytes =
+            max_buffered_bytes_.load(boost::memory_order_relaxed);
+
+    if (max_buffered_bytes &&
+        buffered_bytes_.load(boost::memory_order_relaxed) >=
+            max_buffered_bytes)
+    {
+        return true;
+    }
+
+    return parent_ && parent_->is_buffer_full();
+}
+
+uint64_t admission_budget::get_sessions() const
+{
+    return sessions_.load(boost::memory_order_relaxed);
+}
+
+uint64_t admission_budget::get_buffered_bytes() const
+{
+    return buffered_bytes_.load(boost::memory_order_relaxed);
+}
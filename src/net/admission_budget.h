@@ -0,0 +1,150 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class bounds the number of sessions and the amount of bytes
+/// buffered by them.
+///
+/// The budget of a proxy may have the process-wide budget as its parent, and
+/// every session or byte accounted in the former is accounted in the latter
+/// as well. A limit of 0 disables it. The sessions are admitted up to the
+/// limit, while the bytes are only checked before reading, so a budget may be
+/// exceeded by the reads already in progress.
+///
+class admission_budget :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<admission_budget> ptr;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param max_sessions The maximum number of sessions (0 - unlimited).
+    /// @param max_buffered_bytes The amount of buffered bytes above which
+    /// the sessions stop reading (0 - unlimited).
+    /// @param parent The budget that also accounts everything accounted in
+    /// this one (empty - none).
+    ///
+    admission_budget(
+            uint64_t max_sessions,
+            uint64_t max_buffered_bytes,
+            const ptr& parent);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~admission_budget();
+
+    ///
+    /// @brief Changes the limits, keeping the sessions and bytes accounted
+    /// so far. It is safe to call this method from any thread.
+    ///
+    /// @param max_sessions The maximum number of sessions (0 - unlimited).
+    /// @param max_buffered_bytes The amount of buffered bytes above which
+    /// the sessions stop reading (0 - unlimited).
+    ///
+    void set_limits(
+            uint64_t max_sessions,
+            uint64_t max_buffered_bytes);
+
+    ///
+    /// @brief Admits a session if neither this budget nor its parent is at
+    /// the session limit. It is safe to call this method from any thread.
+    ///
+    /// @return True if the session was admitted.
+    ///
+    bool try_acquire_session();
+
+    ///
+    /// @brief Releases a session previously admitted.
+    ///
+    void release_session();
+
+    ///
+    /// @brief Accounts bytes read and not written yet.
+    ///
+    /// @param bytes The amount of bytes.
+    ///
+    void add_buffered(
+            uint64_t bytes);
+
+    ///
+    /// @brief Releases bytes previously accounted.
+    ///
+    /// @param bytes The amount of bytes.
+    ///
+    void remove_buffered(
+            uint64_t bytes);
+
+    ///
+    /// @brief Checks whether this budget or its parent reached the limit of
+    /// buffered bytes.
+    ///
+    /// @return True if the sessions must stop reading.
+    ///
+    bool is_buffer_full() const;
+
+    ///
+    /// @brief Gets the number of sessions admitted.
+    ///
+    /// @return The number of sessions.
+    ///
+    uint64_t get_sessions() const;
+
+    ///
+    /// @brief Gets the amount of buffered bytes.
+    ///
+    /// @return The amount of bytes.
+    ///
+    uint64_t get_buffered_bytes() const;
+
+protected:
+
+    ///
+    /// @brief Holds the maximum number of sessions.
+    ///
+    boost::atomic<uint64_t> max_sessions_;
+
+    ///
+    /// @brief Holds the maximum amount of buffered bytes.
+    ///
+    boost::atomic<uint64_t> max_buffered_bytes_;
+
+    ///
+    /// @brief Holds the parent budget.
+    ///
+    ptr parent_;
+
+    ///
+    /// @brief Holds the number of sessions admitted.
+    ///
+    boost::atomic<uint64_t> sessions_;
+
+    ///
+    /// @brief Holds the amount of buffered bytes.
+    ///
+    boost::atomic<uint64_t> buffered_bytes_;
+};
+
+} // namespace net
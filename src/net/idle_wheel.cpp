@@ -0,0 +1,226 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "net/idle_wheel.h"
+#include "net/tcp_session.h"
+using namespace net;
+
+idle_wheel::idle_wheel(
+        boost::asio::io_service& io_service,
+        const std::string& name,
+        uint64_t tick,
+        uint64_t timeout) :
+    logger_(boost::log::keywords::channel = "net.idle_wheel." + name),
+    strand_(io_service),
+    timer_(io_service),
+    tick_period_(std::max<uint64_t>(tick, 1)),
+    tick_(0),
+    stopping_(false)
+{
+    // the last activity is only known to the tick, so one more tick keeps a
+    // session from being dropped before the whole timeout
+    timeout_ticks_ = (timeout + tick_period_ - 1) / tick_period_ + 1;
+
+    LOG_TRACE() << "ctor";
+}
+
+idle_wheel::~idle_wheel()
+{
+    LOG_TRACE() << "dtor";
+}
+
+void idle_wheel::start()
+{
+    LOG_INFO() << "starting tick=[" << tick_period_ << "] "
+               << "timeout-ticks=[" << timeout_ticks_ << "]";
+
+    timer_.expires_from_now(boost::posix_time::microseconds(tick_period_));
+    start_timer();
+}
+
+void idle_wheel::stop()
+{
+    strand_.dispatch(
+                boost::bind(&idle_wheel::handle_stop, shared_from_this()));
+}
+
+void idle_wheel::handle_stop()
+{
+    if (stopping_)
+        return;
+
+    stopping_ = true;
+
+    boost::system::error_code ignored;
+    timer_.cancel(ignored);
+
+    LOG_DEBUG() << "stopped tick=[" << get_tick() << "]";
+}
+
+uint64_t idle_wheel::get_tick() const
+{
+    return tick_.load(boost::memory_order_relaxed);
+}
+
+bool idle_wheel::is_expired(
+        uint64_t last_activity) const
+{
+    return last_activity + timeout_ticks_ <= get_tick();
+}
+
+idle_wheel::handle idle_wheel::add(
+        const boost::shared_ptr<tcp_session>& session,
+        const boost::atomic<uint64_t>& last_activity)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    entry session_entry;
+    session_entry.session_ = session;
+    session_entry.last_activity_ = &last_activity;
+    session_entry.expiry_ = 0;
+    session_entry.slot_ = &parked_;
+
+    handle entry_handle = parked_.insert(parked_.end(), session_entry);
+
+    link(entry_handle, get_tick() + timeout_ticks_);
+
+    return entry_handle;
+}
+
+void idle_wheel::update(
+        handle entry_handle,
+        uint64_t last_activity)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    link(entry_handle, last_activity + timeout_ticks_);
+}
+
+void idle_wheel::remove(
+        handle entry_handle)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    entry_handle->slot_->erase(entry_handle);
+}
+
+void idle_wheel::start_timer()
+{
+    timer_.async_wait(
+                strand_.wrap(
+                    boost::bind(
+                        &idle_wheel::handle_timer,
+                        shared_from_this(),
+                        boost::asio::placeholders::error)));
+}
+
+void idle_wheel::handle_timer(
+        const boost::system::error_code& error_code)
+{
+    if (error_code || stopping_)
+        return;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        advance();
+    }
+
+    // the sessions are owned and called without the lock, since they update
+    // or remove their entries from their own strands and their destructors
+    BOOST_FOREACH(const boost::weak_ptr<tcp_session>& weak_session, due_)
+    {
+        if (boost::shared_ptr<tcp_session> session = weak_session.lock())
+            session->check_idle();
+    }
+
+    due_.clear();
+
+    // a late tick is caught up by the next ones instead of drifting
+    timer_.expires_at(
+                timer_.expires_at() +
+                boost::posix_time::microseconds(tick_period_));
+    start_timer();
+}
+
+void idle_wheel::advance()
+{
+    const uint64_t tick = get_tick() + 1;
+    tick_.store(tick, boost::memory_order_relaxed);
+
+    // every time a level wraps, the next slot of the upper level is spread
+    // over the lower ones
+    for (size_t level = 1; level < LEVELS; ++level)
+    {
+        if ((tick >> ((level - 1) * SLOT_BITS)) & (SLOTS - 1))
+            break;
+
+        cascade(level);
+    }
+
+    slot& current = slots_[0][tick & (SLOTS - 1)];
+
+    while (!current.empty())
+    {
+        handle entry_handle = current.begin();
+
+        const uint64_t last_activity =
+                entry_handle->last_activity_->load(
+                    boost::memory_order_relaxed);
+
+        if (!is_expired(last_activity))
+        {
+            link(entry_handle, last_activity + timeout_ticks_);
+            continue;
+        }
+
+        parked_.splice(parked_.end(), current, entry_handle);
+        entry_handle->slot_ = &parked_;
+
+        // a session being destroyed meanwhile removes its entry on its own
+        due_.push_back(entry_handle->session_);
+    }
+}
+
+void idle_wheel::cascade(
+        size_t level)
+{
+    slot& upper =
+            slots_[level][(get_tick() >> (level * SLOT_BITS)) & (SLOTS - 1)];
+
+    while (!upper.empty())
+        link(upper.begin(), upper.begin()->expiry_);
+}
+
+void idle_wheel::link(
+        handle entry_handle,
+        uint64_t expiry)
+{
+    const uint64_t tick = get_tick();
+    const uint64_t max_delta = (1ull << (LEVELS * SLOT_BITS)) - 1;
+
+    expiry = std::max(expiry, tick);
+    expiry = std::min(expiry, tick + max_delta);
+
+    const uint64_t delta = expiry - tick;
+
+    size_t level = 0;
+
+    while (level + 1 < LEVELS && delta >> ((level + 1) * SLOT_BITS))
+        ++level;
+
+    slot& target =
+            slots_[level][(expiry >> (level * SLOT_BITS)) & (SLOTS - 1)];
+
+    target.splice(target.end(), *entry_handle->slot_, entry_handle);
+    entry_handle->slot_ = &target;
+    entry_handle->expiry_ = expiry;
+}
@@ -0,0 +1,301 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "core/log.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+class tcp_session;
+
+///
+/// @brief This class drops the idle sessions of a proxy with a hierarchical
+/// timing wheel.
+///
+/// The wheel advances one tick per period. The sessions only record the tick
+/// of their last activity, and each one is checked once per timeout at most:
+/// an entry that expires while its session was active is moved to the tick
+/// of its new deadline, otherwise the session is asked to stop. Adding,
+/// moving and removing an entry costs O(1), whatever the traffic rate.
+///
+/// The time is counted in ticks, so a session is dropped after being idle
+/// for the timeout plus two ticks at most.
+///
+class idle_wheel :
+        public boost::enable_shared_from_this<idle_wheel>
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<idle_wheel> ptr;
+
+    ///
+    /// @brief This structure holds the state of a session in the wheel.
+    ///
+    typedef struct entry_
+    {
+        ///
+        /// @brief Holds the session.
+        ///
+        boost::weak_ptr<tcp_session> session_;
+
+        ///
+        /// @brief Holds the tick of the last activity of the session. It is
+        /// read without owning the session, which removes the entry before
+        /// the tick is destroyed.
+        ///
+        const boost::atomic<uint64_t>* last_activity_;
+
+        ///
+        /// @brief Holds the tick the entry is due.
+        ///
+        uint64_t expiry_;
+
+        ///
+        /// @brief Holds the slot the entry is linked to.
+        ///
+        std::list<entry_>* slot_;
+
+    } entry;
+
+    ///
+    /// @brief Defines a slot, holding the entries due at the same tick or
+    /// range of ticks.
+    ///
+    typedef std::list<entry> slot;
+
+    ///
+    /// @brief Defines the handle of an entry. It is valid until removed.
+    ///
+    typedef slot::iterator handle;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param io_service Reference to io_service.
+    /// @param name The proxy name, used by the logger.
+    /// @param tick The period of time, in microseconds, between two ticks.
+    /// @param timeout The period of time, in microseconds, without activity
+    /// after which a session is dropped.
+    ///
+    idle_wheel(
+            boost::asio::io_service& io_service,
+            const std::string& name,
+            uint64_t tick,
+            uint64_t timeout);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~idle_wheel();
+
+    ///
+    /// @brief Starts ticking.
+    ///
+    void start();
+
+    ///
+    /// @brief Stops ticking. It is safe to call this method from any thread.
+    ///
+    void stop();
+
+    ///
+    /// @brief Gets the current tick. It is safe to call this method from any
+    /// thread, it is meant to be called on every read.
+    ///
+    /// @return The tick.
+    ///
+    uint64_t get_tick() const;
+
+    ///
+    /// @brief Checks whether a session has been idle long enough to be
+    /// dropped.
+    ///
+    /// @param last_activity The tick of the last activity of the session.
+    ///
+    /// @return True if the session has timed out.
+    ///
+    bool is_expired(
+            uint64_t last_activity) const;
+
+    ///
+    /// @brief Adds a session, due one timeout after the current tick. It is
+    /// safe to call this method from any thread.
+    ///
+    /// @param session The session.
+    /// @param last_activity The tick of the last activity of the session,
+    /// which must outlive the entry.
+    ///
+    /// @return The handle of its entry.
+    ///
+    handle add(
+            const boost::shared_ptr<tcp_session>& session,
+            const boost::atomic<uint64_t>& last_activity);
+
+    ///
+    /// @brief Moves an entry to the deadline following the last activity of
+    /// its session. It is safe to call this method from any thread.
+    ///
+    /// @param entry_handle The entry.
+    /// @param last_activity The tick of the last activity of the session.
+    ///
+    void update(
+            handle entry_handle,
+            uint64_t last_activity);
+
+    ///
+    /// @brief Removes an entry. It is safe to call this method from any
+    /// thread.
+    ///
+    /// @param entry_handle The entry.
+    ///
+    void remove(
+            handle entry_handle);
+
+protected:
+
+    ///
+    /// @brief Handles a stop request inside the wheel strand.
+    ///
+    void handle_stop();
+
+    ///
+    /// @brief Arms the timer of the next tick.
+    ///
+    void start_timer();
+
+    ///
+    /// @brief This handler is invoked on every tick.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    void handle_timer(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Advances the wheel one tick, collecting the sessions to be
+    /// checked. It must be called with the mutex locked, and it never owns a
+    /// session, since the last owner removes its entry under the same mutex.
+    ///
+    void advance();
+
+    ///
+    /// @brief Moves the entries of a slot of an upper level to the lower
+    /// ones. It must be called with the mutex locked.
+    ///
+    /// @param level The level.
+    ///
+    void cascade(
+            size_t level);
+
+    ///
+    /// @brief Links an entry to the slot of a tick. A tick already passed is
+    /// linked to the current slot. It must be called with the mutex locked.
+    ///
+    /// @param entry_handle The entry.
+    /// @param expiry The tick.
+    ///
+    void link(
+            handle entry_handle,
+            uint64_t expiry);
+
+    ///
+    /// @brief Defines the number of bits of the slot index of a level.
+    ///
+    static const unsigned SLOT_BITS = 6;
+
+    ///
+    /// @brief Defines the number of slots of a level.
+    ///
+    static const size_t SLOTS = 1 << SLOT_BITS;
+
+    ///
+    /// @brief Defines the number of levels. The last one spans 2^24 ticks,
+    /// longer deadlines are checked earlier and moved again.
+    ///
+    static const size_t LEVELS = 4;
+
+    ///
+    /// @brief Holds the logger responsible for logging events from objects of
+    /// this class.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Strand used to serialize the timer and the stop.
+    ///
+    boost::asio::io_service::strand strand_;
+
+    ///
+    /// @brief Holds the timer of the next tick.
+    ///
+    boost::asio::deadline_timer timer_;
+
+    ///
+    /// @brief Holds the period of time, in microseconds, between two ticks.
+    ///
+    uint64_t tick_period_;
+
+    ///
+    /// @brief Holds the number of ticks without activity after which a
+    /// session is dropped.
+    ///
+    uint64_t timeout_ticks_;
+
+    ///
+    /// @brief Holds the current tick.
+    ///
+    boost::atomic<uint64_t> tick_;
+
+    ///
+    /// @brief Holds the slots of every level.
+    ///
+    slot slots_[LEVELS][SLOTS];
+
+    ///
+    /// @brief Holds the entries whose session is being checked, until the
+    /// session moves or removes them.
+    ///
+    slot parked_;
+
+    ///
+    /// @brief Holds the sessions to be checked after the current tick. It is
+    /// only accessed from the wheel strand.
+    ///
+    std::vector<boost::weak_ptr<tcp_session> > due_;
+
+    ///
+    /// @brief Flag indicating whether the wheel is stopping. It is only
+    /// accessed from the wheel strand.
+    ///
+    bool stopping_;
+
+    ///
+    /// @brief Mutex used to synchronize the access to the slots.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace net
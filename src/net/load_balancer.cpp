@@ -0,0 +1,192 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+
+#include "net/load_balancer.h"
+using namespace net;
+
+namespace {
+
+///
+/// @brief Defines the number of virtual nodes of the hash ring per unit of
+/// weight.
+///
+const unsigned RING_NODES = 160;
+
+} // namespace
+
+load_balancer::load_balancer(
+        const backend_list& backends,
+        policy selection) :
+    backends_(backends),
+    policy_(selection),
+    next_(0)
+{
+    if (backends_.empty())
+        throw std::invalid_argument("no backends");
+
+    // smooth weighted round-robin: every round, each backend earns its
+    // weight and the richest one is picked and pays the total
+    std::vector<int64_t> current(backends_.size(), 0);
+    int64_t total = 0;
+
+    for (size_t i = 0; i < backends_.size(); ++i)
+    {
+        if (!backends_[i]->weight_)
+            throw std::invalid_argument("invalid backend weight 0");
+
+        total += backends_[i]->weight_;
+    }
+
+    for (int64_t n = 0; n < total; ++n)
+    {
+        size_t best = 0;
+
+        for (size_t i = 0; i < backends_.size(); ++i)
+        {
+            current[i] += backends_[i]->weight_;
+
+            if (current[i] > current[best])
+                best = i;
+        }
+
+        current[best] -= total;
+        schedule_.push_back(best);
+    }
+
+    if (policy_ == consistent_hash)
+    {
+        for (size_t i = 0; i < backends_.size(); ++i)
+        {
+            const std::string name =
+                    backends_[i]->host_ + ":" + backends_[i]->port_;
+
+            for (unsigned j = 0; j < RING_NODES * backends_[i]->weight_; ++j)
+            {
+                const std::string node =
+                        name + "#" + boost::lexical_cast<std::string>(j);
+
+                ring_.push_back(
+                            ring_node(
+                                hash(reinterpret_cast<const unsigned char*>(
+                                         node.data()), node.size()),
+                                i));
+            }
+        }
+
+        std::sort(ring_.begin(), ring_.end());
+    }
+}
+
+load_balancer::~load_balancer()
+{
+}
+
+const load_balancer::backend::ptr& load_balancer::select(
+        const boost::asio::ip::address& client)
+{
+    const uint64_t n = next_.fetch_add(1, boost::memory_order_relaxed);
+    size_t index = schedule_[n % schedule_.size()];
+
+    if (policy_ == least_sessions)
+    {
+        // the scan starts at the round-robin pick, so ties are spread
+        size_t best = index;
+        int64_t best_active = backends_[best]->active_sessions_.load(
+                    boost::memory_order_relaxed);
+
+        for (size_t i = 1; i < backends_.size(); ++i)
+        {
+            const size_t candidate = (index + i) % backends_.size();
+            const int64_t active =
+                    backends_[candidate]->active_sessions_.load(
+                        boost::memory_order_relaxed);
+
+            if (active * backends_[best]->weight_ <
+                    best_active * backends_[candidate]->weight_)
+            {
+                best = candidate;
+                best_active = active;
+            }
+        }
+
+        index = best;
+    }
+    else if (policy_ == consistent_hash && !ring_.empty())
+    {
+        uint64_t key;
+
+        if (client.is_v4())
+        {
+            boost::asio::ip::address_v4::bytes_type bytes =
+                    client.to_v4().to_bytes();
+            key = hash(bytes.data(), bytes.size());
+        }
+        else
+        {
+            boost::asio::ip::address_v6::bytes_type bytes =
+                    client.to_v6().to_bytes();
+            key = hash(bytes.data(), bytes.size());
+        }
+
+        std::vector<ring_node>::const_iterator it =
+                std::lower_bound(ring_.begin(), ring_.end(),
+                                 ring_node(key, 0));
+
+        index = (it == ring_.end() ? ring_.front() : *it).second;
+    }
+
+    backends_[index]->sessions_.fetch_add(1, boost::memory_order_relaxed);
+
+    return backends_[index];
+}
+
+const load_balancer::backend_list& load_balancer::get_backends() const
+{
+    return backends_;
+}
+
+load_balancer::policy load_balancer::parse_policy(
+        const std::string& name)
+{
+    if (name == "round-robin")
+        return round_robin;
+
+    if (name == "least-sessions")
+        return least_sessions;
+
+    if (name == "consistent-hash")
+        return consistent_hash;
+
+    throw std::invalid_argument("invalid balance policy " + name);
+}
+
+uint64_t load_balancer::hash(
+        const unsigned char* data,
+        size_t size)
+{
+    // FNV-1a, followed by the MurmurHash3 finalizer to spread the short
+    // keys over the whole ring
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
@@ -0,0 +1,197 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "net/resolver_cache.h"
+#include "net/upstream_pool.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class selects the backend of every session of a proxy.
+///
+/// The backends are selected in weighted round-robin order, by the lowest
+/// ratio of active sessions to weight, or by hashing the client address on
+/// a ring of weighted virtual nodes, so a client sticks to its backend while
+/// the backend list does not change.
+///
+class load_balancer :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<load_balancer> ptr;
+
+    ///
+    /// @brief Defines the selection policies.
+    ///
+    typedef enum policy_
+    {
+        round_robin,        ///< Weighted round-robin.
+        least_sessions,     ///< Fewest active sessions per weight.
+        consistent_hash     ///< Hash of the client address.
+    } policy;
+
+    ///
+    /// @brief This structure holds a backend, its shared connection helpers
+    /// and its counters.
+    ///
+    typedef struct backend_ :
+            private boost::noncopyable
+    {
+        ///
+        /// @brief Defines a shared_ptr for itself.
+        ///
+        typedef boost::shared_ptr<backend_> ptr;
+
+        ///
+        /// @brief Holds the hostname or address.
+        ///
+        std::string host_;
+
+        ///
+        /// @brief Holds the port or service name.
+        ///
+        std::string port_;
+
+        ///
+        /// @brief Holds the relative share of sessions sent to the backend.
+        ///
+        unsigned weight_;
+
+        ///
+        /// @brief Holds the cache of the backend endpoints. It is empty when
+        /// the cache is disabled.
+        ///
+        resolver_cache::ptr resolver_cache_;
+
+        ///
+        /// @brief Holds the pool of connections to the backend. It is empty
+        /// when the pool is disabled.
+        ///
+        upstream_pool::ptr upstream_pool_;
+
+        ///
+        /// @brief Holds the number of sessions not stopped yet.
+        ///
+        boost::atomic<int64_t> active_sessions_;
+
+        ///
+        /// @brief Holds the number of sessions sent to the backend.
+        ///
+        boost::atomic<uint64_t> sessions_;
+
+    } backend;
+
+    ///
+    /// @brief Defines a list of backends.
+    ///
+    typedef std::vector<backend::ptr> backend_list;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param backends The backends. It must not be empty.
+    /// @param selection The selection policy.
+    ///
+    load_balancer(
+            const backend_list& backends,
+            policy selection);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~load_balancer();
+
+    ///
+    /// @brief Selects the backend of a new session. It is safe to call this
+    /// method from any thread.
+    ///
+    /// @param client The address of the client.
+    ///
+    /// @return The backend.
+    ///
+    const backend::ptr& select(
+            const boost::asio::ip::address& client);
+
+    ///
+    /// @brief Gets the backends.
+    ///
+    /// @return The backends.
+    ///
+    const backend_list& get_backends() const;
+
+    ///
+    /// @brief Parses the name of a selection policy.
+    ///
+    /// @param name The name: "round-robin", "least-sessions" or
+    /// "consistent-hash".
+    ///
+    /// @return The policy.
+    ///
+    /// @throw std::invalid_argument If the name is unknown.
+    ///
+    static policy parse_policy(
+            const std::string& name);
+
+protected:
+
+    ///
+    /// @brief Defines a virtual node of the hash ring.
+    ///
+    typedef std::pair<uint64_t, size_t> ring_node;
+
+    ///
+    /// @brief Hashes a sequence of bytes.
+    ///
+    static uint64_t hash(
+            const unsigned char* data,
+            size_t size);
+
+    ///
+    /// @brief Holds the backends.
+    ///
+    backend_list backends_;
+
+    ///
+    /// @brief Holds the selection policy.
+    ///
+    policy policy_;
+
+    ///
+    /// @brief Holds the round-robin order, where every backend appears as
+    /// many times as its weight, spread as evenly as possible.
+    ///
+    std::vector<size_t> schedule_;
+
+    ///
+    /// @brief Holds the hash ring sorted by hash.
+    ///
+    std::vector<ring_node> ring_;
+
+    ///
+    /// @brief Holds the number of selections so far.
+    ///
+    boost::atomic<uint64_t> next_;
+};
+
+} // namespace net
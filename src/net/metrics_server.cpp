@@ -0,0 +1,225 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "net/metrics_server.h"
+using namespace net;
+
+namespace {
+
+///
+/// @brief Defines the period of time, in milliseconds, a connection has to
+/// send its request and read the response.
+///
+const long REQUEST_TIMEOUT_MS = 5000;
+
+}
+
+metrics_server::metrics_server(
+        boost::asio::io_service& io_service,
+        const std::string& host,
+        const std::string& port,
+        const collector& collect) :
+    logger_(boost::log::keywords::channel = "net.metrics_server"),
+    io_service_(io_service),
+    strand_(io_service),
+    acceptor_(io_service),
+    host_(host),
+    port_(port),
+    collect_(collect)
+{
+    LOG_TRACE() << "ctor";
+}
+
+metrics_server::~metrics_server()
+{
+    LOG_TRACE() << "dtor";
+}
+
+void metrics_server::start()
+{
+    boost::asio::ip::tcp::resolver resolver(io_service_);
+    boost::asio::ip::tcp::endpoint endpoint =
+            *resolver.resolve(
+                boost::asio::ip::tcp::resolver::query(host_, port_));
+
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+
+    LOG_INFO() << "listening endpoint=[" << endpoint.address() << ":"
+               << endpoint.port() << "]";
+
+    start_accept();
+}
+
+void metrics_server::stop()
+{
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+}
+
+void metrics_server::start_accept()
+{
+    socket_ptr socket =
+            boost::make_shared<boost::asio::ip::tcp::socket>(io_service_);
+
+    acceptor_.async_accept(
+                *socket,
+                strand_.wrap(
+                    boost::bind(
+                        &metrics_server::handle_accept,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        socket)));
+}
+
+void metrics_server::handle_accept(
+        const boost::system::error_code& error_code,
+        socket_ptr socket)
+{
+    if (error_code)
+    {
+        if (error_code != boost::asio::error::operation_aborted)
+        {
+            LOG_ERROR() << "ec=[" << error_code << "] message=["
+                        << error_code.message() << "]";
+        }
+
+        return;
+    }
+
+    // bounds the size of the request headers
+    streambuf_ptr request = boost::make_shared<boost::asio::streambuf>(4096);
+
+    // a client that never sends its request would hold the socket forever
+    timer_ptr deadline =
+            boost::make_shared<boost::asio::deadline_timer>(io_service_);
+
+    deadline->expires_from_now(
+                boost::posix_time::milliseconds(REQUEST_TIMEOUT_MS));
+    deadline->async_wait(
+                strand_.wrap(
+                    boost::bind(
+                        &metrics_server::handle_timeout,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        socket)));
+
+    boost::asio::async_read_until(
+                *socket,
+                *request,
+                "\r\n\r\n",
+                strand_.wrap(
+                    boost::bind(
+                        &metrics_server::handle_read,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        socket,
+                        request,
+                        deadline)));
+
+    start_accept();
+}
+
+void metrics_server::handle_read(
+        const boost::system::error_code& error_code,
+        socket_ptr socket,
+        streambuf_ptr request,
+        timer_ptr deadline)
+{
+    if (error_code)
+    {
+        LOG_DEBUG() << "ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+
+        boost::system::error_code ignored;
+        deadline->cancel(ignored);
+        return;
+    }
+
+    std::istream in(request.get());
+    std::string method, target;
+
+    in >> method >> target;
+
+    std::ostringstream body;
+    std::string status;
+
+    if (method == "GET" && (target == "/metrics" || target == "/"))
+    {
+        status = "200 OK";
+        collect_(body);
+    }
+    else
+    {
+        status = "404 Not Found";
+        body << "not found\n";
+    }
+
+    LOG_DEBUG() << "request method=[" << method << "] target=[" << target
+                << "] status=[" << status << "]";
+
+    const std::string text = body.str();
+
+    response_ptr response = boost::make_shared<std::string>(
+                "HTTP/1.0 " + status + "\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " +
+                boost::lexical_cast<std::string>(text.size()) + "\r\n"
+                "Connection: close\r\n"
+                "\r\n" + text);
+
+    boost::asio::async_write(
+                *socket,
+                boost::asio::buffer(*response),
+                strand_.wrap(
+                    boost::bind(
+                        &metrics_server::handle_write,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        socket,
+                        response,
+                        deadline)));
+}
+
+void metrics_server::handle_write(
+        const boost::system::error_code& error_code,
+        socket_ptr socket,
+        response_ptr,
+        timer_ptr deadline)
+{
+    if (error_code)
+    {
+        LOG_DEBUG() << "ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+    }
+
+    boost::system::error_code ignored;
+    deadline->cancel(ignored);
+    socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+    socket->close(ignored);
+}
+
+void metrics_server::handle_timeout(
+        const boost::system::error_code& error_code,
+        socket_ptr socket)
+{
+    if (error_code == boost::asio::error::operation_aborted)
+        return;
+
+    LOG_DEBUG() << "request timed out";
+
+    // the pending operation completes with an error and releases the socket
+    boost::system::error_code ignored;
+    socket->close(ignored);
+}
@@ -0,0 +1,193 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <string>
+#include <ostream>
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include "core/log.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class serves the live metrics over HTTP, in the Prometheus
+/// text format, on "GET /metrics". Every request gets its own connection,
+/// which is closed once the response is written.
+///
+class metrics_server :
+        public boost::enable_shared_from_this<metrics_server>
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<metrics_server> ptr;
+
+    ///
+    /// @brief Defines the function that writes the metrics exposition.
+    ///
+    typedef boost::function<void (std::ostream&)> collector;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param io_service Reference to io_service.
+    /// @param host The hostname or address to listen on.
+    /// @param port The port or service name to listen on.
+    /// @param collect The function that writes the metrics.
+    ///
+    metrics_server(
+            boost::asio::io_service& io_service,
+            const std::string& host,
+            const std::string& port,
+            const collector& collect);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~metrics_server();
+
+    ///
+    /// @brief Binds the listening socket and starts accepting requests.
+    /// Throws on error.
+    ///
+    virtual void start();
+
+    ///
+    /// @brief Stops accepting requests.
+    ///
+    virtual void stop();
+
+protected:
+
+    ///
+    /// @brief Defines a shared_ptr for a socket.
+    ///
+    typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+    ///
+    /// @brief Defines a shared_ptr for a request buffer.
+    ///
+    typedef boost::shared_ptr<boost::asio::streambuf> streambuf_ptr;
+
+    ///
+    /// @brief Defines a shared_ptr for a response.
+    ///
+    typedef boost::shared_ptr<std::string> response_ptr;
+
+    ///
+    /// @brief Defines a shared_ptr for the deadline of a connection.
+    ///
+    typedef boost::shared_ptr<boost::asio::deadline_timer> timer_ptr;
+
+    ///
+    /// @brief Starts an asynchronous accept.
+    ///
+    void start_accept();
+
+    ///
+    /// @brief This handler is invoked whenever there is an incoming connection.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// accept operation.
+    /// @param socket The accepted socket.
+    ///
+    void handle_accept(
+            const boost::system::error_code& error_code,
+            socket_ptr socket);
+
+    ///
+    /// @brief This handler is invoked when the request headers were read.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// read operation.
+    /// @param socket The connection.
+    /// @param request The request buffer.
+    /// @param deadline The deadline of the connection.
+    ///
+    void handle_read(
+            const boost::system::error_code& error_code,
+            socket_ptr socket,
+            streambuf_ptr request,
+            timer_ptr deadline);
+
+    ///
+    /// @brief This handler is invoked when the response was written.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// write operation.
+    /// @param socket The connection.
+    /// @param response The response, kept alive until the write completes.
+    /// @param deadline The deadline of the connection.
+    ///
+    void handle_write(
+            const boost::system::error_code& error_code,
+            socket_ptr socket,
+            response_ptr response,
+            timer_ptr deadline);
+
+    ///
+    /// @brief This handler is invoked when a connection took too long to
+    /// send its request or to read the response.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    /// @param socket The connection.
+    ///
+    void handle_timeout(
+            const boost::system::error_code& error_code,
+            socket_ptr socket);
+
+    ///
+    /// @brief Holds the logger responsible for logging events from objects of
+    /// this class.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Holds the io_service reference used to process all asynchronous
+    /// operations.
+    ///
+    boost::asio::io_service& io_service_;
+
+    ///
+    /// @brief Strand used to serialize the handlers of the connections, so
+    /// a deadline never closes a socket in use by another thread.
+    ///
+    boost::asio::io_service::strand strand_;
+
+    ///
+    /// @brief Acceptor used to accept the requests.
+    ///
+    boost::asio::ip::tcp::acceptor acceptor_;
+
+    ///
+    /// @brief Holds the hostname or address to listen on.
+    ///
+    std::string host_;
+
+    ///
+    /// @brief Holds the port or service name to listen on.
+    ///
+    std::string port_;
+
+    ///
+    /// @brief Holds the function that writes the metrics.
+    ///
+    collector collect_;
+};
+
+} // namespace net
@@ -0,0 +1,374 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "net/pcapng_writer.h"
+using namespace net;
+
+namespace {
+
+///
+/// @brief Defines the pcapng block types.
+///
+enum block_type
+{
+    SECTION_HEADER_BLOCK = 0x0a0d0d0a,
+    INTERFACE_DESCRIPTION_BLOCK = 0x00000001,
+    ENHANCED_PACKET_BLOCK = 0x00000006
+};
+
+///
+/// @brief Defines the link type of raw IPv4/IPv6 packets.
+///
+const uint16_t LINKTYPE_RAW = 101;
+
+///
+/// @brief Defines the TCP flags.
+///
+enum tcp_flag
+{
+    TCP_FIN = 0x01,
+    TCP_SYN = 0x02,
+    TCP_PSH = 0x08,
+    TCP_ACK = 0x10
+};
+
+///
+/// @brief Defines the largest payload of a synthesized segment. It keeps the
+/// IPv4 total length and the IPv6 payload length in 16 bits.
+///
+const size_t MAX_SEGMENT = 65535 - 20 - 20;
+
+///
+/// @brief Defines the size of the stdio buffer of every file.
+///
+const size_t FILE_BUFFER_SIZE = 1 << 20;
+
+///
+/// @brief Stores a 16 bits value in network byte order.
+///
+inline uint8_t* put16(uint8_t* p, uint16_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 8);
+    p[1] = static_cast<uint8_t>(value);
+
+    return p + 2;
+}
+
+///
+/// @brief Stores a 32 bits value in network byte order.
+///
+inline uint8_t* put32(uint8_t* p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+
+    return p + 4;
+}
+
+///
+/// @brief Computes the checksum of an IPv4 header.
+///
+uint16_t ip_checksum(const uint8_t* header, size_t size)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < size; i += 2)
+        sum += (header[i] << 8) | header[i + 1];
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return static_cast<uint16_t>(~sum);
+}
+
+} // namespace
+
+pcapng_writer::pcapng_writer(
+        const std::string& file_name,
+        uint64_t file_size) :
+    logger_(boost::log::keywords::channel = "net.pcapng_writer"),
+    file_name_(file_name),
+    file_size_(file_size),
+    file_(NULL),
+    file_buffer_(FILE_BUFFER_SIZE),
+    file_written_(0),
+    ip_id_(0)
+{
+    memset(&info_, 0, sizeof(info_));
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    open_file();
+
+    if (!file_)
+    {
+        throw boost::system::system_error(
+                    boost::system::error_code(
+                        errno, boost::system::system_category()),
+                    "fopen " + file_name);
+    }
+}
+
+pcapng_writer::~pcapng_writer()
+{
+    if (file_)
+        std::fclose(file_);
+}
+
+void pcapng_writer::write_open(
+        flow& connection,
+        uint32_t isn)
+{
+    connection.client_seq_ = isn;
+    connection.server_seq_ = ~isn;
+    connection.open_ = true;
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    write_packet(connection, true, TCP_SYN, NULL, 0);
+    write_packet(connection, false, TCP_SYN | TCP_ACK, NULL, 0);
+    write_packet(connection, true, TCP_ACK, NULL, 0);
+}
+
+void pcapng_writer::write_data(
+        flow& connection,
+        bool from_client,
+        const uint8_t* buffer,
+        size_t size)
+{
+    if (!connection.open_)
+        return;
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    for (size_t offset = 0; offset < size; offset += MAX_SEGMENT)
+    {
+        write_packet(connection, from_client, TCP_PSH | TCP_ACK,
+                     buffer + offset, std::min(MAX_SEGMENT, size - offset));
+    }
+}
+
+void pcapng_writer::write_close(
+        flow& connection)
+{
+    if (!connection.open_)
+        return;
+
+    connection.open_ = false;
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    write_packet(connection, true, TCP_FIN | TCP_ACK, NULL, 0);
+    write_packet(connection, false, TCP_FIN | TCP_ACK, NULL, 0);
+}
+
+void pcapng_writer::flush()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    if (file_)
+        std::fflush(file_);
+}
+
+pcapng_writer::info pcapng_writer::get_info()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    return info_;
+}
+
+void pcapng_writer::open_file()
+{
+    if (file_)
+    {
+        std::fclose(file_);
+        file_ = NULL;
+    }
+
+    boost::filesystem::path path(file_name_);
+    std::string extension = path.extension().string();
+
+    if (extension.empty())
+        extension = ".pcapng";
+
+    path = path.parent_path() /
+            (path.stem().string() + "." +
+             boost::lexical_cast<std::string>(info_.files_) + extension);
+
+    file_ = std::fopen(path.string().c_str(), "wb");
+
+    if (!file_)
+    {
+        LOG_ERROR() << "could not open file=[" << path.string() << "] "
+                    << "message=[" << std::strerror(errno) << "]";
+        return;
+    }
+
+    std::setvbuf(file_, file_buffer_.data(), _IOFBF, file_buffer_.size());
+
+    ++info_.files_;
+    file_written_ = 0;
+
+    LOG_INFO() << "capturing to file=[" << path.string() << "]";
+
+    // section header block with an unknown section length
+    uint32_t section[7] = {
+        SECTION_HEADER_BLOCK, sizeof(section), 0x1a2b3c4d,
+        1, 0xffffffff, 0xffffffff, sizeof(section)
+    };
+
+    // version 1.0, stored as two 16 bits fields in host byte order
+    uint16_t version[2] = { 1, 0 };
+    memcpy(&section[3], version, sizeof(version));
+
+    // interface description block without snapshot limit
+    uint32_t interface[5] = {
+        INTERFACE_DESCRIPTION_BLOCK, sizeof(interface), 0, 0, sizeof(interface)
+    };
+
+    uint16_t link_type[2] = { LINKTYPE_RAW, 0 };
+    memcpy(&interface[2], link_type, sizeof(link_type));
+
+    write(section, sizeof(section));
+    write(interface, sizeof(interface));
+}
+
+void pcapng_writer::write_packet(
+        flow& connection,
+        bool from_client,
+        uint8_t flags,
+        const uint8_t* buffer,
+        size_t size)
+{
+    if (file_size_ && file_written_ >= file_size_)
+        open_file();
+
+    if (!file_)
+    {
+        ++info_.errors_;
+        return;
+    }
+
+    const boost::asio::ip::tcp::endpoint& source =
+            from_client ? connection.client_ : connection.server_;
+    const boost::asio::ip::tcp::endpoint& destination =
+            from_client ? connection.server_ : connection.client_;
+
+    uint32_t& seq = from_client ?
+                connection.client_seq_ : connection.server_seq_;
+    uint32_t ack = from_client ?
+                connection.server_seq_ : connection.client_seq_;
+
+    // IPv6 header (40) + TCP header (20)
+    uint8_t headers[60];
+    uint8_t* p = headers;
+
+    if (source.address().is_v4())
+    {
+        p = put16(p, 0x4500);
+        p = put16(p, static_cast<uint16_t>(20 + 20 + size));
+        p = put16(p, ip_id_++);
+        p = put16(p, 0x4000);
+        *p++ = 64;
+        *p++ = IPPROTO_TCP;
+        p = put16(p, 0);
+
+        boost::asio::ip::address_v4::bytes_type address =
+                source.address().to_v4().to_bytes();
+        p = std::copy(address.begin(), address.end(), p);
+
+        address = destination.address().to_v4().to_bytes();
+        p = std::copy(address.begin(), address.end(), p);
+
+        put16(headers + 10, ip_checksum(headers, 20));
+    }
+    else
+    {
+        p = put32(p, 0x60000000);
+        p = put16(p, static_cast<uint16_t>(20 + size));
+        *p++ = IPPROTO_TCP;
+        *p++ = 64;
+
+        boost::asio::ip::address_v6::bytes_type address =
+                source.address().to_v6().to_bytes();
+        p = std::copy(address.begin(), address.end(), p);
+
+        address = destination.address().to_v6().to_bytes();
+        p = std::copy(address.begin(), address.end(), p);
+    }
+
+    p = put16(p, source.port());
+    p = put16(p, destination.port());
+    p = put32(p, seq);
+    p = put32(p, (flags & TCP_ACK) ? ack : 0);
+    *p++ = 0x50;
+    *p++ = flags;
+    p = put16(p, 0xffff);
+    p = put16(p, 0);
+    p = put16(p, 0);
+
+    const uint32_t header_size = static_cast<uint32_t>(p - headers);
+    const uint32_t captured = header_size + static_cast<uint32_t>(size);
+    const uint32_t padding = (4 - (captured & 3)) & 3;
+
+    const uint64_t timestamp =
+            boost::chrono::duration_cast<boost::chrono::microseconds>(
+                boost::chrono::system_clock::now().time_since_epoch()).count();
+
+    uint32_t block[7] = {
+        ENHANCED_PACKET_BLOCK, 32 + captured + padding, 0,
+        static_cast<uint32_t>(timestamp >> 32),
+        static_cast<uint32_t>(timestamp), captured, captured
+    };
+
+    static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+
+    if (write(block, sizeof(block)) &&
+            write(headers, header_size) &&
+            write(buffer, size) &&
+            write(zeros, padding) &&
+            write(&block[1], sizeof(block[1])))
+    {
+        ++info_.packets_;
+        info_.bytes_ += size;
+    }
+    else
+    {
+        ++info_.errors_;
+    }
+
+    seq += static_cast<uint32_t>(size);
+
+    if (flags & (TCP_SYN | TCP_FIN))
+        ++seq;
+}
+
+bool pcapng_writer::write(
+        const void* buffer,
+        size_t size)
+{
+    if (!size)
+        return true;
+
+    if (std::fwrite(buffer, 1, size, file_) != size)
+        return false;
+
+    file_written_ += size;
+
+    return true;
+}
@@ -0,0 +1,256 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "core/log.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class writes the proxied traffic to pcapng files as
+/// synthesized TCP/IP packets, so it can be loaded by the usual analysis
+/// tools.
+///
+/// Every session is recorded as the connection between the client and the
+/// proxy: a handshake when the session starts, one segment per chunk read
+/// and a FIN per direction when it stops. The packets use the raw IP link
+/// type and carry no TCP checksum. The files are written through a large
+/// stdio buffer and rotated when they reach the configured size.
+///
+class pcapng_writer :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<pcapng_writer> ptr;
+
+    ///
+    /// @brief This structure holds the state of a recorded connection. It
+    /// belongs to the session and must only be used by one thread at a time.
+    ///
+    typedef struct flow_
+    {
+        ///
+        /// @brief Holds the endpoint of the client.
+        ///
+        boost::asio::ip::tcp::endpoint client_;
+
+        ///
+        /// @brief Holds the endpoint of the proxy the client connected to.
+        ///
+        boost::asio::ip::tcp::endpoint server_;
+
+        ///
+        /// @brief Holds the next sequence number sent by the client.
+        ///
+        uint32_t client_seq_;
+
+        ///
+        /// @brief Holds the next sequence number sent by the proxy.
+        ///
+        uint32_t server_seq_;
+
+        ///
+        /// @brief Flag indicating whether the handshake was written and the
+        /// FINs were not.
+        ///
+        bool open_;
+
+    } flow;
+
+    ///
+    /// @brief This structure defines counters for collecting statistical
+    /// information.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of packets written.
+        ///
+        uint64_t packets_;
+
+        ///
+        /// @brief Holds the number of payload bytes written.
+        ///
+        uint64_t bytes_;
+
+        ///
+        /// @brief Holds the number of files opened.
+        ///
+        uint64_t files_;
+
+        ///
+        /// @brief Holds the number of packets lost by write errors.
+        ///
+        uint64_t errors_;
+
+    } info;
+
+    ///
+    /// @brief Constructor. Opens the first file.
+    ///
+    /// @param file_name The path of the capture. The files are named after
+    /// it with a sequence number before the extension, e.g.
+    /// "http.0.pcapng", "http.1.pcapng".
+    /// @param file_size The size in bytes above which a new file is started
+    /// (0 - disabled).
+    ///
+    pcapng_writer(
+            const std::string& file_name,
+            uint64_t file_size);
+
+    ///
+    /// @brief Destructor. Flushes and closes the current file.
+    ///
+    virtual ~pcapng_writer();
+
+    ///
+    /// @brief Writes the handshake of a connection.
+    ///
+    /// @param connection The connection, with both endpoints set. Its
+    /// sequence numbers are initialized by this call.
+    /// @param isn The initial sequence number of both sides.
+    ///
+    void write_open(
+            flow& connection,
+            uint32_t isn);
+
+    ///
+    /// @brief Writes a chunk of payload, split in as many segments as needed.
+    ///
+    /// @param connection The connection.
+    /// @param from_client Flag indicating the direction of the chunk.
+    /// @param buffer The payload.
+    /// @param size The payload size.
+    ///
+    void write_data(
+            flow& connection,
+            bool from_client,
+            const uint8_t* buffer,
+            size_t size);
+
+    ///
+    /// @brief Writes the FINs of a connection.
+    ///
+    /// @param connection The connection.
+    ///
+    void write_close(
+            flow& connection);
+
+    ///
+    /// @brief Writes the buffered packets to the current file.
+    ///
+    void flush();
+
+    ///
+    /// @brief Gets statistical information.
+    ///
+    /// @return A copy of the writer counters.
+    ///
+    info get_info();
+
+protected:
+
+    ///
+    /// @brief Closes the current file, if any, and opens the next one with
+    /// its section and interface headers. Must be called with mutex_ held.
+    ///
+    void open_file();
+
+    ///
+    /// @brief Writes one packet. Must be called with mutex_ held.
+    ///
+    /// @param connection The connection.
+    /// @param from_client Flag indicating the direction of the packet.
+    /// @param flags The TCP flags.
+    /// @param buffer The payload.
+    /// @param size The payload size. It must fit in one IP packet.
+    ///
+    void write_packet(
+            flow& connection,
+            bool from_client,
+            uint8_t flags,
+            const uint8_t* buffer,
+            size_t size);
+
+    ///
+    /// @brief Appends raw bytes to the current file. Must be called with
+    /// mutex_ held.
+    ///
+    /// @param buffer The bytes.
+    /// @param size The amount of bytes.
+    ///
+    /// @return False on error.
+    ///
+    bool write(
+            const void* buffer,
+            size_t size);
+
+    ///
+    /// @brief Holds the logger responsible for logging events from objects of
+    /// this class.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Holds the path of the capture.
+    ///
+    std::string file_name_;
+
+    ///
+    /// @brief Holds the size above which a new file is started.
+    ///
+    uint64_t file_size_;
+
+    ///
+    /// @brief Holds the current file.
+    ///
+    std::FILE* file_;
+
+    ///
+    /// @brief Holds the stdio buffer of the current file.
+    ///
+    std::vector<char> file_buffer_;
+
+    ///
+    /// @brief Holds the amount of bytes written to the current file.
+    ///
+    uint64_t file_written_;
+
+    ///
+    /// @brief Holds the identification of the next IPv4 packet.
+    ///
+    uint16_t ip_id_;
+
+    ///
+    /// @brief Holds statistical information.
+    ///
+    info info_;
+
+    ///
+    /// @brief Mutex used to serialize the sessions writing to the file.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace net
@@ -4,19 +4,636 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 //
+#include <fstream>
+#include <set>
+#include <sstream>
+
 #include <boost/property_tree/xml_parser.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 #include "net/proxy_manager.h"
 using namespace net;
 
+namespace {
+
+///
+/// @brief This structure holds the counters of all instances of a proxy.
+///
+typedef struct metrics_sample_
+{
+    ///
+    /// @brief Holds the number of connections accepted.
+    ///
+    uint64_t accepts_;
+
+    ///
+    /// @brief Holds the number of sessions not stopped yet.
+    ///
+    uint64_t active_sessions_;
+
+    ///
+    /// @brief Holds the number of failed connections to the destination.
+    ///
+    uint64_t connect_failures_;
+
+    ///
+    /// @brief Holds the number of bytes read from the clients.
+    ///
+    uint64_t tx_bytes_;
+
+    ///
+    /// @brief Holds the number of bytes read from the servers.
+    ///
+    uint64_t rx_bytes_;
+
+    ///
+    /// @brief Holds the number of sessions served by the upstream pool.
+    ///
+    uint64_t upstream_pool_hits_;
+
+    ///
+    /// @brief Holds the number of sessions that found the upstream pool
+    /// empty.
+    ///
+    uint64_t upstream_pool_misses_;
+
+    ///
+    /// @brief Holds the number of connections accepted by the drain loops.
+    ///
+    uint64_t accepts_drained_;
+
+    ///
+    /// @brief Holds the number of accepts that failed.
+    ///
+    uint64_t accept_errors_;
+
+    ///
+    /// @brief Holds the accept queue length last seen by every instance.
+    ///
+    uint64_t accept_queue_length_;
+
+    ///
+    /// @brief Holds how many times the accepts were paused by the budget.
+    ///
+    uint64_t budget_accept_pauses_;
+
+    ///
+    /// @brief Holds how many times the reads were paused by the budget.
+    ///
+    uint64_t budget_read_pauses_;
+
+    ///
+    /// @brief Holds how many times a read waited for a rate limit.
+    ///
+    uint64_t shaping_waits_;
+
+    ///
+    /// @brief Holds the segments retransmitted to the clients.
+    ///
+    uint64_t client_retransmits_;
+
+    ///
+    /// @brief Holds the segments retransmitted to the backends.
+    ///
+    uint64_t upstream_retransmits_;
+
+    ///
+    /// @brief Holds the amount of bytes buffered by the sessions. The budget
+    /// is shared by the instances, so it is read once.
+    ///
+    uint64_t buffered_bytes_;
+
+} metrics_sample;
+
+///
+/// @brief Defines the samples indexed by the proxy name.
+///
+typedef std::map<std::string, metrics_sample> sample_map;
+
+///
+/// @brief This structure holds the counters of a backend of all instances of
+/// a proxy.
+///
+typedef struct backend_sample_
+{
+    ///
+    /// @brief Holds the number of sessions not stopped yet.
+    ///
+    int64_t active_sessions_;
+
+    ///
+    /// @brief Holds the number of sessions sent to the backend.
+    ///
+    uint64_t sessions_;
+
+} backend_sample;
+
+///
+/// @brief Defines the backend samples indexed by the proxy name and the
+/// backend.
+///
+typedef std::map<std::pair<std::string, std::string>, backend_sample>
+    backend_map;
+
+///
+/// @brief This structure holds the latency counts of all instances of a
+/// proxy.
+///
+typedef struct latency_sample_
+{
+    ///
+    /// @brief Holds the relay latency of the client messages.
+    ///
+    core::histogram::counts tx_;
+
+    ///
+    /// @brief Holds the relay latency of the server messages.
+    ///
+    core::histogram::counts rx_;
+
+    ///
+    /// @brief Holds the connect latency.
+    ///
+    core::histogram::counts connect_;
+
+    ///
+    /// @brief Holds the read buffer sizes.
+    ///
+    core::histogram::counts read_buffer_;
+
+    ///
+    /// @brief Holds the write queue depths.
+    ///
+    core::histogram::counts write_queue_;
+
+    ///
+    /// @brief Holds the number of messages per write.
+    ///
+    core::histogram::counts write_gather_;
+
+    ///
+    /// @brief Holds the round-trip times of the client connections.
+    ///
+    core::histogram::counts client_rtt_;
+
+    ///
+    /// @brief Holds the round-trip times of the backend connections.
+    ///
+    core::histogram::counts upstream_rtt_;
+
+    ///
+    /// @brief Holds the congestion windows of the client connections.
+    ///
+    core::histogram::counts client_cwnd_;
+
+    ///
+    /// @brief Holds the congestion windows of the backend connections.
+    ///
+    core::histogram::counts upstream_cwnd_;
+
+} latency_sample;
+
+///
+/// @brief Defines the latency samples indexed by the proxy name.
+///
+typedef std::map<std::string, latency_sample> latency_map;
+
+///
+/// @brief Writes the percentiles or the count of every latency path of every
+/// proxy.
+///
+void write_latency(
+        std::ostream& out,
+        const latency_map& latencies,
+        bool count)
+{
+    const char* paths[] = { "tx", "rx", "connect" };
+    const char* quantiles[] = { "0.5", "0.99", "0.999" };
+
+    BOOST_FOREACH(const latency_map::value_type& v, latencies)
+    {
+        const core::histogram::counts* counts[] = {
+            &v.second.tx_, &v.second.rx_, &v.second.connect_
+        };
+
+        for (size_t i = 0; i < 3; ++i)
+        {
+            core::histogram::info summary =
+                    core::histogram::summarize(*counts[i]);
+
+            const std::string labels = "proxy=\"" + v.first +
+                    "\",path=\"" + paths[i] + "\"";
+
+            if (count)
+            {
+                out << "proxy_latency_count{" << labels << "} "
+                    << summary.count_ << "\n";
+                continue;
+            }
+
+            uint64_t values[] = { summary.p50_, summary.p99_, summary.p999_ };
+
+            for (size_t j = 0; j < 3; ++j)
+            {
+                out << "proxy_latency_seconds{" << labels
+                    << ",quantile=\"" << quantiles[j] << "\"} "
+                    << values[j] / 1e9 << "\n";
+            }
+        }
+    }
+}
+
+///
+/// @brief Writes the median, the 99th percentile and the maximum of a size
+/// distribution of every proxy as a gauge.
+///
+void write_summary(
+        std::ostream& out,
+        const latency_map& latencies,
+        const char* name,
+        const char* help,
+        core::histogram::counts latency_sample::* member)
+{
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " gauge\n";
+
+    BOOST_FOREACH(const latency_map::value_type& v, latencies)
+    {
+        core::histogram::info summary =
+                core::histogram::summarize(v.second.*member);
+
+        out << name << "{proxy=\"" << v.first
+            << "\",quantile=\"0.5\"} " << summary.p50_ << "\n"
+            << name << "{proxy=\"" << v.first
+            << "\",quantile=\"0.99\"} " << summary.p99_ << "\n"
+            << name << "{proxy=\"" << v.first
+            << "\",quantile=\"1\"} " << summary.max_ << "\n";
+    }
+}
+
+///
+/// @brief Reads the host-wide counters of the connections dropped because a
+/// listen queue was full.
+///
+/// @param overflows The number of times a listen queue overflowed.
+/// @param drops The number of SYNs dropped by the listeners.
+///
+/// @return True if the counters are available.
+///
+bool read_listen_overflows(
+        uint64_t& overflows,
+        uint64_t& drops)
+{
+    // TcpExt comes as a line of names followed by a line of values
+    std::ifstream netstat("/proc/net/netstat");
+    std::string names, values;
+
+    while (std::getline(netstat, names) && std::getline(netstat, values))
+    {
+        if (names.compare(0, 7, "TcpExt:"))
+            continue;
+
+        std::istringstream name_stream(names), value_stream(values);
+        std::string name, value;
+        int found = 0;
+
+        while (name_stream >> name && value_stream >> value)
+        {
+            if (name == "ListenOverflows")
+            {
+                overflows = boost::lexical_cast<uint64_t>(value);
+                ++found;
+            }
+            else if (name == "ListenDrops")
+            {
+                drops = boost::lexical_cast<uint64_t>(value);
+                ++found;
+            }
+        }
+
+        return found == 2;
+    }
+
+    return false;
+}
+
+///
+/// @brief Adds the counters of a proxy instance to the samples. An instance
+/// replaced by a reload counts on the same counters as its replacement, so
+/// the counters shared by several instances are only added once.
+///
+/// @param name The proxy name.
+/// @param proxy_ptr The instance.
+/// @param sampled The counters added so far.
+/// @param samples The counter samples.
+/// @param latencies The latency samples.
+/// @param backends The backend samples.
+///
+void add_sample(
+        const std::string& name,
+        const tcp_proxy::ptr& proxy_ptr,
+        std::set<const proxy_metrics*>& sampled,
+        sample_map& samples,
+        latency_map& latencies,
+        backend_map& backends)
+{
+    const bool carried =
+            !sampled.insert(proxy_ptr->get_metrics().get()).second;
+
+    BOOST_FOREACH(const load_balancer::backend::ptr& backend,
+                  proxy_ptr->get_balancer()->get_backends())
+    {
+        backend_sample& backend_counts = backends[
+                std::make_pair(name, backend->host_ + ":" + backend->port_)];
+
+        backend_counts.active_sessions_ +=
+                backend->active_sessions_.load(boost::memory_order_relaxed);
+
+        // the replacement started from the sessions sent by this instance
+        if (!carried)
+        {
+            backend_counts.sessions_ +=
+                    backend->sessions_.load(boost::memory_order_relaxed);
+        }
+    }
+
+    if (carried)
+        return;
+
+    const proxy_metrics& metrics = *proxy_ptr->get_metrics();
+    metrics_sample& sample = samples[name];
+
+    sample.accepts_ +=
+            metrics.accepts_.load(boost::memory_order_relaxed);
+    sample.active_sessions_ +=
+            metrics.active_sessions_.load(boost::memory_order_relaxed);
+    sample.connect_failures_ +=
+            metrics.connect_failures_.load(boost::memory_order_relaxed);
+    sample.tx_bytes_ +=
+            metrics.tx_bytes_.load(boost::memory_order_relaxed);
+    sample.rx_bytes_ +=
+            metrics.rx_bytes_.load(boost::memory_order_relaxed);
+    sample.upstream_pool_hits_ +=
+            metrics.upstream_pool_hits_.load(boost::memory_order_relaxed);
+    sample.upstream_pool_misses_ +=
+            metrics.upstream_pool_misses_.load(boost::memory_order_relaxed);
+    sample.accepts_drained_ +=
+            metrics.accepts_drained_.load(boost::memory_order_relaxed);
+    sample.accept_errors_ +=
+            metrics.accept_errors_.load(boost::memory_order_relaxed);
+    sample.accept_queue_length_ +=
+            metrics.accept_queue_length_.load(boost::memory_order_relaxed);
+    sample.budget_accept_pauses_ +=
+            metrics.budget_accept_pauses_.load(boost::memory_order_relaxed);
+    sample.budget_read_pauses_ +=
+            metrics.budget_read_pauses_.load(boost::memory_order_relaxed);
+    sample.shaping_waits_ +=
+            metrics.shaping_waits_.load(boost::memory_order_relaxed);
+    sample.client_retransmits_ +=
+            metrics.client_tcp_.retransmits_.load(boost::memory_order_relaxed);
+    sample.upstream_retransmits_ +=
+            metrics.upstream_tcp_.retransmits_.load(
+                boost::memory_order_relaxed);
+    sample.buffered_bytes_ =
+            proxy_ptr->get_budget()->get_buffered_bytes();
+
+    latency_sample& latency = latencies[name];
+    proxy_metrics& histograms = *proxy_ptr->get_metrics();
+
+    histograms.tx_latency_.merge(latency.tx_);
+    histograms.rx_latency_.merge(latency.rx_);
+    histograms.connect_latency_.merge(latency.connect_);
+    histograms.read_buffer_size_.merge(latency.read_buffer_);
+    histograms.write_queue_depth_.merge(latency.write_queue_);
+    histograms.write_gather_size_.merge(latency.write_gather_);
+    histograms.client_tcp_.rtt_.merge(latency.client_rtt_);
+    histograms.upstream_tcp_.rtt_.merge(latency.upstream_rtt_);
+    histograms.client_tcp_.cwnd_.merge(latency.client_cwnd_);
+    histograms.upstream_tcp_.cwnd_.merge(latency.upstream_cwnd_);
+}
+
+///
+/// @brief Carries the backend counters of an instance over to the one that
+/// replaces it, matching the backends by endpoint.
+///
+/// @param from The instance replaced.
+/// @param to The replacement, not started yet.
+///
+void carry_backends(
+        const tcp_proxy::ptr& from,
+        const tcp_proxy::ptr& to)
+{
+    BOOST_FOREACH(const load_balancer::backend::ptr& previous,
+                  from->get_balancer()->get_backends())
+    {
+        BOOST_FOREACH(const load_balancer::backend::ptr& backend,
+                      to->get_balancer()->get_backends())
+        {
+            if (backend->host_ == previous->host_ &&
+                backend->port_ == previous->port_)
+            {
+                backend->sessions_.store(
+                            previous->sessions_.load(
+                                boost::memory_order_relaxed),
+                            boost::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+///
+/// @brief Writes one metric family with one line per proxy.
+///
+void write_family(
+        std::ostream& out,
+        const char* name,
+        const char* type,
+        const char* help,
+        const sample_map& samples,
+        uint64_t metrics_sample::* field)
+{
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+
+    BOOST_FOREACH(const sample_map::value_type& v, samples)
+    {
+        out << name << "{proxy=\"" << v.first << "\"} "
+            << v.second.*field << "\n";
+    }
+}
+
+///
+/// @brief Reads the socket options of one side of a proxy. Every option left
+/// out keeps the kernel default.
+///
+/// @param proxy The settings of the proxy.
+/// @param side The side, either client or upstream.
+///
+/// @return The options.
+///
+socket_profile::options read_socket_profile(
+        const boost::property_tree::ptree& proxy,
+        const std::string& side)
+{
+    socket_profile::options options = socket_profile::options();
+
+    boost::optional<const boost::property_tree::ptree&> profile =
+            proxy.get_child_optional("socket-profile." + side);
+
+    if (!profile)
+        return options;
+
+    options.no_delay_ = profile->get("no-delay", false);
+    options.quick_ack_ = profile->get("quick-ack", false);
+    options.cork_ = profile->get("cork", false);
+    options.keep_alive_ = profile->get("keep-alive", false);
+    options.keep_idle_ = profile->get("keep-idle", 0u);
+    options.keep_interval_ = profile->get("keep-interval", 0u);
+    options.keep_count_ = profile->get("keep-count", 0u);
+    options.receive_buffer_ = profile->get("receive-buffer", 0ul);
+    options.send_buffer_ = profile->get("send-buffer", 0ul);
+    options.not_sent_lowat_ = profile->get("not-sent-lowat", 0ul);
+
+    return options;
+}
+
+///
+/// @brief Reads the configuration of a proxy.
+///
+/// @param proxy The settings of the proxy.
+///
+/// @return The configuration.
+///
+tcp_proxy::config read_proxy_config(
+        const boost::property_tree::ptree& proxy)
+{
+    tcp_proxy::config config;
+
+    config.name_ = proxy.get<std::string>("name");
+    config.shost_ = proxy.get("shost", "localhost");
+    config.dhost_ = proxy.get("dhost", "localhost");
+    config.sport_ = proxy.get("sport", "http-alt");
+    config.dport_ = proxy.get("dport", "http");
+    config.client_delay_ = proxy.get("client-delay", 0ul);
+    config.server_delay_ = proxy.get("server-delay", 0ul);
+    config.client_rate_ = proxy.get("client-rate", 0ul);
+    config.client_burst_ = proxy.get("client-burst", 65536ul);
+    config.server_rate_ = proxy.get("server-rate", 0ul);
+    config.server_burst_ = proxy.get("server-burst", 65536ul);
+    config.aggregate_client_rate_ = proxy.get("aggregate-client-rate", 0ul);
+    config.aggregate_client_burst_ =
+            proxy.get("aggregate-client-burst", 65536ul);
+    config.aggregate_server_rate_ = proxy.get("aggregate-server-rate", 0ul);
+    config.aggregate_server_burst_ =
+            proxy.get("aggregate-server-burst", 65536ul);
+    config.buffer_size_ = proxy.get("buffer-size", 8192ul);
+    config.buffer_min_size_ = proxy.get("buffer-min-size", 1024ul);
+    config.buffer_max_size_ = proxy.get("buffer-max-size", 65536ul);
+    config.buffer_pool_size_ = proxy.get("buffer-pool-size", 256ul);
+    config.high_watermark_ = proxy.get("high-watermark", 262144ul);
+    config.low_watermark_ = proxy.get("low-watermark", 65536ul);
+    config.message_dump_ =  proxy.get("message-dump", "none");
+    config.timeout_ =  proxy.get("timeout", 0ul);
+    config.timeout_tick_ = proxy.get("timeout-tick", 100000ul);
+    config.connect_timeout_ = proxy.get("connect-timeout", 10000000ul);
+    config.connect_stagger_ = proxy.get("connect-stagger", 250000ul);
+    config.listen_backlog_ = proxy.get("listen-backlog", 0ul);
+    config.accept_count_ = proxy.get("accept-count", 4ul);
+    config.accept_batch_ = proxy.get("accept-batch", 16ul);
+    config.max_sessions_ = proxy.get("max-sessions", 0ul);
+    config.max_buffered_bytes_ = proxy.get("max-buffered-bytes", 0ul);
+    config.zero_copy_ = proxy.get("zero-copy", true);
+    config.io_uring_ = proxy.get("io-uring", false);
+    config.io_uring_entries_ = proxy.get("io-uring-entries", 1024u);
+    config.io_uring_buffers_ = proxy.get("io-uring-buffers", 1024u);
+    config.capture_file_ = proxy.get("capture-file", "");
+    config.capture_file_size_ = proxy.get("capture-file-size", 67108864ul);
+    config.upstream_pool_size_ = proxy.get("upstream-pool-size", 0ul);
+    config.upstream_pool_max_idle_ =
+            proxy.get("upstream-pool-max-idle", 30000000ul);
+    config.resolve_ttl_ = proxy.get("resolve-ttl", 30000000ul);
+    config.balance_ = proxy.get("balance", "round-robin");
+    config.client_socket_ = read_socket_profile(proxy, "client");
+    config.upstream_socket_ = read_socket_profile(proxy, "upstream");
+
+    boost::optional<const boost::property_tree::ptree&> backends =
+            proxy.get_child_optional("backends");
+
+    if (backends)
+    {
+        BOOST_FOREACH(const boost::property_tree::ptree::value_type& b,
+                      *backends)
+        {
+            tcp_proxy::backend_config backend;
+
+            backend.host_ = b.second.get("host", "localhost");
+            backend.port_ = b.second.get("port", "http");
+            backend.weight_ = b.second.get("weight", 1u);
+
+            config.backends_.push_back(backend);
+        }
+    }
+
+    config.reuse_port_ = false;
+    config.shard_ = 0;
+    config.listener_ = -1;
+
+    return config;
+}
+
+///
+/// @brief Defines the settings of the active proxies by name.
+///
+typedef std::map<std::string, boost::property_tree::ptree> proxy_settings;
+
+///
+/// @brief Gets the settings of the active proxies.
+///
+/// @param proxies The proxies node of the settings.
+///
+/// @return The settings by proxy name.
+///
+proxy_settings get_active_proxies(
+        const boost::property_tree::ptree& proxies)
+{
+    proxy_settings settings;
+
+    BOOST_FOREACH(const boost::property_tree::ptree::value_type& v, proxies)
+    {
+        if (v.second.get("active", 0))
+            settings[v.second.get<std::string>("name")] = v.second;
+    }
+
+    return settings;
+}
+
+///
+/// @brief Gets the listening endpoint of a proxy, as written in its settings.
+///
+/// @param proxy The settings of the proxy.
+///
+/// @return The endpoint, as host:port.
+///
+std::string get_listen_key(
+        const boost::property_tree::ptree& proxy)
+{
+    return proxy.get("shost", "localhost") + ":" +
+            proxy.get("sport", "http-alt");
+}
+
+} // namespace
+
 proxy_manager::proxy_manager() :
     logger_(boost::log::keywords::channel = "net.proxy_manager"),
+    dump_queue_size_(4096),
     signal_set_(io_service_)
 {
     LOG_TRACE() << "ctor";
 
     signal_set_.add(SIGINT);
+    signal_set_.add(SIGHUP);
 
     signal_set_.async_wait(
                 boost::bind(
@@ -34,14 +651,335 @@ proxy_manager::~proxy_manager()
 }
 
 void proxy_manager::create_proxy(
-        const tcp_proxy::config& config)
+        const tcp_proxy::config& proxy_config,
+        const proxy_list& previous,
+        const proxy_list& replaced)
+{
+    tcp_proxy::config config = proxy_config;
+
+    // the shards share the aggregate rate limits as well
+    if (!config.client_shaper_ && config.aggregate_client_rate_)
+    {
+        config.client_shaper_ = boost::make_shared<core::token_bucket>(
+                    config.aggregate_client_rate_,
+                    config.aggregate_client_burst_);
+    }
+
+    if (!config.server_shaper_ && config.aggregate_server_rate_)
+    {
+        config.server_shaper_ = boost::make_shared<core::token_bucket>(
+                    config.aggregate_server_rate_,
+                    config.aggregate_server_burst_);
+    }
+
+    // the sessions still draining and the new ones are bounded together
+    if (!config.budget_ && !replaced.empty())
+    {
+        config.budget_ = replaced.front()->get_budget();
+        config.budget_->set_limits(
+                    config.max_sessions_, config.max_buffered_bytes_);
+    }
+
+    if (!config.budget_)
+    {
+        // the shards share the budget, so the limits apply to the proxy
+        config.budget_ = boost::make_shared<admission_budget>(
+                    config.max_sessions_, config.max_buffered_bytes_, budget_);
+    }
+
+    if (config.message_dump_ == "hex" || config.message_dump_ == "ascii")
+    {
+        if (!message_dumper_)
+        {
+            message_dumper_ = boost::make_shared<core::message_dumper>(
+                        dump_queue_size_);
+        }
+
+        config.message_dumper_ = message_dumper_;
+    }
+
+    if (shards_.empty())
+    {
+        if (!previous.empty())
+            config.listener_ = previous.front()->duplicate_listener();
+
+        if (!replaced.empty())
+            config.metrics_ = replaced.front()->get_metrics();
+
+        tcp_proxy::ptr proxy_ptr =
+                boost::make_shared<tcp_proxy>(
+                    boost::ref(io_service_), config);
+
+        if (!replaced.empty())
+            carry_backends(replaced.front(), proxy_ptr);
+
+        proxies_.insert(std::make_pair(config.name_, proxy_ptr));
+
+        proxy_ptr->start();
+
+        return;
+    }
+
+    for (unsigned i = 0; i < shards_.size(); ++i)
+    {
+        tcp_proxy::config shard_config = config;
+
+        shard_config.reuse_port_ = true;
+        shard_config.shard_ = i;
+
+        if (i < previous.size())
+            shard_config.listener_ = previous[i]->duplicate_listener();
+
+        if (i < replaced.size())
+            shard_config.metrics_ = replaced[i]->get_metrics();
+
+        tcp_proxy::ptr proxy_ptr =
+                boost::make_shared<tcp_proxy>(
+                    boost::ref(*shards_[i]), shard_config);
+
+        if (i < replaced.size())
+            carry_backends(replaced[i], proxy_ptr);
+
+        proxies_.insert(std::make_pair(config.name_, proxy_ptr));
+
+        proxy_ptr->start();
+    }
+}
+
+void proxy_manager::create_shards(
+        unsigned count)
 {
-    tcp_proxy::ptr proxy_ptr =
-            boost::make_shared<tcp_proxy>(boost::ref(io_service_), config);
+    LOG_INFO() << "sharded mode shards=[" << count << "]";
 
-    proxies_[config.name_] = proxy_ptr;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        // every shard is run by a single thread, so asio can skip the
+        // locking it needs for a shared io_service
+        io_service_ptr shard = boost::make_shared<boost::asio::io_service>(1);
 
-    proxy_ptr->start();
+        shards_.push_back(shard);
+        shard_works_.push_back(
+                    boost::make_shared<boost::asio::io_service::work>(
+                        boost::ref(*shard)));
+    }
+}
+
+void proxy_manager::enable_metrics(
+        const std::string& host,
+        const std::string& port)
+{
+    metrics_host_ = host;
+    metrics_port_ = port;
+}
+
+void proxy_manager::write_metrics(
+        std::ostream& out)
+{
+    sample_map samples;
+    latency_map latencies;
+    backend_map backends;
+
+    boost::lock_guard<boost::mutex> lock(proxies_mutex_);
+
+    std::set<const proxy_metrics*> sampled;
+
+    BOOST_FOREACH(proxy_map::value_type& v, proxies_)
+    {
+        add_sample(v.first, v.second, sampled, samples, latencies, backends);
+    }
+
+    // the sessions still draining are counted under the name they had
+    BOOST_FOREACH(draining_map::value_type& v, draining_)
+    {
+        if (tcp_proxy::ptr proxy_ptr = v.second.lock())
+        {
+            add_sample(v.first, proxy_ptr, sampled, samples, latencies,
+                       backends);
+        }
+    }
+
+    write_family(out, "proxy_active_sessions", "gauge",
+                 "Sessions currently open.",
+                 samples, &metrics_sample::active_sessions_);
+
+    write_family(out, "proxy_accepts_total", "counter",
+                 "Connections accepted.",
+                 samples, &metrics_sample::accepts_);
+
+    write_family(out, "proxy_connect_failures_total", "counter",
+                 "Sessions that could not resolve or connect the destination.",
+                 samples, &metrics_sample::connect_failures_);
+
+    write_family(out, "proxy_accepts_drained_total", "counter",
+                 "Connections accepted by the drain loop.",
+                 samples, &metrics_sample::accepts_drained_);
+
+    write_family(out, "proxy_accept_errors_total", "counter",
+                 "Accepts that failed.",
+                 samples, &metrics_sample::accept_errors_);
+
+    write_family(out, "proxy_accept_queue_length", "gauge",
+                 "Connections waiting in the accept queue at the last accept.",
+                 samples, &metrics_sample::accept_queue_length_);
+
+    write_family(out, "proxy_budget_accept_pauses_total", "counter",
+                 "Times the accepts were paused by the session limit.",
+                 samples, &metrics_sample::budget_accept_pauses_);
+
+    write_family(out, "proxy_budget_read_pauses_total", "counter",
+                 "Times a session stopped reading by the buffered bytes limit.",
+                 samples, &metrics_sample::budget_read_pauses_);
+
+    write_family(out, "proxy_shaping_waits_total", "counter",
+                 "Reads that waited for a rate limit.",
+                 samples, &metrics_sample::shaping_waits_);
+
+    write_family(out, "proxy_buffered_bytes", "gauge",
+                 "Bytes read and not written yet.",
+                 samples, &metrics_sample::buffered_bytes_);
+
+    uint64_t overflows = 0;
+    uint64_t drops = 0;
+
+    if (read_listen_overflows(overflows, drops))
+    {
+        out << "# HELP proxy_listen_overflows_total Host-wide listen queue "
+               "overflows.\n"
+            << "# TYPE proxy_listen_overflows_total counter\n"
+            << "proxy_listen_overflows_total " << overflows << "\n"
+            << "# HELP proxy_listen_drops_total Host-wide SYNs dropped by "
+               "the listeners.\n"
+            << "# TYPE proxy_listen_drops_total counter\n"
+            << "proxy_listen_drops_total " << drops << "\n";
+    }
+
+    write_family(out, "proxy_upstream_pool_hits_total", "counter",
+                 "Sessions that took a pre-connected upstream connection.",
+                 samples, &metrics_sample::upstream_pool_hits_);
+
+    write_family(out, "proxy_upstream_pool_misses_total", "counter",
+                 "Sessions that found the upstream pool empty.",
+                 samples, &metrics_sample::upstream_pool_misses_);
+
+    out << "# HELP proxy_bytes_total Bytes relayed, tx from the clients and "
+           "rx from the servers.\n"
+        << "# TYPE proxy_bytes_total counter\n";
+
+    BOOST_FOREACH(const sample_map::value_type& v, samples)
+    {
+        out << "proxy_bytes_total{proxy=\"" << v.first
+            << "\",direction=\"tx\"} " << v.second.tx_bytes_ << "\n"
+            << "proxy_bytes_total{proxy=\"" << v.first
+            << "\",direction=\"rx\"} " << v.second.rx_bytes_ << "\n";
+    }
+
+    out << "# HELP proxy_backend_active_sessions Sessions currently open per "
+           "backend.\n"
+        << "# TYPE proxy_backend_active_sessions gauge\n";
+
+    BOOST_FOREACH(const backend_map::value_type& v, backends)
+    {
+        out << "proxy_backend_active_sessions{proxy=\"" << v.first.first
+            << "\",backend=\"" << v.first.second << "\"} "
+            << v.second.active_sessions_ << "\n";
+    }
+
+    out << "# HELP proxy_backend_sessions_total Sessions sent per backend.\n"
+        << "# TYPE proxy_backend_sessions_total counter\n";
+
+    BOOST_FOREACH(const backend_map::value_type& v, backends)
+    {
+        out << "proxy_backend_sessions_total{proxy=\"" << v.first.first
+            << "\",backend=\"" << v.first.second << "\"} "
+            << v.second.sessions_ << "\n";
+    }
+
+    out << "# HELP proxy_latency_seconds Relay latency (tx, rx) and connect "
+           "latency percentiles.\n"
+        << "# TYPE proxy_latency_seconds gauge\n";
+
+    write_latency(out, latencies, false);
+
+    out << "# HELP proxy_latency_count Latencies recorded.\n"
+        << "# TYPE proxy_latency_count counter\n";
+
+    write_latency(out, latencies, true);
+
+    write_summary(out, latencies, "proxy_read_buffer_bytes",
+                  "Read buffer size percentiles.",
+                  &latency_sample::read_buffer_);
+
+    write_summary(out, latencies, "proxy_write_queue_depth",
+                  "Messages waiting when a write starts.",
+                  &latency_sample::write_queue_);
+
+    write_summary(out, latencies, "proxy_write_gather_messages",
+                  "Messages gathered per write.",
+                  &latency_sample::write_gather_);
+
+    write_family(out, "proxy_client_tcp_retransmits_total", "counter",
+                 "Segments retransmitted to the clients.",
+                 samples, &metrics_sample::client_retransmits_);
+
+    write_family(out, "proxy_upstream_tcp_retransmits_total", "counter",
+                 "Segments retransmitted to the backends.",
+                 samples, &metrics_sample::upstream_retransmits_);
+
+    write_summary(out, latencies, "proxy_client_tcp_rtt_microseconds",
+                  "Round-trip time of the client connections at close.",
+                  &latency_sample::client_rtt_);
+
+    write_summary(out, latencies, "proxy_upstream_tcp_rtt_microseconds",
+                  "Round-trip time of the backend connections at close.",
+                  &latency_sample::upstream_rtt_);
+
+    write_summary(out, latencies, "proxy_client_tcp_cwnd_segments",
+                  "Congestion window of the client connections at close.",
+                  &latency_sample::client_cwnd_);
+
+    write_summary(out, latencies, "proxy_upstream_tcp_cwnd_segments",
+                  "Congestion window of the backend connections at close.",
+                  &latency_sample::upstream_cwnd_);
+}
+
+void proxy_manager::run(
+        unsigned thread_pool_size)
+{
+    if (!metrics_port_.empty())
+    {
+        metrics_server_ = boost::make_shared<metrics_server>(
+                    boost::ref(io_service_),
+                    metrics_host_,
+                    metrics_port_,
+                    boost::bind(&proxy_manager::write_metrics, this, _1));
+
+        metrics_server_->start();
+    }
+
+    if (shards_.empty())
+    {
+        for (unsigned i = 0; i + 1 < thread_pool_size; ++i)
+        {
+            thread_group_.create_thread(
+                        boost::bind(&boost::asio::io_service::run,
+                                    &io_service_));
+        }
+    }
+    else
+    {
+        BOOST_FOREACH(io_service_ptr& shard, shards_)
+        {
+            thread_group_.create_thread(
+                        boost::bind(&boost::asio::io_service::run,
+                                    shard.get()));
+        }
+    }
+
+    LOG_INFO() << "started";
+
+    io_service_.run();
+
+    stop();
 }
 
 void proxy_manager::start(
@@ -54,58 +992,71 @@ void proxy_manager::start(
     LOG_INFO() << "reading settings from file=[" << settings_file << "]";
 
     boost::property_tree::read_xml(settings_file, config_);
+    settings_file_ = settings_file;
 
-    BOOST_FOREACH(
-                boost::property_tree::ptree::value_type& v,
-                config_.get_child(CONFIG_ROOT + ".proxies"))
-    {
-        if (v.second.get("active", 0))
-        {
-            tcp_proxy::config config;
+    unsigned thread_pool_size =
+            config_.get(CONFIG_ROOT + ".thread-pool.size",
+                        boost::thread::hardware_concurrency());
 
-            config.name_ = v.second.get<std::string>("name");
-            config.shost_ = v.second.get("shost", "localhost");
-            config.dhost_ = v.second.get("dhost", "localhost");
-            config.sport_ = v.second.get("sport", "http-alt");
-            config.dport_ = v.second.get("dport", "http");
-            config.client_delay_ = v.second.get("client-delay", 0ul);
-            config.server_delay_ = v.second.get("server-delay", 0ul);
-            config.buffer_size_ = v.second.get("buffer-size", 8192ul);
-            config.message_dump_ =  v.second.get("message-dump", "none");
-            config.timeout_ =  v.second.get("timeout", 0ul);
+    if (!thread_pool_size)
+        thread_pool_size = 1;
 
-            create_proxy(config);
-        }
-    }
+    dump_queue_size_ =
+            config_.get(CONFIG_ROOT + ".logging.dump-queue-size", 4096ul);
 
-    const unsigned thread_pool_size =
-            config_.get("proxy-settings.thread-pool.size",
-                         boost::thread::hardware_concurrency());
+    enable_metrics(
+                config_.get(CONFIG_ROOT + ".metrics.host", "localhost"),
+                config_.get(CONFIG_ROOT + ".metrics.port", ""));
 
-    for (unsigned i = 0; i < thread_pool_size - 1; ++i)
+    const uint64_t max_sessions =
+            config_.get(CONFIG_ROOT + ".limits.max-sessions", 0ul);
+    const uint64_t max_buffered_bytes =
+            config_.get(CONFIG_ROOT + ".limits.max-buffered-bytes", 0ul);
+
+    if (max_sessions || max_buffered_bytes)
     {
-        thread_group_.create_thread(
-                    boost::bind(&boost::asio::io_service::run,
-                                &io_service_));
+        LOG_INFO() << "limits max-sessions=[" << max_sessions << "] "
+                   << "max-buffered-bytes=[" << max_buffered_bytes << "]";
+
+        budget_ = boost::make_shared<admission_budget>(
+                    max_sessions, max_buffered_bytes, admission_budget::ptr());
     }
 
-    LOG_INFO() << "started";
+    if (config_.get(CONFIG_ROOT + ".thread-pool.sharded", 0))
+        create_shards(thread_pool_size);
 
-    io_service_.run();
+    BOOST_FOREACH(
+                boost::property_tree::ptree::value_type& v,
+                config_.get_child(CONFIG_ROOT + ".proxies"))
+    {
+        if (v.second.get("active", 0))
+            create_proxy(read_proxy_config(v.second));
+    }
+
+    run(thread_pool_size);
 }
 
 void proxy_manager::start(
-        const tcp_proxy::config& proxy_config)
+        const tcp_proxy::config& proxy_config,
+        unsigned thread_pool_size,
+        bool sharded,
+        size_t dump_queue_size)
 {
     boost::lock_guard<boost::mutex> lock(mutex_);
 
     LOG_INFO() << "starting";
 
-    create_proxy(proxy_config);
+    if (!thread_pool_size)
+        thread_pool_size = 1;
 
-    LOG_INFO() << "started";
+    dump_queue_size_ = dump_queue_size;
 
-    io_service_.run();
+    if (sharded)
+        create_shards(thread_pool_size);
+
+    create_proxy(proxy_config);
+
+    run(thread_pool_size);
 }
 
 void proxy_manager::stop()
@@ -114,16 +1065,218 @@ void proxy_manager::stop()
 
     io_service_.stop();
 
-    BOOST_FOREACH(proxy_map::value_type& v, proxies_)
+    shard_works_.clear();
+
+    BOOST_FOREACH(io_service_ptr& shard, shards_)
     {
-        v.second->stop();
+        shard->stop();
     }
 
-    proxies_.clear();
+    thread_group_.join_all();
+
+    // no thread is running the io_services anymore, so the stop requests
+    // dispatched by the proxies and sessions are executed right here
+    io_service_.reset();
+
+    BOOST_FOREACH(io_service_ptr& shard, shards_)
+    {
+        shard->reset();
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(proxies_mutex_);
+
+        BOOST_FOREACH(proxy_map::value_type& v, proxies_)
+        {
+            v.second->stop();
+        }
+
+        BOOST_FOREACH(draining_map::value_type& v, draining_)
+        {
+            tcp_proxy::ptr proxy_ptr = v.second.lock();
+
+            if (proxy_ptr)
+                proxy_ptr->stop();
+        }
+    }
+
+    if (metrics_server_)
+    {
+        metrics_server_->stop();
+        metrics_server_.reset();
+    }
+
+    io_service_.poll();
+
+    BOOST_FOREACH(io_service_ptr& shard, shards_)
+    {
+        shard->poll();
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(proxies_mutex_);
+
+        proxies_.clear();
+        draining_.clear();
+    }
+
+    // the sessions are gone, so the dumper can log what is left in its queue
+    if (message_dumper_)
+    {
+        message_dumper_->stop();
+
+        core::message_dumper::info dumper_info = message_dumper_->get_info();
+
+        LOG_INFO() << "message dumper dumps=[" << dumper_info.dumped_ << "] "
+                   << "dropped=[" << dumper_info.dropped_ << "]";
+
+        message_dumper_.reset();
+    }
 
     LOG_INFO() << "stopped";
 }
 
+void proxy_manager::reload()
+{
+    if (settings_file_.empty())
+    {
+        LOG_WARNING() << "reload ignored, there is no settings file";
+        return;
+    }
+
+    LOG_INFO() << "reloading settings from file=[" << settings_file_ << "]";
+
+    boost::property_tree::ptree config;
+    proxy_settings previous;
+    proxy_settings current;
+    std::map<std::string, tcp_proxy::config> proxy_configs;
+
+    // nothing changes unless the whole file is valid
+    try
+    {
+        boost::property_tree::read_xml(settings_file_, config);
+
+        previous = get_active_proxies(
+                    config_.get_child(CONFIG_ROOT + ".proxies"));
+        current = get_active_proxies(
+                    config.get_child(CONFIG_ROOT + ".proxies"));
+
+        BOOST_FOREACH(const proxy_settings::value_type& v, current)
+        {
+            proxy_configs[v.first] = read_proxy_config(v.second);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        LOG_ERROR() << "reload failed what=[" << e.what() << "]";
+        return;
+    }
+
+    static const char* const RESTART_SECTIONS[] =
+    {
+        "thread-pool", "logging", "limits", "metrics"
+    };
+
+    BOOST_FOREACH(const char* section, RESTART_SECTIONS)
+    {
+        const std::string path = CONFIG_ROOT + "." + section;
+
+        if (config_.get_child(path, boost::property_tree::ptree()) !=
+                config.get_child(path, boost::property_tree::ptree()))
+        {
+            LOG_WARNING() << "section=[" << section << "] changed, it only "
+                          << "applies after a restart";
+        }
+    }
+
+    boost::lock_guard<boost::mutex> lock(proxies_mutex_);
+
+    // the instances removed or replaced, by listening endpoint, so a new
+    // proxy on the same endpoint adopts their listening sockets
+    std::map<std::string, proxy_list> retired;
+
+    // the same instances by name, so a new proxy of the same name keeps
+    // their counters and budget
+    std::map<std::string, proxy_list> replaced;
+
+    BOOST_FOREACH(const proxy_settings::value_type& v, previous)
+    {
+        proxy_settings::const_iterator it = current.find(v.first);
+
+        if (it != current.end() && it->second == v.second)
+            continue;
+
+        LOG_INFO() << (it == current.end() ? "removing" : "replacing")
+                   << " proxy=[" << v.first << "]";
+
+        std::pair<proxy_map::iterator, proxy_map::iterator> range =
+                proxies_.equal_range(v.first);
+        proxy_list& instances = retired[get_listen_key(v.second)];
+
+        for (proxy_map::iterator i = range.first; i != range.second; ++i)
+        {
+            instances.push_back(i->second);
+            replaced[v.first].push_back(i->second);
+        }
+
+        proxies_.erase(range.first, range.second);
+    }
+
+    BOOST_FOREACH(const proxy_settings::value_type& v, current)
+    {
+        proxy_settings::const_iterator it = previous.find(v.first);
+
+        if (it != previous.end() && it->second == v.second)
+            continue;
+
+        if (it == previous.end())
+            LOG_INFO() << "adding proxy=[" << v.first << "]";
+
+        std::map<std::string, proxy_list>::const_iterator instances =
+                retired.find(get_listen_key(v.second));
+
+        try
+        {
+            create_proxy(proxy_configs[v.first],
+                         instances != retired.end() ?
+                             instances->second : proxy_list(),
+                         replaced[v.first]);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR() << "proxy=[" << v.first << "] not started what=["
+                        << e.what() << "]";
+        }
+    }
+
+    // the listening sockets have been duplicated by now, so the retired
+    // instances can close theirs
+    draining_map draining;
+
+    BOOST_FOREACH(const draining_map::value_type& v, draining_)
+    {
+        if (!v.second.expired())
+            draining.insert(v);
+    }
+
+    typedef std::map<std::string, proxy_list>::value_type retired_value;
+
+    BOOST_FOREACH(const retired_value& v, replaced)
+    {
+        BOOST_FOREACH(const tcp_proxy::ptr& proxy_ptr, v.second)
+        {
+            proxy_ptr->drain();
+            draining.insert(std::make_pair(v.first, proxy_ptr));
+        }
+    }
+
+    draining_.swap(draining);
+    config_.swap(config);
+
+    LOG_INFO() << "reloaded proxies=[" << current.size() << "] "
+               << "draining=[" << draining_.size() << "]";
+}
+
 void proxy_manager::handle_signal(
         const boost::system::error_code& ec,
         int signal_number)
@@ -134,10 +1287,20 @@ void proxy_manager::handle_signal(
 
         if (signal_number == SIGINT)
         {
-            stop();
+            // the threads leave their io_services and the thread that called
+            // start() completes the shutdown
+            io_service_.stop();
+
+            BOOST_FOREACH(io_service_ptr& shard, shards_)
+            {
+                shard->stop();
+            }
         }
         else
         {
+            if (signal_number == SIGHUP)
+                reload();
+
             signal_set_.async_wait(
                         boost::bind(
                             &proxy_manager::handle_signal,
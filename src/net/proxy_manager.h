@@ -8,12 +8,16 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <ostream>
 
 #include <boost/asio.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/property_tree/ptree.hpp>
 
 #include "net/tcp_proxy.h"
+#include "net/admission_budget.h"
+#include "net/metrics_server.h"
 #include "core/log.h"
 
 ///
@@ -29,13 +33,37 @@ class proxy_manager
 public:
 
     ///
-    /// @brief Defines a mapping between a proxy and its name.
+    /// @brief Defines a mapping between a proxy and its name. In sharded mode
+    /// there is one proxy instance per shard under the same name.
     ///
-    typedef std::map<std::string, tcp_proxy::ptr> proxy_map;
+    typedef std::multimap<std::string, tcp_proxy::ptr> proxy_map;
+
+    ///
+    /// @brief Defines a list of proxy instances.
+    ///
+    typedef std::vector<tcp_proxy::ptr> proxy_list;
+
+    ///
+    /// @brief Defines a mapping between a proxy draining its sessions and
+    /// its name.
+    ///
+    typedef std::multimap<std::string, boost::weak_ptr<tcp_proxy> >
+        draining_map;
+
+    ///
+    /// @brief Defines a shared_ptr for an io_service.
+    ///
+    typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
+
+    ///
+    /// @brief Defines a shared_ptr for an io_service work.
+    ///
+    typedef boost::shared_ptr<boost::asio::io_service::work> work_ptr;
 
     ///
     /// @brief Constructor. Adds and initiates a signal handler for system
-    /// signals.
+    /// signals: SIGINT stops the manager and SIGHUP reloads the settings
+    /// file.
     ///
     proxy_manager();
 
@@ -57,12 +85,34 @@ public:
     /// @brief Starts one proxy based on a proxy configuration.
     ///
     /// @param proxy_config The proxy configuration that will be used.
+    /// @param thread_pool_size The number of threads used to run the proxy.
+    /// @param sharded Flag indicating whether every thread owns its own
+    /// io_service and acceptor (SO_REUSEPORT) instead of sharing one
+    /// io_service.
+    /// @param dump_queue_size The number of messages the message dumper can
+    /// hold before dropping.
     ///
     virtual void start(
-            const tcp_proxy::config& proxy_config);
+            const tcp_proxy::config& proxy_config,
+            unsigned thread_pool_size = 1,
+            bool sharded = false,
+            size_t dump_queue_size = 4096);
+
+    ///
+    /// @brief Enables the metrics endpoint. It is started together with the
+    /// proxies and served from the control io_service.
+    ///
+    /// @param host The hostname or address to listen on.
+    /// @param port The port or service name to listen on (empty - disabled).
+    ///
+    virtual void enable_metrics(
+            const std::string& host,
+            const std::string& port);
 
     ///
-    /// @brief Stops the io_service and all proxy instances.
+    /// @brief Stops the io_services, waits for the threads and stops all proxy
+    /// instances. It must not be called from a thread that runs one of the
+    /// io_services.
     ///
     virtual void stop();
 
@@ -77,10 +127,57 @@ protected:
     ///
     /// @brief Creates a new proxy based on a configuration.
     ///
-    /// @param config Proxy configuration.
+    /// @param proxy_config Proxy configuration.
+    /// @param previous The instances the new ones replace, one per shard,
+    /// whose listening sockets are adopted (empty - none).
+    /// @param replaced The instances of the same name the new ones replace,
+    /// one per shard, whose counters and budget are carried over (empty -
+    /// none).
     ///
     virtual void create_proxy(
-            const tcp_proxy::config& config);
+            const tcp_proxy::config& proxy_config,
+            const proxy_list& previous = proxy_list(),
+            const proxy_list& replaced = proxy_list());
+
+    ///
+    /// @brief Reads the settings file again and applies the changes of the
+    /// proxies list. The new proxies are started and the removed ones drain
+    /// their sessions. A changed proxy is replaced by a new instance for the
+    /// new sessions, while the previous one drains, and the new instance
+    /// adopts the listening socket when the endpoint is the same. The other
+    /// sections of the settings only apply after a restart.
+    ///
+    virtual void reload();
+
+    ///
+    /// @brief Creates one io_service per thread. Every proxy created after
+    /// this call will have one instance per shard.
+    ///
+    /// @param count The number of shards.
+    ///
+    virtual void create_shards(
+            unsigned count);
+
+    ///
+    /// @brief Runs the io_services until a stop is requested and then stops
+    /// the manager. In sharded mode every shard is run by its own thread and
+    /// the calling thread runs the control io_service (signals). Otherwise all
+    /// threads run the same io_service.
+    ///
+    /// @param thread_pool_size The number of threads used to process the
+    /// asynchronous operations.
+    ///
+    virtual void run(
+            unsigned thread_pool_size);
+
+    ///
+    /// @brief Writes the live counters of all proxies in the Prometheus text
+    /// format. The instances of a sharded proxy are summed.
+    ///
+    /// @param out The stream the metrics are written to.
+    ///
+    virtual void write_metrics(
+            std::ostream& out);
 
     ///
     /// @brief Handles a signal.
@@ -103,11 +200,73 @@ protected:
     ///
     boost::property_tree::ptree config_;
 
+    ///
+    /// @brief Holds the full path of the settings file (empty - the proxy was
+    /// configured otherwise).
+    ///
+    std::string settings_file_;
+
+    ///
+    /// @brief Holds the io_services owned by each thread in sharded mode. It
+    /// is empty when all threads share io_service_.
+    ///
+    std::vector<io_service_ptr> shards_;
+
+    ///
+    /// @brief Holds the works that keep the shards running while they have
+    /// nothing to do.
+    ///
+    std::vector<work_ptr> shard_works_;
+
+    ///
+    /// @brief Holds the dumper shared by all proxies with message dump. It is
+    /// created with the first of them.
+    ///
+    core::message_dumper::ptr message_dumper_;
+
+    ///
+    /// @brief Holds the number of messages the message dumper can hold.
+    ///
+    size_t dump_queue_size_;
+
+    ///
+    /// @brief Holds the process-wide budget, parent of the budgets of every
+    /// proxy. It is empty when there are no process-wide limits.
+    ///
+    admission_budget::ptr budget_;
+
+    ///
+    /// @brief Holds the hostname or address of the metrics endpoint.
+    ///
+    std::string metrics_host_;
+
+    ///
+    /// @brief Holds the port of the metrics endpoint (empty - disabled).
+    ///
+    std::string metrics_port_;
+
+    ///
+    /// @brief Holds the metrics endpoint, when enabled.
+    ///
+    metrics_server::ptr metrics_server_;
+
     ///
     /// @brief This structure holds all active proxies.
     ///
     proxy_map proxies_;
 
+    ///
+    /// @brief Holds the proxies removed or replaced by a reload that still
+    /// drain their sessions. They go away on their own once drained.
+    ///
+    draining_map draining_;
+
+    ///
+    /// @brief Mutex used to synchronize access to the proxies, which are
+    /// changed by the reloads while the metrics are written.
+    ///
+    boost::mutex proxies_mutex_;
+
     ///
     /// @brief Holds the additional threads used by the io_service.
     ///
@@ -0,0 +1,207 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "core/histogram.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This structure holds the kernel statistics (TCP_INFO) of the
+/// connections of one side of a proxy, sampled as the sessions close.
+///
+typedef struct tcp_stats_ :
+        private boost::noncopyable
+{
+    ///
+    /// @brief Constructor. Zeroes all counters.
+    ///
+    tcp_stats_() :
+        retransmits_(0)
+    {
+    }
+
+    ///
+    /// @brief Holds the smoothed round-trip time, in microseconds.
+    ///
+    core::histogram rtt_;
+
+    ///
+    /// @brief Holds the congestion window, in segments.
+    ///
+    core::histogram cwnd_;
+
+    ///
+    /// @brief Holds the number of segments retransmitted.
+    ///
+    boost::atomic<uint64_t> retransmits_;
+
+} tcp_stats;
+
+///
+/// @brief This structure holds the live counters of a proxy. They are
+/// updated by the proxy and its sessions on the data path, with relaxed
+/// atomics, and read at any time by the metrics endpoint.
+///
+typedef struct proxy_metrics_ :
+        private boost::noncopyable
+{
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<proxy_metrics_> ptr;
+
+    ///
+    /// @brief Constructor. Zeroes all counters.
+    ///
+    proxy_metrics_() :
+        accepts_(0),
+        active_sessions_(0),
+        connect_failures_(0),
+        tx_bytes_(0),
+        rx_bytes_(0),
+        upstream_pool_hits_(0),
+        upstream_pool_misses_(0),
+        accepts_drained_(0),
+        accept_errors_(0),
+        accept_queue_length_(0),
+        budget_accept_pauses_(0),
+        budget_read_pauses_(0),
+        shaping_waits_(0)
+    {
+    }
+
+    ///
+    /// @brief Holds the number of connections accepted.
+    ///
+    boost::atomic<uint64_t> accepts_;
+
+    ///
+    /// @brief Holds the number of sessions not stopped yet.
+    ///
+    boost::atomic<int64_t> active_sessions_;
+
+    ///
+    /// @brief Holds the number of sessions that could not resolve or connect
+    /// to the destination.
+    ///
+    boost::atomic<uint64_t> connect_failures_;
+
+    ///
+    /// @brief Holds the number of bytes read from the clients.
+    ///
+    boost::atomic<uint64_t> tx_bytes_;
+
+    ///
+    /// @brief Holds the number of bytes read from the servers.
+    ///
+    boost::atomic<uint64_t> rx_bytes_;
+
+    ///
+    /// @brief Holds the number of sessions that took a connection from the
+    /// upstream pool.
+    ///
+    boost::atomic<uint64_t> upstream_pool_hits_;
+
+    ///
+    /// @brief Holds the number of sessions that found the upstream pool
+    /// empty and connected on demand.
+    ///
+    boost::atomic<uint64_t> upstream_pool_misses_;
+
+    ///
+    /// @brief Holds the number of connections accepted by the drain loop
+    /// instead of an asynchronous accept.
+    ///
+    boost::atomic<uint64_t> accepts_drained_;
+
+    ///
+    /// @brief Holds the number of accepts that failed.
+    ///
+    boost::atomic<uint64_t> accept_errors_;
+
+    ///
+    /// @brief Holds the length of the accept queue the last time a
+    /// connection was accepted.
+    ///
+    boost::atomic<uint64_t> accept_queue_length_;
+
+    ///
+    /// @brief Holds how many times the accepts were paused because the
+    /// session limit was reached.
+    ///
+    boost::atomic<uint64_t> budget_accept_pauses_;
+
+    ///
+    /// @brief Holds how many times the reads of a session were paused
+    /// because the buffered bytes limit was reached.
+    ///
+    boost::atomic<uint64_t> budget_read_pauses_;
+
+    ///
+    /// @brief Holds how many times a read waited for a rate limit.
+    ///
+    boost::atomic<uint64_t> shaping_waits_;
+
+    ///
+    /// @brief Holds the time, in nanoseconds, from the read of a client
+    /// message to the completion of its write to the server.
+    ///
+    core::histogram tx_latency_;
+
+    ///
+    /// @brief Holds the time, in nanoseconds, from the read of a server
+    /// message to the completion of its write to the client.
+    ///
+    core::histogram rx_latency_;
+
+    ///
+    /// @brief Holds the time, in nanoseconds, from the accept of a client to
+    /// the connection to the server.
+    ///
+    core::histogram connect_latency_;
+
+    ///
+    /// @brief Holds the size, in bytes, of the buffer of every read.
+    ///
+    core::histogram read_buffer_size_;
+
+    ///
+    /// @brief Holds the number of messages waiting in a direction whenever a
+    /// write starts.
+    ///
+    core::histogram write_queue_depth_;
+
+    ///
+    /// @brief Holds the number of messages gathered into every write.
+    ///
+    core::histogram write_gather_size_;
+
+    ///
+    /// @brief Holds the kernel statistics of the connections from the
+    /// clients.
+    ///
+    tcp_stats client_tcp_;
+
+    ///
+    /// @brief Holds the kernel statistics of the connections to the
+    /// backends.
+    ///
+    tcp_stats upstream_tcp_;
+
+} proxy_metrics;
+
+} // namespace net
@@ -0,0 +1,158 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "net/resolver_cache.h"
+using namespace net;
+
+resolver_cache::resolver_cache(
+        boost::asio::io_service& io_service,
+        const std::string& name,
+        const std::string& host,
+        const std::string& port,
+        uint64_t ttl) :
+    logger_(boost::log::keywords::channel = "net.resolver_cache." + name),
+    strand_(io_service),
+    resolver_(io_service),
+    to_(host, port),
+    timer_(io_service),
+    ttl_(ttl),
+    stopping_(false)
+{
+    info_ = info();
+
+    LOG_TRACE() << "ctor";
+}
+
+resolver_cache::~resolver_cache()
+{
+    LOG_TRACE() << "dtor";
+}
+
+void resolver_cache::start()
+{
+    LOG_INFO() << "starting ttl=[" << ttl_ << "]";
+
+    strand_.post(boost::bind(&resolver_cache::refresh, shared_from_this()));
+}
+
+void resolver_cache::stop()
+{
+    strand_.dispatch(
+                boost::bind(&resolver_cache::handle_stop, shared_from_this()));
+}
+
+void resolver_cache::handle_stop()
+{
+    if (stopping_)
+        return;
+
+    stopping_ = true;
+
+    boost::system::error_code ignored;
+    resolver_.cancel();
+    timer_.cancel(ignored);
+
+    info cache_info = get_info();
+
+    LOG_INFO() << "stopped resolves=[" << cache_info.resolves_ << "] "
+               << "resolve-failures=[" << cache_info.resolve_failures_ << "]";
+}
+
+resolver_cache::endpoints_ptr resolver_cache::get_endpoints()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    return endpoints_;
+}
+
+resolver_cache::info resolver_cache::get_info()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    return info_;
+}
+
+void resolver_cache::refresh()
+{
+    if (stopping_)
+        return;
+
+    resolver_.async_resolve(
+                to_,
+                strand_.wrap(
+                    boost::bind(
+                        &resolver_cache::handle_resolve,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::iterator)));
+}
+
+void resolver_cache::handle_resolve(
+        const boost::system::error_code& error_code,
+        boost::asio::ip::tcp::resolver::iterator it)
+{
+    if (stopping_ || error_code == boost::asio::error::operation_aborted)
+        return;
+
+    boost::asio::ip::tcp::resolver::iterator end;
+
+    if (error_code || it == end)
+    {
+        LOG_WARNING() << "resolve failed ec=[" << error_code << "] message=["
+                      << error_code.message() << "]";
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            ++info_.resolve_failures_;
+        }
+
+        // the stale endpoints are still better than none
+        start_timer(std::min<uint64_t>(ttl_, 1000000));
+        return;
+    }
+
+    boost::shared_ptr<endpoint_list> endpoints =
+            boost::make_shared<endpoint_list>(it, end);
+
+    LOG_DEBUG() << "resolved endpoints=[" << endpoints->size() << "] "
+                << "first=[" << endpoints->front().address() << ":"
+                << endpoints->front().port() << "]";
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        endpoints_ = endpoints;
+        ++info_.resolves_;
+    }
+
+    start_timer(ttl_);
+}
+
+void resolver_cache::start_timer(
+        uint64_t delay)
+{
+    timer_.expires_from_now(boost::posix_time::microseconds(delay));
+
+    timer_.async_wait(
+                strand_.wrap(
+                    boost::bind(
+                        &resolver_cache::handle_timer,
+                        shared_from_this(),
+                        boost::asio::placeholders::error)));
+}
+
+void resolver_cache::handle_timer(
+        const boost::system::error_code& error_code)
+{
+    if (!error_code)
+        refresh();
+}
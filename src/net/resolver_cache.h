@@ -0,0 +1,217 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "core/log.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class keeps the resolved endpoints of a destination, so the
+/// sessions can connect without resolving it again.
+///
+/// The destination is resolved when the cache starts and again every time
+/// the TTL expires, in the background. The previous endpoints are kept until
+/// a resolution succeeds, and a failed one is retried within a second.
+///
+class resolver_cache :
+        public boost::enable_shared_from_this<resolver_cache>
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<resolver_cache> ptr;
+
+    ///
+    /// @brief Defines a list of endpoints.
+    ///
+    typedef std::vector<boost::asio::ip::tcp::endpoint> endpoint_list;
+
+    ///
+    /// @brief Defines a shared_ptr for an immutable list of endpoints.
+    ///
+    typedef boost::shared_ptr<const endpoint_list> endpoints_ptr;
+
+    ///
+    /// @brief This structure holds the cache counters.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of resolutions completed.
+        ///
+        uint64_t resolves_;
+
+        ///
+        /// @brief Holds the number of resolutions that failed.
+        ///
+        uint64_t resolve_failures_;
+
+    } info;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param io_service Reference to io_service.
+    /// @param name The proxy name, used by the logger.
+    /// @param host The destination hostname or address.
+    /// @param port The destination port or service name.
+    /// @param ttl The period of time, in microseconds, the endpoints are
+    /// used before being resolved again.
+    ///
+    resolver_cache(
+            boost::asio::io_service& io_service,
+            const std::string& name,
+            const std::string& host,
+            const std::string& port,
+            uint64_t ttl);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~resolver_cache();
+
+    ///
+    /// @brief Starts the first resolution.
+    ///
+    void start();
+
+    ///
+    /// @brief Stops the refresh. It is safe to call this method from any
+    /// thread.
+    ///
+    void stop();
+
+    ///
+    /// @brief Gets the endpoints of the last successful resolution. It is
+    /// safe to call this method from any thread.
+    ///
+    /// @return The endpoints or an empty pointer if the destination was not
+    /// resolved yet.
+    ///
+    endpoints_ptr get_endpoints();
+
+    ///
+    /// @brief Gets the cache counters.
+    ///
+    /// @return The counters.
+    ///
+    info get_info();
+
+protected:
+
+    ///
+    /// @brief Handles a stop request inside the cache strand.
+    ///
+    void handle_stop();
+
+    ///
+    /// @brief Starts a resolution.
+    ///
+    void refresh();
+
+    ///
+    /// @brief This handler is invoked whenever the destination hostname
+    /// resolution has been completed.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// resolve operation.
+    /// @param it The iterator to the endpoint list.
+    ///
+    void handle_resolve(
+            const boost::system::error_code& error_code,
+            boost::asio::ip::tcp::resolver::iterator it);
+
+    ///
+    /// @brief Arms the timer of the next resolution.
+    ///
+    /// @param delay The period of time, in microseconds, until the next
+    /// resolution.
+    ///
+    void start_timer(
+            uint64_t delay);
+
+    ///
+    /// @brief This handler is invoked whenever the next resolution is due.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    void handle_timer(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Holds the logger responsible for logging events from objects of
+    /// this class.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Strand used to serialize the resolutions, the timer and the
+    /// stop.
+    ///
+    boost::asio::io_service::strand strand_;
+
+    ///
+    /// @brief Resolver used to resolve the destination hostname.
+    ///
+    boost::asio::ip::tcp::resolver resolver_;
+
+    ///
+    /// @brief Query used to resolve the destination hostname and service name.
+    ///
+    boost::asio::ip::tcp::resolver::query to_;
+
+    ///
+    /// @brief Holds the timer of the next resolution.
+    ///
+    boost::asio::deadline_timer timer_;
+
+    ///
+    /// @brief Holds the period of time, in microseconds, the endpoints are
+    /// used before being resolved again.
+    ///
+    uint64_t ttl_;
+
+    ///
+    /// @brief Holds the endpoints of the last successful resolution.
+    ///
+    endpoints_ptr endpoints_;
+
+    ///
+    /// @brief Holds the cache counters.
+    ///
+    info info_;
+
+    ///
+    /// @brief Flag indicating whether the cache is stopping. It is only
+    /// accessed from the cache strand.
+    ///
+    bool stopping_;
+
+    ///
+    /// @brief Mutex used to synchronize the access to the endpoints and the
+    /// counters.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace net
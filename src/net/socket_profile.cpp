@@ -0,0 +1,187 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <cerrno>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "net/socket_profile.h"
+using namespace net;
+
+socket_profile::socket_profile(
+        const options& profile_options) :
+    options_(profile_options)
+{
+}
+
+socket_profile::~socket_profile()
+{
+}
+
+void socket_profile::apply(
+        boost::asio::ip::tcp::socket& socket,
+        boost::system::error_code& error_code) const
+{
+    const int fd = socket.native_handle();
+
+    error_code.clear();
+
+    if (options_.no_delay_)
+    {
+        socket.set_option(
+                    boost::asio::ip::tcp::no_delay(true), error_code);
+    }
+
+    if (!error_code && options_.keep_alive_)
+    {
+        socket.set_option(
+                    boost::asio::socket_base::keep_alive(true), error_code);
+    }
+
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+    if (!error_code && options_.keep_idle_)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, options_.keep_idle_,
+                   error_code);
+    }
+
+    if (!error_code && options_.keep_interval_)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, options_.keep_interval_,
+                   error_code);
+    }
+
+    if (!error_code && options_.keep_count_)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, options_.keep_count_,
+                   error_code);
+    }
+#endif
+
+    if (!error_code && options_.receive_buffer_)
+    {
+        socket.set_option(
+                    boost::asio::socket_base::receive_buffer_size(
+                        static_cast<int>(options_.receive_buffer_)),
+                    error_code);
+    }
+
+    if (!error_code && options_.send_buffer_)
+    {
+        socket.set_option(
+                    boost::asio::socket_base::send_buffer_size(
+                        static_cast<int>(options_.send_buffer_)),
+                    error_code);
+    }
+
+#if defined(TCP_NOTSENT_LOWAT)
+    if (!error_code && options_.not_sent_lowat_)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   static_cast<int>(options_.not_sent_lowat_), error_code);
+    }
+#endif
+
+#if defined(TCP_QUICKACK)
+    if (!error_code && options_.quick_ack_)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, error_code);
+    }
+#endif
+
+    (void)fd;
+}
+
+void socket_profile::apply_buffers(
+        boost::asio::ip::tcp::acceptor& acceptor,
+        boost::system::error_code& error_code) const
+{
+    error_code.clear();
+
+    if (options_.receive_buffer_)
+    {
+        acceptor.set_option(
+                    boost::asio::socket_base::receive_buffer_size(
+                        static_cast<int>(options_.receive_buffer_)),
+                    error_code);
+    }
+
+    if (!error_code && options_.send_buffer_)
+    {
+        acceptor.set_option(
+                    boost::asio::socket_base::send_buffer_size(
+                        static_cast<int>(options_.send_buffer_)),
+                    error_code);
+    }
+}
+
+void socket_profile::cork(
+        boost::asio::ip::tcp::socket& socket,
+        bool on) const
+{
+#if defined(TCP_CORK)
+    if (!options_.cork_)
+        return;
+
+    // a failure only costs the coalescing, the write goes on regardless
+    boost::system::error_code ignored;
+    set_option(socket.native_handle(), IPPROTO_TCP, TCP_CORK, on, ignored);
+#else
+    (void)socket;
+    (void)on;
+#endif
+}
+
+void socket_profile::quick_ack(
+        boost::asio::ip::tcp::socket& socket) const
+{
+#if defined(TCP_QUICKACK)
+    if (!options_.quick_ack_)
+        return;
+
+    boost::system::error_code ignored;
+    set_option(socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, 1, ignored);
+#else
+    (void)socket;
+#endif
+}
+
+const socket_profile::options& socket_profile::get_options() const
+{
+    return options_;
+}
+
+void socket_profile::set_option(
+        int fd,
+        int level,
+        int name,
+        int value,
+        boost::system::error_code& error_code)
+{
+    if (::setsockopt(fd, level, name, &value, sizeof(value)))
+    {
+        error_code = boost::system::error_code(
+                    errno, boost::system::system_category());
+    }
+}
+
+std::ostream& net::operator<<(
+        std::ostream& out,
+        const socket_profile::options& profile_options)
+{
+    return out << "no-delay=[" << profile_options.no_delay_ << "] "
+               << "quick-ack=[" << profile_options.quick_ack_ << "] "
+               << "cork=[" << profile_options.cork_ << "] "
+               << "keep-alive=[" << profile_options.keep_alive_ << "/"
+               << profile_options.keep_idle_ << "/"
+               << profile_options.keep_interval_ << "/"
+               << profile_options.keep_count_ << "] "
+               << "receive-buffer=[" << profile_options.receive_buffer_ << "] "
+               << "send-buffer=[" << profile_options.send_buffer_ << "] "
+               << "not-sent-lowat=[" << profile_options.not_sent_lowat_ << "]";
+}
@@ -0,0 +1,192 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class applies the socket options of one side of the sessions
+/// of a proxy, either the connections from the clients or the connections to
+/// the backends.
+///
+/// Every option left at zero keeps the kernel default. The buffer sizes are
+/// also applied to the listener, since the window scale of a connection is
+/// settled by the handshake and the accepted sockets inherit them.
+///
+class socket_profile :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<const socket_profile> ptr;
+
+    ///
+    /// @brief This structure holds the options of the profile.
+    ///
+    typedef struct options_
+    {
+        ///
+        /// @brief Disables the Nagle algorithm (TCP_NODELAY).
+        ///
+        bool no_delay_;
+
+        ///
+        /// @brief Acknowledges every segment right away (TCP_QUICKACK). The
+        /// kernel leaves this mode on its own, so it is set again after every
+        /// read.
+        ///
+        bool quick_ack_;
+
+        ///
+        /// @brief Holds back partial segments while a write is in progress
+        /// (TCP_CORK). The socket is uncorked once the write completes.
+        ///
+        bool cork_;
+
+        ///
+        /// @brief Enables the keepalive probes (SO_KEEPALIVE).
+        ///
+        bool keep_alive_;
+
+        ///
+        /// @brief Holds the idle time, in seconds, before the first keepalive
+        /// probe (TCP_KEEPIDLE).
+        ///
+        unsigned keep_idle_;
+
+        ///
+        /// @brief Holds the time, in seconds, between the keepalive probes
+        /// (TCP_KEEPINTVL).
+        ///
+        unsigned keep_interval_;
+
+        ///
+        /// @brief Holds the number of unanswered keepalive probes after which
+        /// the connection is dropped (TCP_KEEPCNT).
+        ///
+        unsigned keep_count_;
+
+        ///
+        /// @brief Holds the size in bytes of the receive buffer (SO_RCVBUF).
+        /// Setting it disables the receive buffer autotuning.
+        ///
+        uint64_t receive_buffer_;
+
+        ///
+        /// @brief Holds the size in bytes of the send buffer (SO_SNDBUF).
+        /// Setting it disables the send buffer autotuning.
+        ///
+        uint64_t send_buffer_;
+
+        ///
+        /// @brief Holds the amount of bytes not sent yet above which the
+        /// socket is not writable (TCP_NOTSENT_LOWAT).
+        ///
+        uint64_t not_sent_lowat_;
+
+    } options;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param profile_options The options.
+    ///
+    explicit socket_profile(
+            const options& profile_options);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~socket_profile();
+
+    ///
+    /// @brief Applies the options to a socket. It stops at the first option
+    /// the kernel rejects.
+    ///
+    /// @param socket The socket, which must be open.
+    /// @param error_code Set to indicate what error occurred, if any.
+    ///
+    void apply(
+            boost::asio::ip::tcp::socket& socket,
+            boost::system::error_code& error_code) const;
+
+    ///
+    /// @brief Applies the buffer sizes to a listener, before it listens.
+    ///
+    /// @param acceptor The listener, which must be open.
+    /// @param error_code Set to indicate what error occurred, if any.
+    ///
+    void apply_buffers(
+            boost::asio::ip::tcp::acceptor& acceptor,
+            boost::system::error_code& error_code) const;
+
+    ///
+    /// @brief Corks or uncorks a socket if the profile enables it.
+    ///
+    /// @param socket The socket.
+    /// @param on True to cork, false to uncork.
+    ///
+    void cork(
+            boost::asio::ip::tcp::socket& socket,
+            bool on) const;
+
+    ///
+    /// @brief Sets the quick acknowledgements of a socket again if the
+    /// profile enables them.
+    ///
+    /// @param socket The socket.
+    ///
+    void quick_ack(
+            boost::asio::ip::tcp::socket& socket) const;
+
+    ///
+    /// @brief Gets the options.
+    ///
+    /// @return The options.
+    ///
+    const options& get_options() const;
+
+protected:
+
+    ///
+    /// @brief Sets an integer option with setsockopt(2).
+    ///
+    static void set_option(
+            int fd,
+            int level,
+            int name,
+            int value,
+            boost::system::error_code& error_code);
+
+    ///
+    /// @brief Holds the options.
+    ///
+    options options_;
+};
+
+///
+/// @brief Writes the options of a profile in the key=[value] format used by
+/// the logs.
+///
+std::ostream& operator<<(
+        std::ostream& out,
+        const socket_profile::options& profile_options);
+
+} // namespace net
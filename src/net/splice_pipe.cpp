@@ -0,0 +1,170 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include <boost/asio/error.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "net/splice_pipe.h"
+using namespace net;
+
+#if defined(__linux__)
+
+splice_pipe::splice_pipe(
+        size_t capacity) :
+    read_fd_(-1),
+    write_fd_(-1),
+    capacity_(capacity),
+    pending_(0)
+{
+    int fds[2];
+
+    if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        throw boost::system::system_error(
+                    boost::system::error_code(
+                        errno, boost::system::system_category()),
+                    "pipe2");
+    }
+
+    read_fd_ = fds[0];
+    write_fd_ = fds[1];
+
+    // a failure here is not fatal, the pipe just keeps its default capacity
+    int size = ::fcntl(write_fd_, F_SETPIPE_SZ, static_cast<int>(capacity));
+
+    if (size > 0)
+        capacity_ = static_cast<size_t>(size);
+}
+
+splice_pipe::~splice_pipe()
+{
+    ::close(read_fd_);
+    ::close(write_fd_);
+}
+
+bool splice_pipe::is_supported()
+{
+    return true;
+}
+
+size_t splice_pipe::fill(
+        int fd,
+        boost::system::error_code& error_code)
+{
+    error_code.clear();
+
+    for (;;)
+    {
+        ssize_t n = ::splice(fd, NULL, write_fd_, NULL,
+                             capacity_ - pending_,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n >= 0)
+        {
+            pending_ += static_cast<size_t>(n);
+            return static_cast<size_t>(n);
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN)
+            error_code = boost::asio::error::would_block;
+        else
+            error_code = boost::system::error_code(
+                        errno, boost::system::system_category());
+
+        return 0;
+    }
+}
+
+size_t splice_pipe::drain(
+        int fd,
+        boost::system::error_code& error_code)
+{
+    size_t total = 0;
+
+    error_code.clear();
+
+    while (pending_)
+    {
+        ssize_t n = ::splice(read_fd_, NULL, fd, NULL, pending_,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0)
+        {
+            pending_ -= static_cast<size_t>(n);
+            total += static_cast<size_t>(n);
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == EAGAIN)
+            error_code = boost::asio::error::would_block;
+        else if (n < 0)
+            error_code = boost::system::error_code(
+                        errno, boost::system::system_category());
+        else
+            error_code = boost::asio::error::broken_pipe;
+
+        break;
+    }
+
+    return total;
+}
+
+#else
+
+splice_pipe::splice_pipe(
+        size_t capacity) :
+    read_fd_(-1),
+    write_fd_(-1),
+    capacity_(capacity),
+    pending_(0)
+{
+    throw boost::system::system_error(
+                boost::asio::error::operation_not_supported, "splice");
+}
+
+splice_pipe::~splice_pipe()
+{
+}
+
+bool splice_pipe::is_supported()
+{
+    return false;
+}
+
+size_t splice_pipe::fill(
+        int,
+        boost::system::error_code& error_code)
+{
+    error_code = boost::asio::error::operation_not_supported;
+    return 0;
+}
+
+size_t splice_pipe::drain(
+        int,
+        boost::system::error_code& error_code)
+{
+    error_code = boost::asio::error::operation_not_supported;
+    return 0;
+}
+
+#endif
+
+size_t splice_pipe::pending() const
+{
+    return pending_;
+}
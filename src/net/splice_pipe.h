@@ -0,0 +1,108 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstddef>
+
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class wraps a kernel pipe used to move bytes between two
+/// sockets with splice(2), without copying them into user space.
+///
+/// The pipe is only available on Linux. On other platforms is_supported()
+/// returns false and the sessions must use the buffered relay.
+///
+class splice_pipe :
+        private boost::noncopyable
+{
+public:
+
+    ///
+    /// @brief Constructor. Creates a non-blocking pipe.
+    ///
+    /// @param capacity The requested capacity of the pipe in bytes. The kernel
+    /// may round this value up.
+    ///
+    explicit splice_pipe(
+            size_t capacity);
+
+    ///
+    /// @brief Destructor. Closes both ends of the pipe.
+    ///
+    virtual ~splice_pipe();
+
+    ///
+    /// @brief Checks whether zero-copy relay is supported by this platform.
+    ///
+    /// @return True if splice(2) is available.
+    ///
+    static bool is_supported();
+
+    ///
+    /// @brief Moves bytes from a socket into the pipe.
+    ///
+    /// @param fd The source socket descriptor.
+    /// @param error_code Set to would_block if the socket has no data.
+    ///
+    /// @return The amount of bytes moved. Zero with no error means the peer
+    /// closed the connection.
+    ///
+    size_t fill(
+            int fd,
+            boost::system::error_code& error_code);
+
+    ///
+    /// @brief Moves the pending bytes from the pipe into a socket.
+    ///
+    /// @param fd The destination socket descriptor.
+    /// @param error_code Set to would_block if the socket can not accept more
+    /// data.
+    ///
+    /// @return The amount of bytes moved.
+    ///
+    size_t drain(
+            int fd,
+            boost::system::error_code& error_code);
+
+    ///
+    /// @brief Gets the amount of bytes held by the pipe.
+    ///
+    /// @return The amount of bytes waiting to be drained.
+    ///
+    size_t pending() const;
+
+protected:
+
+    ///
+    /// @brief Holds the read end of the pipe.
+    ///
+    int read_fd_;
+
+    ///
+    /// @brief Holds the write end of the pipe.
+    ///
+    int write_fd_;
+
+    ///
+    /// @brief Holds the capacity of the pipe.
+    ///
+    size_t capacity_;
+
+    ///
+    /// @brief Holds the amount of bytes waiting to be drained.
+    ///
+    size_t pending_;
+};
+
+} // namespace net
@@ -4,39 +4,228 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 //
-#include <iostream>
-#include <sstream>
-#include <iomanip>
 #include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/lock_guard.hpp>
 #include <boost/chrono.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/random/random_device.hpp>
 using namespace boost::asio;
 
 #include "net/tcp_proxy.h"
 using namespace net;
 
+namespace {
+
+///
+/// @brief Defines the period of time, in milliseconds, after which an accept
+/// that failed is retried.
+///
+const long ACCEPT_ERROR_RETRY_MS = 100;
+
+///
+/// @brief Defines the period of time, in milliseconds, after which an accept
+/// deferred by the session limit is retried.
+///
+const long ACCEPT_BUDGET_RETRY_MS = 10;
+
+} // namespace
+
 tcp_proxy::tcp_proxy(
         boost::asio::io_service& io_service,
         const tcp_proxy::config& config) :
-       logger_(boost::log::keywords::channel = "net.tcp_proxy." + config.name_),
+       logger_(boost::log::keywords::channel = "net.tcp_proxy." + config.name_ +
+               (config.reuse_port_ ?
+                    "." + boost::lexical_cast<std::string>(config.shard_) :
+                    std::string())),
        io_service_(io_service),
+       listener_fd_(-1),
+       strand_(io_service_),
        acceptor_(io_service_),
+       accept_timer_(io_service_),
+       deferred_accepts_(0),
+       accepts_paused_(false),
        resolver_(io_service_),
        from_(config.shost_, config.sport_),
-       to_(config.dhost_, config.dport_),
-       uniform_dist_(0, UINT32_MAX),
-       config_(config)
+       id_counter_(0),
+       buffer_pool_(boost::make_shared<core::buffer_pool>(
+                        config.buffer_min_size_,
+                        config.buffer_max_size_,
+                        config.buffer_pool_size_)),
+       client_socket_(boost::make_shared<socket_profile>(
+                          config.client_socket_)),
+       upstream_socket_(boost::make_shared<socket_profile>(
+                            config.upstream_socket_)),
+       metrics_(config.metrics_ ?
+                    config.metrics_ : boost::make_shared<proxy_metrics>()),
+       config_(config),
+       stopping_(false),
+       draining_(false)
 {
     LOG_TRACE() << "ctor";
     memset(&info_, 0, sizeof(info_));
+
+    if ((config_.message_dump_ == "hex" || config_.message_dump_ == "ascii") &&
+            !config_.message_dumper_)
+    {
+        config_.message_dumper_ =
+                boost::make_shared<core::message_dumper>(4096);
+    }
+
+    if (!config_.client_shaper_ && config_.aggregate_client_rate_)
+    {
+        config_.client_shaper_ = boost::make_shared<core::token_bucket>(
+                    config_.aggregate_client_rate_,
+                    config_.aggregate_client_burst_);
+    }
+
+    if (!config_.server_shaper_ && config_.aggregate_server_rate_)
+    {
+        config_.server_shaper_ = boost::make_shared<core::token_bucket>(
+                    config_.aggregate_server_rate_,
+                    config_.aggregate_server_burst_);
+    }
+
+    if (!config_.budget_)
+    {
+        config_.budget_ = boost::make_shared<admission_budget>(
+                    config_.max_sessions_,
+                    config_.max_buffered_bytes_,
+                    admission_budget::ptr());
+    }
+
+    if (config_.timeout_)
+    {
+        idle_wheel_ = boost::make_shared<idle_wheel>(
+                    boost::ref(io_service_),
+                    config_.name_,
+                    config_.timeout_tick_,
+                    config_.timeout_);
+    }
+
+    if (!config_.capture_file_.empty())
+    {
+        boost::filesystem::path path(config_.capture_file_);
+
+        if (config_.reuse_port_)
+        {
+            path = path.parent_path() /
+                    (path.stem().string() + "-" +
+                     boost::lexical_cast<std::string>(config_.shard_) +
+                     path.extension().string());
+        }
+
+        capture_ = boost::make_shared<pcapng_writer>(
+                    path.string(), config_.capture_file_size_);
+    }
+
+    if (config_.backends_.empty())
+    {
+        backend_config destination;
+
+        destination.host_ = config_.dhost_;
+        destination.port_ = config_.dport_;
+        destination.weight_ = 1;
+
+        config_.backends_.push_back(destination);
+    }
+
+    load_balancer::backend_list backends;
+
+    BOOST_FOREACH(const backend_config& v, config_.backends_)
+    {
+        load_balancer::backend::ptr backend =
+                boost::make_shared<load_balancer::backend>();
+        const std::string name = config_.name_ + "." + v.host_ + ":" + v.port_;
+
+        backend->host_ = v.host_;
+        backend->port_ = v.port_;
+        backend->weight_ = v.weight_;
+        backend->active_sessions_ = 0;
+        backend->sessions_ = 0;
+
+        if (config_.resolve_ttl_)
+        {
+            backend->resolver_cache_ = boost::make_shared<resolver_cache>(
+                        boost::ref(io_service_),
+                        name,
+                        v.host_,
+                        v.port_,
+                        config_.resolve_ttl_);
+        }
+
+        if (config_.upstream_pool_size_)
+        {
+            backend->upstream_pool_ = boost::make_shared<upstream_pool>(
+                        boost::ref(io_service_),
+                        name,
+                        v.host_,
+                        v.port_,
+                        config_.upstream_pool_size_,
+                        config_.upstream_pool_max_idle_,
+                        backend->resolver_cache_);
+        }
+
+        backends.push_back(backend);
+    }
+
+    balancer_ = boost::make_shared<load_balancer>(
+                backends, load_balancer::parse_policy(config_.balance_));
+
+    if (config_.io_uring_)
+    {
+        try
+        {
+            if (!uring_relay::is_supported())
+            {
+                throw boost::system::system_error(
+                            boost::asio::error::operation_not_supported,
+                            "io_uring relay");
+            }
+
+            uring_relay_ = boost::make_shared<uring_relay>(
+                        boost::ref(io_service_),
+                        config_.name_,
+                        config_.io_uring_entries_,
+                        config_.io_uring_buffers_,
+                        config_.buffer_size_,
+                        config_.high_watermark_,
+                        std::min(config_.low_watermark_,
+                                 config_.high_watermark_),
+                        metrics_,
+                        config_.budget_);
+        }
+        catch (const boost::system::system_error& e)
+        {
+            LOG_WARNING() << "io_uring relay unavailable, falling back "
+                          << "what=[" << e.what() << "]";
+        }
+    }
+
+    // the random device is only read once, the identifiers are derived from
+    // this seed
+    boost::random::random_device random_device;
+    id_seed_ = random_device();
 }
 
 tcp_proxy::~tcp_proxy()
 {
+    // the listener was handed over but never adopted
+    if (config_.listener_ >= 0)
+        ::close(config_.listener_);
+
     LOG_TRACE() << "dtor";
 }
 
@@ -46,58 +235,357 @@ void tcp_proxy::start()
 
     LOG_INFO() << "starting source=[" << from_.host_name() << ":"
                << from_.service_name() << "] "
-               << "destination=[" << to_.host_name() << ":"
-               << to_.service_name() << "]";
+               << "balance=[" << config_.balance_ << "]";
+
+    BOOST_FOREACH(const backend_config& v, config_.backends_)
+    {
+        LOG_INFO() << "backend destination=[" << v.host_ << ":" << v.port_
+                   << "] weight=[" << v.weight_ << "]";
+    }
 
     LOG_INFO() << "message-dump=[" << config_.message_dump_ << "] "
                << "buffer-size=[" << config_.buffer_size_ << "] "
-               << "timeout=[" << config_.timeout_ << "]";
+               << "buffer-pool-size=[" << config_.buffer_pool_size_ << "] "
+               << "timeout=[" << config_.timeout_ << "] "
+               << "timeout-tick=[" << config_.timeout_tick_ << "]";
+
+    LOG_INFO() << "buffer-min-size=[" << config_.buffer_min_size_ << "] "
+               << "buffer-max-size=[" << config_.buffer_max_size_ << "]";
+
+    LOG_INFO() << "max-sessions=[" << config_.max_sessions_ << "] "
+               << "max-buffered-bytes=[" << config_.max_buffered_bytes_ << "]";
+
+    LOG_INFO() << "connect-timeout=[" << config_.connect_timeout_ << "] "
+               << "connect-stagger=[" << config_.connect_stagger_ << "]";
+
+    LOG_INFO() << "high-watermark=[" << config_.high_watermark_ << "] "
+               << "low-watermark=[" << config_.low_watermark_ << "]";
 
     LOG_INFO() << "client-delay=[" << config_.client_delay_ << "] "
-               << "server-delay=[" << config_.server_delay_ << "]";
+               << "server-delay=[" << config_.server_delay_ << "] "
+               << "zero-copy=[" << config_.zero_copy_ << "]";
+
+    LOG_INFO() << "io-uring=[" << config_.io_uring_ << "] "
+               << "io-uring-entries=[" << config_.io_uring_entries_ << "] "
+               << "io-uring-buffers=[" << config_.io_uring_buffers_ << "]";
+
+    LOG_INFO() << "client-rate=[" << config_.client_rate_ << "/"
+               << config_.client_burst_ << "] "
+               << "server-rate=[" << config_.server_rate_ << "/"
+               << config_.server_burst_ << "] "
+               << "aggregate-client-rate=[" << config_.aggregate_client_rate_
+               << "/" << config_.aggregate_client_burst_ << "] "
+               << "aggregate-server-rate=[" << config_.aggregate_server_rate_
+               << "/" << config_.aggregate_server_burst_ << "]";
+
+    LOG_INFO() << "client-socket " << config_.client_socket_;
+    LOG_INFO() << "upstream-socket " << config_.upstream_socket_;
+
+    LOG_INFO() << "capture-file=[" << config_.capture_file_ << "] "
+               << "capture-file-size=[" << config_.capture_file_size_ << "]";
+
+    LOG_INFO() << "upstream-pool-size=[" << config_.upstream_pool_size_ << "] "
+               << "upstream-pool-max-idle=["
+               << config_.upstream_pool_max_idle_ << "] "
+               << "resolve-ttl=[" << config_.resolve_ttl_ << "]";
+
+    if (uring_relay_)
+        uring_relay_->start();
+
+    if (idle_wheel_)
+        idle_wheel_->start();
+
+    BOOST_FOREACH(const load_balancer::backend::ptr& backend,
+                  balancer_->get_backends())
+    {
+        if (backend->resolver_cache_)
+            backend->resolver_cache_->start();
+
+        if (backend->upstream_pool_)
+            backend->upstream_pool_->start();
+    }
 
     resolver_.async_resolve(
                 from_,
-                boost::bind(
-                    &tcp_proxy::handle_resolve,
-                    this,
-                    placeholders::error,
-                    placeholders::iterator)
-                );
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_proxy::handle_resolve,
+                        shared_from_this(),
+                        placeholders::error,
+                        placeholders::iterator)));
 }
 
 void tcp_proxy::stop()
 {
-    BOOST_FOREACH(session_map::value_type& v, sessions_)
+    strand_.dispatch(
+                boost::bind(
+                    &tcp_proxy::handle_stop, shared_from_this()));
+}
+
+void tcp_proxy::handle_stop()
+{
+    if (stopping_)
+        return;
+
+    stopping_ = true;
+
+    close_acceptor();
+
+    boost::system::error_code ignored;
+    accept_timer_.cancel(ignored);
+    resolver_.cancel();
+
+    // the relay stops its sessions right away, and the last one to stop
+    // logs the statistics already
+    const bool idle = sessions_.empty();
+
+    if (uring_relay_)
+        uring_relay_->stop();
+
+    if (idle_wheel_)
+        idle_wheel_->stop();
+
+    BOOST_FOREACH(const load_balancer::backend::ptr& backend,
+                  balancer_->get_backends())
+    {
+        if (backend->upstream_pool_)
+            backend->upstream_pool_->stop();
+
+        if (backend->resolver_cache_)
+            backend->resolver_cache_->stop();
+    }
+
+    if (sessions_.empty())
+    {
+        if (idle)
+            log_stats();
+
+        return;
+    }
+
+    // the sessions remove themselves from sessions_ as they stop
+    session_map sessions = sessions_;
+
+    BOOST_FOREACH(session_map::value_type& v, sessions)
     {
         v.second->stop();
     }
+}
+
+void tcp_proxy::drain()
+{
+    strand_.dispatch(
+                boost::bind(
+                    &tcp_proxy::handle_drain, shared_from_this()));
+}
+
+void tcp_proxy::handle_drain()
+{
+    if (stopping_ || draining_)
+        return;
+
+    draining_ = true;
+
+    LOG_INFO() << "draining sessions=[" << sessions_.size() << "]";
+
+    close_acceptor();
+
+    boost::system::error_code ignored;
+    accept_timer_.cancel(ignored);
+    resolver_.cancel();
+
+    // the relay, the pools and the idle wheel are still used by the sessions
+    if (sessions_.empty())
+        handle_stop();
+}
+
+int tcp_proxy::duplicate_listener()
+{
+    boost::lock_guard<boost::mutex> lock(listener_mutex_);
+
+    if (listener_fd_ < 0)
+        return -1;
+
+    return ::fcntl(listener_fd_, F_DUPFD_CLOEXEC, 0);
+}
+
+void tcp_proxy::close_acceptor()
+{
+    boost::lock_guard<boost::mutex> lock(listener_mutex_);
+
+    listener_fd_ = -1;
+
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+}
+
+const proxy_metrics::ptr& tcp_proxy::get_metrics() const
+{
+    return metrics_;
+}
+
+const load_balancer::ptr& tcp_proxy::get_balancer() const
+{
+    return balancer_;
+}
+
+const admission_budget::ptr& tcp_proxy::get_budget() const
+{
+    return config_.budget_;
+}
 
+void tcp_proxy::log_stats()
+{
     info_.stop_time_ = boost::chrono::system_clock::now();
 
+    core::buffer_pool::info pool_info = buffer_pool_->get_info();
+
     LOG_INFO() << "stats "
                << "sessions=[" << info_.total_sessions_ << "] "
                << "tx=[" << info_.total_tx_ << "] "
                << "rx=[" << info_.total_rx_ << "] "
+               << "read-pauses=[" << info_.total_read_pauses_ << "] "
                << "elapsed=[" << boost::chrono::duration_cast<
                   boost::chrono::milliseconds>(
                       info_.stop_time_ - info_.start_time_)
                << "]";
+    LOG_INFO() << "buffer pool "
+               << "hits=[" << pool_info.hits_ << "] "
+               << "misses=[" << pool_info.misses_ << "] "
+               << "discards=[" << pool_info.discards_ << "]";
+
+    if (capture_)
+    {
+        capture_->flush();
+
+        pcapng_writer::info capture_info = capture_->get_info();
+
+        LOG_INFO() << "capture "
+                   << "packets=[" << capture_info.packets_ << "] "
+                   << "bytes=[" << capture_info.bytes_ << "] "
+                   << "files=[" << capture_info.files_ << "] "
+                   << "errors=[" << capture_info.errors_ << "]";
+    }
+
+    BOOST_FOREACH(const load_balancer::backend::ptr& backend,
+                  balancer_->get_backends())
+    {
+        LOG_INFO() << "backend destination=[" << backend->host_ << ":"
+                   << backend->port_ << "] "
+                   << "sessions=[" << backend->sessions_ << "]";
+    }
+
+    if (config_.upstream_pool_size_)
+    {
+        LOG_INFO() << "upstream pool "
+                   << "hits=[" << metrics_->upstream_pool_hits_ << "] "
+                   << "misses=[" << metrics_->upstream_pool_misses_ << "]";
+    }
+
+    LOG_INFO() << "budget "
+               << "accept-pauses=[" << metrics_->budget_accept_pauses_ << "] "
+               << "read-pauses=[" << metrics_->budget_read_pauses_ << "]";
+
+    LOG_INFO() << "shaping waits=[" << metrics_->shaping_waits_ << "]";
+
+    log_latency("tx", metrics_->tx_latency_);
+    log_latency("rx", metrics_->rx_latency_);
+    log_latency("connect", metrics_->connect_latency_);
+
+    core::histogram::info size_info = metrics_->read_buffer_size_.get_info();
+
+    LOG_INFO() << "read buffer "
+               << "count=[" << size_info.count_ << "] "
+               << "p50=[" << size_info.p50_ << "] "
+               << "p99=[" << size_info.p99_ << "] "
+               << "max=[" << size_info.max_ << "]";
+
+    core::histogram::info depth_info =
+            metrics_->write_queue_depth_.get_info();
+    core::histogram::info gather_info =
+            metrics_->write_gather_size_.get_info();
+
+    LOG_INFO() << "writes "
+               << "count=[" << gather_info.count_ << "] "
+               << "queue-depth-p50=[" << depth_info.p50_ << "] "
+               << "queue-depth-max=[" << depth_info.max_ << "] "
+               << "gather-p50=[" << gather_info.p50_ << "] "
+               << "gather-p99=[" << gather_info.p99_ << "] "
+               << "gather-max=[" << gather_info.max_ << "]";
+
+    log_tcp_stats("client", metrics_->client_tcp_);
+    log_tcp_stats("upstream", metrics_->upstream_tcp_);
+
     LOG_DEBUG() << "stopped";
 }
 
+void tcp_proxy::log_tcp_stats(
+        const char* side,
+        tcp_stats& stats)
+{
+    core::histogram::info rtt_info = stats.rtt_.get_info();
+    core::histogram::info cwnd_info = stats.cwnd_.get_info();
+
+    LOG_INFO() << "tcp side=[" << side << "] "
+               << "samples=[" << rtt_info.count_ << "] "
+               << "rtt-p50=[" << rtt_info.p50_ << "us] "
+               << "rtt-p99=[" << rtt_info.p99_ << "us] "
+               << "cwnd-p50=[" << cwnd_info.p50_ << "] "
+               << "cwnd-p99=[" << cwnd_info.p99_ << "] "
+               << "retransmits=[" << stats.retransmits_ << "]";
+}
+
+void tcp_proxy::log_latency(
+        const char* path,
+        core::histogram& latency)
+{
+    core::histogram::info latency_info = latency.get_info();
+
+    LOG_INFO() << "latency path=[" << path << "] "
+               << "count=[" << latency_info.count_ << "] "
+               << "p50=[" << latency_info.p50_ << "ns] "
+               << "p99=[" << latency_info.p99_ << "ns] "
+               << "p999=[" << latency_info.p999_ << "ns] "
+               << "max=[" << latency_info.max_ << "ns]";
+}
+
 void tcp_proxy::handle_session_stopped(
         tcp_session::ptr session_ptr)
 {
-    boost::lock_guard<boost::mutex> lock(mutex_);
-
-    LOG_INFO() << "removing session=[" << session_ptr->get_id() << "]";
+    LOG_INFO() << "removing session=[" << session_ptr->get_id_string() << "]";
 
     info_.total_rx_ += session_ptr->get_info().total_rx_;
     info_.total_tx_ += session_ptr->get_info().total_tx_;
+    info_.total_read_pauses_ += session_ptr->get_info().read_pauses_;
     ++info_.total_sessions_;
 
+    metrics_->active_sessions_.fetch_sub(1, boost::memory_order_relaxed);
+    config_.budget_->release_session();
+
     sessions_.erase(session_ptr->get_id());
+
+    if (!sessions_.empty())
+        return;
+
+    if (stopping_)
+        log_stats();
+    else if (draining_)
+        handle_stop();
+}
+
+tcp_session::id_type tcp_proxy::next_session_id()
+{
+    // the finalizer of MurmurHash3 is a bijection on 32 bits, so distinct
+    // counters always give distinct identifiers
+    uint32_t h = id_seed_ + id_counter_++;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
 }
 
 void tcp_proxy::handle_resolve(
@@ -112,99 +600,307 @@ void tcp_proxy::handle_resolve(
         {
             ip::tcp::endpoint ep(*it);
 
-            LOG_INFO() << "binding endpoint=["
-                       << ep.address() << ":" << ep.port() << "/"
-                       << (ep.address().is_v4() ? "ipv4" : "ipv6") << "]";
+            const bool adopted = config_.listener_ >= 0;
+
+            if (adopted)
+            {
+                LOG_INFO() << "adopting listener endpoint=["
+                           << ep.address() << ":" << ep.port() << "/"
+                           << (ep.address().is_v4() ? "ipv4" : "ipv6") << "]";
+
+                acceptor_.assign(ep.protocol(), config_.listener_);
+                config_.listener_ = -1;
+            }
+            else
+            {
+                LOG_INFO() << "binding endpoint=["
+                           << ep.address() << ":" << ep.port() << "/"
+                           << (ep.address().is_v4() ? "ipv4" : "ipv6") << "]";
+
+                acceptor_.open(ep.protocol());
+                acceptor_.set_option(socket_base::reuse_address(true));
+
+                if (config_.reuse_port_)
+                {
+#if defined(SO_REUSEPORT)
+                    acceptor_.set_option(reuse_port(true));
+#else
+                    LOG_WARNING() << "SO_REUSEPORT is not supported";
+#endif
+                }
+            }
+
+            boost::system::error_code ec;
+            client_socket_->apply_buffers(acceptor_, ec);
+
+            if (ec)
+            {
+                LOG_WARNING() << "socket profile ec=[" << ec << "] message=["
+                              << ec.message() << "]";
+            }
+
+            if (!adopted)
+                acceptor_.bind(ep);
+
+            const int backlog = config_.listen_backlog_ ?
+                        static_cast<int>(config_.listen_backlog_) :
+                        static_cast<int>(socket_base::max_listen_connections);
+
+            LOG_INFO() << "listening backlog=[" << backlog << "] "
+                       << "accept-count=[" << config_.accept_count_ << "] "
+                       << "accept-batch=[" << config_.accept_batch_ << "]";
+
+            // listening again on an adopted socket only updates its backlog
+            acceptor_.listen(backlog);
+
+            // the drain loop must not block when the queue is empty, the
+            // asynchronous accepts are not affected by this flag
+            acceptor_.non_blocking(true);
+
+            {
+                boost::lock_guard<boost::mutex> lock(listener_mutex_);
+                listener_fd_ = acceptor_.native_handle();
+            }
+
+            for (uint64_t i = 0; i < std::max<uint64_t>(
+                     config_.accept_count_, 1); ++i)
+            {
+                start_accept();
+            }
+        }
+    }
+    else
+    {
+        LOG_ERROR() << "ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+    }
+}
 
-            acceptor_.open(ep.protocol());
-            acceptor_.set_option(socket_base::reuse_address(true));
-            acceptor_.bind(ep);
+tcp_session::ptr tcp_proxy::create_session()
+{
+    tcp_session::config session_config;
+
+    session_config.id_ = next_session_id();
+    session_config.type_ = config_.name_;
+    session_config.buffer_size_ = config_.buffer_size_;
+    session_config.client_delay_ = config_.client_delay_;
+    session_config.server_delay_ = config_.server_delay_;
+    session_config.client_rate_ = config_.client_rate_;
+    session_config.client_burst_ = config_.client_burst_;
+    session_config.server_rate_ = config_.server_rate_;
+    session_config.server_burst_ = config_.server_burst_;
+    session_config.client_shaper_ = config_.client_shaper_;
+    session_config.server_shaper_ = config_.server_shaper_;
+    session_config.timeout_ = config_.timeout_;
+    session_config.idle_wheel_ = idle_wheel_;
+    session_config.connect_timeout_ = config_.connect_timeout_;
+    session_config.connect_stagger_ = config_.connect_stagger_;
+    session_config.zero_copy_ = config_.zero_copy_;
+    session_config.high_watermark_ = config_.high_watermark_;
+    session_config.low_watermark_ =
+            std::min(config_.low_watermark_, config_.high_watermark_);
+    session_config.buffer_pool_ = buffer_pool_;
+    session_config.message_dumper_ = config_.message_dumper_;
+    session_config.capture_ = capture_;
+    session_config.metrics_ = metrics_;
+    session_config.balancer_ = balancer_;
+    session_config.budget_ = config_.budget_;
+    session_config.uring_relay_ = uring_relay_;
+    session_config.client_socket_ = client_socket_;
+    session_config.upstream_socket_ = upstream_socket_;
+
+    if (config_.message_dump_ == "hex")
+    {
+        session_config.message_dump_ = tcp_session::hex;
+    }
+    else if (config_.message_dump_ == "ascii")
+    {
+        session_config.message_dump_ = tcp_session::ascii;
+    }
+    else
+    {
+        session_config.message_dump_ = tcp_session::none;
+    }
 
-            LOG_INFO() << "listening";
+    tcp_session::ptr ptr =
+            boost::make_shared<tcp_session>(
+                boost::ref(io_service_),
+                session_config);
+
+    ptr->signal_stopped_.connect(
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_proxy::handle_session_stopped,
+                        shared_from_this(),
+                        _1)));
+
+    return ptr;
+}
 
-            acceptor_.listen();
+void tcp_proxy::start_accept()
+{
+    if (!config_.budget_->try_acquire_session())
+    {
+        if (!accepts_paused_)
+        {
+            LOG_DEBUG() << "accepts paused sessions=["
+                        << config_.budget_->get_sessions() << "]";
 
-            boost::system::error_code success;
-            tcp_session::ptr null;
-            handle_accept(success, null);
+            accepts_paused_ = true;
+            metrics_->budget_accept_pauses_.fetch_add(
+                        1, boost::memory_order_relaxed);
         }
+
+        defer_accept(ACCEPT_BUDGET_RETRY_MS);
+        return;
     }
-    else
+
+    if (accepts_paused_)
     {
-        LOG_ERROR() << "ec=[" << error_code << "] message=["
-                    << error_code.message() << "]";
+        LOG_DEBUG() << "accepts resumed";
+
+        accepts_paused_ = false;
     }
+
+    tcp_session::ptr ptr = create_session();
+
+    acceptor_.async_accept(
+                ptr->get_socket(),
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_proxy::handle_accept,
+                        shared_from_this(),
+                        placeholders::error,
+                        ptr)));
+}
+
+void tcp_proxy::start_session(
+        tcp_session::ptr session_ptr)
+{
+    LOG_INFO() << "connection accepted - session=["
+               << session_ptr->get_id_string() << "]";
+
+    metrics_->accepts_.fetch_add(1, boost::memory_order_relaxed);
+    metrics_->active_sessions_.fetch_add(1, boost::memory_order_relaxed);
+
+    session_ptr->start();
+
+    sessions_[session_ptr->get_id()] = session_ptr;
 }
 
 void tcp_proxy::handle_accept(
         const boost::system::error_code& error_code,
         tcp_session::ptr session_ptr)
 {
-    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (stopping_ || error_code)
+    {
+        // the session of the budget held by the accept is given back, the
+        // accepted ones give theirs back as they stop
+        config_.budget_->release_session();
+    }
 
-    if (!error_code)
+    if (stopping_ || error_code == boost::asio::error::operation_aborted)
+        return;
+
+    if (error_code)
     {
-        std::ostringstream session_id;
+        LOG_ERROR() << "ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
 
-        if (session_ptr)
-        {
-            LOG_INFO() << "connection accepted - session=["
-                       << session_ptr->get_id() << "]";
+        metrics_->accept_errors_.fetch_add(1, boost::memory_order_relaxed);
 
-            session_ptr->start();
+        // errors like running out of descriptors last for a while, so the
+        // accept is retried later instead of spinning
+        defer_accept(ACCEPT_ERROR_RETRY_MS);
+        return;
+    }
 
-            sessions_[session_ptr->get_id()] = session_ptr;
-        }
+#if defined(TCP_INFO)
+    // the accept queue length seen at every wakeup shows how close the
+    // listener is to overflowing
+    struct tcp_info tcp_info;
+    socklen_t tcp_info_size = sizeof(tcp_info);
+
+    if (!::getsockopt(acceptor_.native_handle(), IPPROTO_TCP, TCP_INFO,
+                      &tcp_info, &tcp_info_size))
+    {
+        metrics_->accept_queue_length_.store(
+                    tcp_info.tcpi_unacked, boost::memory_order_relaxed);
+    }
+#endif
 
-        session_id << std::hex << std::setfill('0') << std::setw(8)
-                   << uniform_dist_(random_device_);
+    start_session(session_ptr);
 
-        tcp_session::config session_config;
+    // a connection accepted before the drain is relayed, but no other one
+    if (draining_)
+        return;
 
-        session_config.id_ = session_id.str();
-        session_config.type_ = config_.name_;
-        session_config.buffer_size_ = config_.buffer_size_;
-        session_config.host_ = to_.host_name();
-        session_config.port_ = to_.service_name();
-        session_config.client_delay_ = config_.client_delay_;
-        session_config.server_delay_ = config_.server_delay_;
-        session_config.timeout_ = config_.timeout_;
+    // drains the connections already queued without waiting for another
+    // wakeup, the session is only created once a connection is there
+    for (uint64_t i = 1; i < config_.accept_batch_; ++i)
+    {
+        // the queued connections wait in the listen queue while the session
+        // limit is reached
+        if (!config_.budget_->try_acquire_session())
+            break;
 
-        if (config_.message_dump_ == "hex")
-        {
-            session_config.message_dump_ = tcp_session::hex;
-        }
-        else if (config_.message_dump_ == "ascii")
-        {
-            session_config.message_dump_ = tcp_session::ascii;
-        }
-        else
+        boost::system::error_code ec;
+        ip::tcp::socket socket(io_service_);
+
+        acceptor_.accept(socket, ec);
+
+        if (ec)
         {
-            session_config.message_dump_ = tcp_session::none;
+            config_.budget_->release_session();
+
+            if (ec != boost::asio::error::would_block &&
+                ec != boost::asio::error::try_again)
+            {
+                LOG_ERROR() << "ec=[" << ec << "] message=["
+                            << ec.message() << "]";
+
+                metrics_->accept_errors_.fetch_add(
+                            1, boost::memory_order_relaxed);
+            }
+
+            break;
         }
 
-        tcp_session::ptr ptr =
-                boost::make_shared<tcp_session>(
-                    boost::ref(io_service_),
-                    session_config);
+        tcp_session::ptr ptr = create_session();
+        ptr->get_socket() = std::move(socket);
 
-        ptr->signal_stopped_.connect(
-                    boost::bind(
-                        &tcp_proxy::handle_session_stopped,
-                        this,
-                        _1));
+        metrics_->accepts_drained_.fetch_add(1, boost::memory_order_relaxed);
 
-        acceptor_.async_accept(
-                    ptr->get_socket(),
+        start_session(ptr);
+    }
+
+    start_accept();
+}
+
+void tcp_proxy::defer_accept(
+        long delay)
+{
+    if (deferred_accepts_++)
+        return;
+
+    accept_timer_.expires_from_now(boost::posix_time::milliseconds(delay));
+    accept_timer_.async_wait(
+                strand_.wrap(
                     boost::bind(
-                        &tcp_proxy::handle_accept,
-                        this,
-                        placeholders::error,
-                        ptr));
+                        &tcp_proxy::handle_accept_retry,
+                        shared_from_this(),
+                        placeholders::error)));
+}
 
-    }
-    else
-    {
-        LOG_ERROR() << "ec=[" << error_code << "] message=[" << error_code.message() << "]";
-    }
+void tcp_proxy::handle_accept_retry(
+        const boost::system::error_code& error_code)
+{
+    if (error_code || stopping_ || draining_)
+        return;
+
+    uint64_t count = deferred_accepts_;
+    deferred_accepts_ = 0;
+
+    while (count--)
+        start_accept();
 }
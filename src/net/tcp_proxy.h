@@ -7,17 +7,22 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <vector>
 #include <cstdint>
 
 #include <boost/asio.hpp>
-#include <boost/thread/mutex.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/random/random_device.hpp>
-#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "net/tcp_session.h"
+#include "net/admission_budget.h"
+#include "net/proxy_metrics.h"
+#include "net/socket_profile.h"
+#include "core/buffer_pool.h"
+#include "core/token_bucket.h"
+#include "core/message_dumper.h"
 #include "core/log.h"
 
 ///
@@ -48,7 +53,8 @@ public:
     ///
     /// @brief Defines a mapping between a session and its unique id.
     ///
-    typedef std::map<std::string, tcp_session::ptr> session_map;
+    typedef boost::unordered_map<tcp_session::id_type, tcp_session::ptr>
+        session_map;
 
     ///
     /// @brief Defines the type of time_point used by the proxy.
@@ -86,8 +92,35 @@ public:
         ///
         uint64_t total_rx_;
 
+        ///
+        /// @brief Holds the sum of read pauses caused by the high watermark.
+        ///
+        uint64_t total_read_pauses_;
+
     } info;
 
+    ///
+    /// @brief This structure defines a backend the sessions are balanced to.
+    ///
+    typedef struct backend_config_
+    {
+        ///
+        /// @brief Backend hostname or address.
+        ///
+        std::string host_;
+
+        ///
+        /// @brief Backend port or service name.
+        ///
+        std::string port_;
+
+        ///
+        /// @brief Relative share of the sessions sent to the backend.
+        ///
+        unsigned weight_;
+
+    } backend_config;
+
     ///
     /// @brief This structures defines all configuration parameters required by
     /// the proxy.
@@ -119,6 +152,18 @@ public:
         ///
         std::string dport_;
 
+        ///
+        /// @brief Backends the sessions are balanced to. When it is empty,
+        /// the destination hostname and port are the only backend.
+        ///
+        std::vector<backend_config> backends_;
+
+        ///
+        /// @brief Backend selection policy. Possible values are:
+        /// "round-robin", "least-sessions" or "consistent-hash".
+        ///
+        std::string balance_;
+
         ///
         /// @brief This parameter specifies how long microseconds the messages
         /// from client will be delayed before being forwarded to the
@@ -133,24 +178,279 @@ public:
         ///
         uint64_t server_delay_;
 
+        ///
+        /// @brief This parameter specifies the rate limit, in bytes per
+        /// second, of the messages from client of every session
+        /// (0 - unlimited).
+        ///
+        uint64_t client_rate_;
+
+        ///
+        /// @brief This parameter specifies the burst size, in bytes, of the
+        /// client rate limit of every session.
+        ///
+        uint64_t client_burst_;
+
+        ///
+        /// @brief This parameter specifies the rate limit, in bytes per
+        /// second, of the messages from server of every session
+        /// (0 - unlimited).
+        ///
+        uint64_t server_rate_;
+
+        ///
+        /// @brief This parameter specifies the burst size, in bytes, of the
+        /// server rate limit of every session.
+        ///
+        uint64_t server_burst_;
+
+        ///
+        /// @brief This parameter specifies the rate limit, in bytes per
+        /// second, of the messages from client of all sessions together
+        /// (0 - unlimited).
+        ///
+        uint64_t aggregate_client_rate_;
+
+        ///
+        /// @brief This parameter specifies the burst size, in bytes, of the
+        /// aggregate client rate limit.
+        ///
+        uint64_t aggregate_client_burst_;
+
+        ///
+        /// @brief This parameter specifies the rate limit, in bytes per
+        /// second, of the messages from server of all sessions together
+        /// (0 - unlimited).
+        ///
+        uint64_t aggregate_server_rate_;
+
+        ///
+        /// @brief This parameter specifies the burst size, in bytes, of the
+        /// aggregate server rate limit.
+        ///
+        uint64_t aggregate_server_burst_;
+
+        ///
+        /// @brief Holds the aggregate client rate limit, shared by the
+        /// shards. When it is empty and there is an aggregate client rate,
+        /// the proxy creates its own.
+        ///
+        core::token_bucket::ptr client_shaper_;
+
+        ///
+        /// @brief Holds the aggregate server rate limit, shared by the
+        /// shards. When it is empty and there is an aggregate server rate,
+        /// the proxy creates its own.
+        ///
+        core::token_bucket::ptr server_shaper_;
+
         ///
         /// @brief This parameter specifies the size in bytes of the internal
-        /// buffer used to forward messages.
+        /// buffer used to forward messages. It is the initial size of the
+        /// read buffers, which adapt between the minimum and maximum sizes.
         ///
         uint64_t buffer_size_;
 
+        ///
+        /// @brief This parameter specifies the size in bytes below which the
+        /// read buffers never shrink.
+        ///
+        uint64_t buffer_min_size_;
+
+        ///
+        /// @brief This parameter specifies the size in bytes above which the
+        /// read buffers never grow.
+        ///
+        uint64_t buffer_max_size_;
+
+        ///
+        /// @brief This parameter specifies the maximum number of idle buffers
+        /// kept by the proxy buffer pool.
+        ///
+        uint64_t buffer_pool_size_;
+
+        ///
+        /// @brief This parameter specifies the amount of bytes waiting to be
+        /// written, per direction, above which the session stops reading.
+        ///
+        uint64_t high_watermark_;
+
+        ///
+        /// @brief This parameter specifies the amount of bytes waiting to be
+        /// written, per direction, below which the session resumes reading.
+        ///
+        uint64_t low_watermark_;
+
         ///
         /// @brief This parameter specifies a time in microseconds to be used to
         /// terminate a inactive session by timeout.
         ///
         uint64_t timeout_;
 
+        ///
+        /// @brief This parameter specifies the period of time, in
+        /// microseconds, between two checks of the inactive sessions. The
+        /// timeout is rounded up to it.
+        ///
+        uint64_t timeout_tick_;
+
+        ///
+        /// @brief This parameter specifies a time in microseconds after which
+        /// a session that could not resolve and connect to its backend is
+        /// stopped (0 - disabled).
+        ///
+        uint64_t connect_timeout_;
+
+        ///
+        /// @brief This parameter specifies a time in microseconds after which
+        /// the connect to the next endpoint of the backend starts while the
+        /// previous ones are still pending.
+        ///
+        uint64_t connect_stagger_;
+
+        ///
+        /// @brief This parameter specifies the size of the queue of
+        /// connections waiting to be accepted (0 - system maximum).
+        ///
+        uint64_t listen_backlog_;
+
+        ///
+        /// @brief This parameter specifies the number of asynchronous
+        /// accepts kept pending.
+        ///
+        uint64_t accept_count_;
+
+        ///
+        /// @brief This parameter specifies the maximum number of connections
+        /// accepted per wakeup, the queued ones being accepted right away.
+        ///
+        uint64_t accept_batch_;
+
+        ///
+        /// @brief This parameter specifies the maximum number of concurrent
+        /// sessions, above which the accepts are paused (0 - unlimited).
+        ///
+        uint64_t max_sessions_;
+
+        ///
+        /// @brief This parameter specifies the amount of bytes buffered by
+        /// all sessions above which they stop reading (0 - unlimited).
+        ///
+        uint64_t max_buffered_bytes_;
+
+        ///
+        /// @brief Holds the budget of the proxy, shared by its shards. When
+        /// it is empty, the proxy creates its own budget from the limits
+        /// above.
+        ///
+        admission_budget::ptr budget_;
+
+        ///
+        /// @brief Holds the live counters of the proxy. The instance that
+        /// replaces another on a reload keeps counting on the same ones.
+        /// When it is empty, the proxy creates its own counters.
+        ///
+        proxy_metrics::ptr metrics_;
+
         ///
         /// @brief Message dump type. Possible values are: "hex", "ascii" or
         /// "none".
         ///
         std::string message_dump_;
 
+        ///
+        /// @brief Holds the dumper shared by the proxies. When it is empty and
+        /// there is a message dump, the proxy creates its own dumper.
+        ///
+        core::message_dumper::ptr message_dumper_;
+
+        ///
+        /// @brief Holds the path of the pcapng capture (empty - disabled). In
+        /// sharded mode the shard index is appended to the file name.
+        ///
+        std::string capture_file_;
+
+        ///
+        /// @brief Holds the size in bytes above which the capture is rotated
+        /// to a new file (0 - disabled).
+        ///
+        uint64_t capture_file_size_;
+
+        ///
+        /// @brief Holds the number of idle connections to the destination
+        /// kept open ahead of the sessions (0 - disabled).
+        ///
+        uint64_t upstream_pool_size_;
+
+        ///
+        /// @brief Holds the period of time, in microseconds, after which an
+        /// idle pooled connection is replaced (0 - never).
+        ///
+        uint64_t upstream_pool_max_idle_;
+
+        ///
+        /// @brief Holds the period of time, in microseconds, the resolved
+        /// destination endpoints are cached before being resolved again in
+        /// the background (0 - resolve for every connection).
+        ///
+        uint64_t resolve_ttl_;
+
+        ///
+        /// @brief Enables the zero-copy relay (splice) for sessions without
+        /// message dump and delays.
+        ///
+        bool zero_copy_;
+
+        ///
+        /// @brief Enables the io_uring relay for the same sessions as the
+        /// zero-copy relay. The proxy falls back to the other relays when the
+        /// kernel does not support it.
+        ///
+        bool io_uring_;
+
+        ///
+        /// @brief Holds the number of submission queue entries of the
+        /// io_uring relay.
+        ///
+        unsigned io_uring_entries_;
+
+        ///
+        /// @brief Holds the number of buffers registered by the io_uring
+        /// relay, each one of buffer_size_ bytes. It is rounded up to a power
+        /// of two.
+        ///
+        unsigned io_uring_buffers_;
+
+        ///
+        /// @brief Holds the socket options of the connections from the
+        /// clients.
+        ///
+        socket_profile::options client_socket_;
+
+        ///
+        /// @brief Holds the socket options of the connections to the
+        /// backends.
+        ///
+        socket_profile::options upstream_socket_;
+
+        ///
+        /// @brief Enables SO_REUSEPORT on the acceptor, allowing one proxy
+        /// instance per shard to listen on the same endpoint.
+        ///
+        bool reuse_port_;
+
+        ///
+        /// @brief Holds the index of the shard that runs this proxy instance.
+        ///
+        unsigned shard_;
+
+        ///
+        /// @brief Holds a listening socket adopted instead of binding a new
+        /// one, taken from the instance this one replaces so no connection
+        /// is refused meanwhile. The proxy owns it (-1 - none).
+        ///
+        int listener_;
+
     } config;
 
     ///
@@ -174,12 +474,103 @@ public:
     virtual void start();
 
     ///
-    /// @brief Stops all sessions and prints usage statistics.
+    /// @brief Stops accepting connections and stops all sessions. The usage
+    /// statistics are printed once the last session is removed. The work is
+    /// dispatched to the proxy strand, so it is safe to call this method from
+    /// any thread.
     ///
     virtual void stop();
 
+    ///
+    /// @brief Stops accepting connections and lets the sessions run until
+    /// they end, stopping the proxy then. It is safe to call this method
+    /// from any thread.
+    ///
+    virtual void drain();
+
+    ///
+    /// @brief Duplicates the listening socket, so the instance replacing
+    /// this one accepts from the same queue. It is safe to call this method
+    /// from any thread.
+    ///
+    /// @return The duplicated socket, owned by the caller, or -1 if the
+    /// proxy is not listening.
+    ///
+    int duplicate_listener();
+
+    ///
+    /// @brief Gets the live counters of the proxy. They can be read from any
+    /// thread.
+    ///
+    /// @return The counters.
+    ///
+    const proxy_metrics::ptr& get_metrics() const;
+
+    ///
+    /// @brief Gets the backend balancer. The backend counters can be read
+    /// from any thread.
+    ///
+    /// @return The balancer.
+    ///
+    const load_balancer::ptr& get_balancer() const;
+
+    ///
+    /// @brief Gets the budget of the proxy. It is shared by its shards.
+    ///
+    /// @return The budget.
+    ///
+    const admission_budget::ptr& get_budget() const;
+
 protected:
 
+    ///
+    /// @brief Handles a stop request inside the proxy strand.
+    ///
+    virtual void handle_stop();
+
+    ///
+    /// @brief Handles a drain request inside the proxy strand.
+    ///
+    virtual void handle_drain();
+
+    ///
+    /// @brief Closes the acceptor, so the proxy stops accepting connections.
+    ///
+    void close_acceptor();
+
+    ///
+    /// @brief Prints the usage statistics.
+    ///
+    virtual void log_stats();
+
+    ///
+    /// @brief Prints the percentiles of a latency histogram.
+    ///
+    /// @param path The name of the measured path.
+    /// @param latency The histogram.
+    ///
+    void log_latency(
+            const char* path,
+            core::histogram& latency);
+
+    ///
+    /// @brief Prints the kernel statistics of one side of the sessions.
+    ///
+    /// @param side The side, either client or upstream.
+    /// @param stats The statistics.
+    ///
+    void log_tcp_stats(
+            const char* side,
+            tcp_stats& stats);
+
+    ///
+    /// @brief Generates a new session identifier. The identifiers look random
+    /// but are unique until 2^32 sessions have been created.
+    ///
+    /// @return The session identifier.
+    ///
+    tcp_session::id_type next_session_id();
+
     ///
     /// @brief This handler is invoked by the session whenever it is finished.
     ///
@@ -211,6 +602,46 @@ protected:
             const boost::system::error_code& error_code,
             tcp_session::ptr session_ptr);
 
+    ///
+    /// @brief This handler is invoked whenever the deferred accepts can be
+    /// retried.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    virtual void handle_accept_retry(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Creates the session for the next connection.
+    ///
+    /// @return The session.
+    ///
+    tcp_session::ptr create_session();
+
+    ///
+    /// @brief Starts an asynchronous accept, or defers it while the session
+    /// limit is reached. The pending accept holds a session of the budget.
+    ///
+    void start_accept();
+
+    ///
+    /// @brief Defers an accept until the accept timer expires.
+    ///
+    /// @param delay The period of time, in milliseconds, to wait if the timer
+    /// is not armed yet.
+    ///
+    void defer_accept(
+            long delay);
+
+    ///
+    /// @brief Starts a session whose connection was accepted.
+    ///
+    /// @param session_ptr The session.
+    ///
+    void start_session(
+            tcp_session::ptr session_ptr);
+
     ///
     /// @brief Holds the logger responsible for logging events from objects of
     /// this class.
@@ -223,11 +654,53 @@ protected:
     ///
     boost::asio::io_service& io_service_;
 
+    ///
+    /// @brief Holds the listening socket, while the acceptor listens (-1 -
+    /// not listening).
+    ///
+    int listener_fd_;
+
+    ///
+    /// @brief Mutex used to keep the listening socket from being closed
+    /// while it is duplicated.
+    ///
+    boost::mutex listener_mutex_;
+
+    ///
+    /// @brief Strand used to serialize the accept path and the access to the
+    /// sessions. Every member below is only accessed from this strand.
+    ///
+    boost::asio::io_service::strand strand_;
+
+#if defined(SO_REUSEPORT)
+    ///
+    /// @brief Defines the SO_REUSEPORT socket option.
+    ///
+    typedef boost::asio::detail::socket_option::boolean<
+        SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
     ///
     /// @brief Acceptor used to accept incoming connections.
     ///
     boost::asio::ip::tcp::acceptor acceptor_;
 
+    ///
+    /// @brief Timer used to retry the accepts deferred after an error or
+    /// while the session limit is reached.
+    ///
+    boost::asio::deadline_timer accept_timer_;
+
+    ///
+    /// @brief Holds the number of accepts waiting for the accept timer.
+    ///
+    uint64_t deferred_accepts_;
+
+    ///
+    /// @brief Flag indicating whether the accepts are paused by the budget.
+    ///
+    bool accepts_paused_;
+
     ///
     /// @brief Resolver used to resolve hostnames.
     ///
@@ -239,24 +712,64 @@ protected:
     boost::asio::ip::tcp::resolver::query from_;
 
     ///
-    /// @brief Query used to resolve the destination hostname and service name.
+    /// @brief This structure holds all active sessions indexed by their id.
     ///
-    boost::asio::ip::tcp::resolver::query to_;
+    session_map sessions_;
 
     ///
-    /// @brief This structure holds all active sessions indexed by their id.
+    /// @brief Holds the random seed used to generate the sessions
+    /// identifiers.
     ///
-    session_map sessions_;
+    uint32_t id_seed_;
+
+    ///
+    /// @brief Holds the number of session identifiers generated so far.
+    ///
+    uint32_t id_counter_;
+
+    ///
+    /// @brief Holds the pool of read buffers shared by all sessions.
+    ///
+    core::buffer_pool::ptr buffer_pool_;
+
+    ///
+    /// @brief Holds the capture writer shared by all sessions. It is empty
+    /// when the capture is disabled.
+    ///
+    pcapng_writer::ptr capture_;
+
+    ///
+    /// @brief Holds the balancer shared by all sessions, along with the
+    /// endpoint cache and the connection pool of every backend.
+    ///
+    load_balancer::ptr balancer_;
+
+    ///
+    /// @brief Holds the io_uring relay shared by all sessions. It is empty
+    /// when the relay is disabled or not supported.
+    ///
+    uring_relay::ptr uring_relay_;
+
+    ///
+    /// @brief Holds the wheel that drops the inactive sessions (empty -
+    /// timeout disabled).
+    ///
+    idle_wheel::ptr idle_wheel_;
+
+    ///
+    /// @brief Holds the socket profile of the connections from the clients.
+    ///
+    socket_profile::ptr client_socket_;
 
     ///
-    /// @brief Random device used to generate the sessions identifiers.
+    /// @brief Holds the socket profile of the connections to the backends.
     ///
-    boost::random::random_device random_device_;
+    socket_profile::ptr upstream_socket_;
 
     ///
-    /// @brief Uniform distribution used to generate the sessions identifiers.
+    /// @brief Holds the live counters shared with the sessions.
     ///
-    boost::random::uniform_int_distribution<uint32_t> uniform_dist_;
+    proxy_metrics::ptr metrics_;
 
     ///
     /// @brief Holds the configuration.
@@ -269,9 +782,15 @@ protected:
     info info_;
 
     ///
-    /// @brief Mutex used to synchronize access to this class.
+    /// @brief Flag indicating whether the proxy is stopping.
+    ///
+    bool stopping_;
+
+    ///
+    /// @brief Flag indicating whether the proxy stopped accepting and waits
+    /// for its sessions to end.
     ///
-    boost::mutex mutex_;
+    bool draining_;
 
 };
 
@@ -4,42 +4,151 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 //
-#include <iomanip>
-#include <sstream>
-#include <cctype>
+#include <algorithm>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <boost/make_shared.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/algorithm/hex.hpp>
+#include <boost/foreach.hpp>
 
 #include "net/tcp_session.h"
 using namespace net;
 
+namespace {
+
+///
+/// @brief Defines the number of consecutive reads filling less than a quarter
+/// of the read buffer after which it is halved.
+///
+const unsigned SMALL_READS_TO_SHRINK = 4;
+
+///
+/// @brief Defines the period of time, in milliseconds, after which the reads
+/// paused by the budget are retried.
+///
+const long BUDGET_RETRY_MS = 10;
+
+///
+/// @brief Defines the maximum number of queued messages gathered into a
+/// single write, which matches the number of buffers asio passes to one
+/// sendmsg(2).
+///
+const size_t MAX_GATHER_BUFFERS = 64;
+
+} // namespace
+
 tcp_session::tcp_session(
         boost::asio::io_service& io_service,
         const tcp_session::config& config) :
     logger_(boost::log::keywords::channel =
-        std::string("net.tcp_session." + config.type_ + "." + config.id_)),
+        "net.tcp_session." + config.type_ + "." + format_id(config.id_)),
+    id_string_(format_id(config.id_)),
     io_service_(io_service),
+    strand_(io_service),
     client_(io_service),
     server_(io_service),
     resolver_(io_service),
-    to_(config.host_, config.port_),
-    timeout_timer_(io_service),
+    next_candidate_(0),
+    failed_attempts_(0),
+    connecting_(false),
+    upstream_connected_(false),
+    pooled_(false),
+    stagger_timer_(io_service),
+    connect_timer_(io_service),
+    last_activity_(0),
+    idle_linked_(false),
     server_timer_(io_service),
     client_timer_(io_service),
+    server_shaping_timer_(io_service),
+    client_shaping_timer_(io_service),
+    budget_timer_(io_service),
+    budget_timer_armed_(false),
+    budget_paused_(false),
     config_(config)
 {
+    if (config_.message_dump_ != none)
+    {
+        dump_channel_ = boost::make_shared<const std::string>(
+                    "net.tcp_session." + config.type_ + "." + id_string_);
+    }
+
+    capture_flow_.open_ = false;
+
     info_.status_ = ready;
     info_.total_tx_ = 0;
     info_.total_rx_ = 0;
+    info_.read_pauses_ = 0;
+
+    server_direction_.from_ = &client_;
+    server_direction_.to_ = &server_;
+    server_direction_.server_flag_ = true;
+    server_direction_.from_profile_ = config_.upstream_socket_.get();
+    server_direction_.to_profile_ = config_.client_socket_.get();
+    server_direction_.delay_ = config_.server_delay_;
+    server_direction_.timer_ = &server_timer_;
+    server_direction_.latency_ = &config_.metrics_->rx_latency_;
+    server_direction_.aggregate_shaper_ = config_.server_shaper_;
+    server_direction_.shaping_timer_ = &server_shaping_timer_;
+
+    client_direction_.from_ = &server_;
+    client_direction_.to_ = &client_;
+    client_direction_.server_flag_ = false;
+    client_direction_.from_profile_ = config_.client_socket_.get();
+    client_direction_.to_profile_ = config_.upstream_socket_.get();
+    client_direction_.delay_ = config_.client_delay_;
+    client_direction_.timer_ = &client_timer_;
+    client_direction_.latency_ = &config_.metrics_->tx_latency_;
+    client_direction_.aggregate_shaper_ = config_.client_shaper_;
+    client_direction_.shaping_timer_ = &client_shaping_timer_;
+
+    if (config_.server_rate_)
+    {
+        server_direction_.shaper_ = boost::make_shared<core::token_bucket>(
+                    config_.server_rate_, config_.server_burst_);
+    }
+
+    if (config_.client_rate_)
+    {
+        client_direction_.shaper_ = boost::make_shared<core::token_bucket>(
+                    config_.client_rate_, config_.client_burst_);
+    }
+
+    direction* dirs[] = { &server_direction_, &client_direction_ };
+
+    BOOST_FOREACH(direction* dir, dirs)
+    {
+        dir->queued_bytes_ = 0;
+        dir->reading_ = false;
+        dir->writing_ = false;
+        dir->paused_ = false;
+        dir->timer_armed_ = false;
+        dir->read_size_ =
+                config_.buffer_pool_->get_class_size(config_.buffer_size_);
+        dir->small_reads_ = 0;
+        dir->shaping_ = false;
+        dir->gathered_ = 0;
+    }
 
     LOG_TRACE() << "ctor";
 }
 
 tcp_session::~tcp_session()
 {
+    // no handler holds the session anymore, so the bytes still queued will
+    // never be written
+    if (idle_linked_)
+        config_.idle_wheel_->remove(idle_entry_);
+
+    if (config_.budget_)
+    {
+        config_.budget_->remove_buffered(
+                    server_direction_.queued_bytes_ +
+                    client_direction_.queued_bytes_);
+    }
+
     LOG_TRACE() << "dtor";
 }
 
@@ -53,43 +162,310 @@ void tcp_session::start()
     LOG_INFO() << "started";
 
     info_.start_time_ = boost::chrono::system_clock::now();
+    start_steady_time_ = boost::chrono::steady_clock::now();
     info_.status_ = running;
 
+    // linked before any handler runs, so the stop always finds the entry
+    if (config_.idle_wheel_)
+    {
+        mark_active();
+        idle_entry_ = config_.idle_wheel_->add(
+                    shared_from_this(), last_activity_);
+        idle_linked_ = true;
+    }
+
+    apply_profile(server_, config_.client_socket_);
+
+    boost::system::error_code ec;
+
+    backend_ = config_.balancer_->select(server_.remote_endpoint(ec).address());
+    backend_->active_sessions_.fetch_add(1, boost::memory_order_relaxed);
+
+    LOG_DEBUG() << "backend=[" << backend_->host_ << ":" << backend_->port_
+                << "]";
+
+    upstream_pool::socket_ptr upstream;
+
+    if (backend_->upstream_pool_)
+    {
+        upstream = backend_->upstream_pool_->acquire();
+
+        (upstream ? config_.metrics_->upstream_pool_hits_ :
+                    config_.metrics_->upstream_pool_misses_).fetch_add(
+                        1, boost::memory_order_relaxed);
+    }
+
+    if (upstream)
+    {
+        LOG_DEBUG() << "connection taken from the upstream pool";
+
+        client_ = std::move(*upstream);
+        pooled_ = true;
+
+        apply_profile(client_, config_.upstream_socket_);
+
+        strand_.post(
+                    boost::bind(
+                        &tcp_session::handle_connect,
+                        shared_from_this(),
+                        boost::system::error_code()));
+    }
+    else
+    {
+        strand_.post(
+                    boost::bind(
+                        &tcp_session::start_connect,
+                        shared_from_this()));
+    }
+}
+
+void tcp_session::start_connect()
+{
+    if (info_.status_ != running)
+        return;
+
+    connecting_ = true;
+
+    if (config_.connect_timeout_)
+    {
+        connect_timer_.expires_from_now(
+                    boost::posix_time::microseconds(config_.connect_timeout_));
+
+        connect_timer_.async_wait(
+                    strand_.wrap(
+                        boost::bind(
+                            &tcp_session::handle_connect_timeout,
+                            shared_from_this(),
+                            boost::asio::placeholders::error)));
+    }
+
+    resolver_cache::endpoints_ptr endpoints;
+
+    if (backend_->resolver_cache_)
+        endpoints = backend_->resolver_cache_->get_endpoints();
+
+    if (endpoints)
+    {
+        LOG_DEBUG() << "to cached endpoints=[" << endpoints->size() << "]";
+
+        start_attempts(*endpoints);
+        return;
+    }
+
     resolver_.async_resolve(
-                to_,
-                boost::bind(
-                    &tcp_session::handle_resolve,
-                    this,
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::iterator)
+                backend_->host_,
+                backend_->port_,
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_resolve,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::iterator))
                 );
+}
+
+void tcp_session::start_attempts(
+        const resolver_cache::endpoint_list& endpoints)
+{
+    // alternates the address families, starting with the preferred one, so
+    // an unreachable family costs one stagger period at most
+    resolver_cache::endpoint_list preferred;
+    resolver_cache::endpoint_list other;
+
+    BOOST_FOREACH(const boost::asio::ip::tcp::endpoint& ep, endpoints)
+    {
+        if (ep.protocol() == endpoints.front().protocol())
+            preferred.push_back(ep);
+        else
+            other.push_back(ep);
+    }
+
+    candidates_.clear();
+
+    for (size_t i = 0; i < preferred.size() || i < other.size(); ++i)
+    {
+        if (i < preferred.size())
+            candidates_.push_back(preferred[i]);
+
+        if (i < other.size())
+            candidates_.push_back(other[i]);
+    }
+
+    next_candidate_ = 0;
+    failed_attempts_ = 0;
+
+    if (candidates_.empty())
+    {
+        connecting_ = false;
+        cancel_attempts();
+        handle_connect(boost::asio::error::host_not_found);
+        return;
+    }
+
+    start_attempt();
+}
+
+void tcp_session::start_attempt()
+{
+    const boost::asio::ip::tcp::endpoint& ep = candidates_[next_candidate_++];
+
+    upstream_pool::socket_ptr socket =
+            boost::make_shared<boost::asio::ip::tcp::socket>(io_service_);
+
+    attempts_.push_back(socket);
+
+    LOG_DEBUG() << "to endpoint=[" << ep.address() << ":" << ep.port() << "]";
+
+    // the buffer sizes must be set before the handshake to be fully used,
+    // if the socket can not be opened the connect reports it
+    boost::system::error_code ec;
+    socket->open(ep.protocol(), ec);
 
-    if (config_.timeout_)
-        set_timeout(config_.timeout_);
+    if (!ec)
+        apply_profile(*socket, config_.upstream_socket_);
+
+    socket->async_connect(
+                ep,
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_attempt,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        socket)));
+
+    if (next_candidate_ < candidates_.size())
+    {
+        stagger_timer_.expires_from_now(
+                    boost::posix_time::microseconds(config_.connect_stagger_));
+
+        stagger_timer_.async_wait(
+                    strand_.wrap(
+                        boost::bind(
+                            &tcp_session::handle_stagger,
+                            shared_from_this(),
+                            boost::asio::placeholders::error)));
+    }
 }
 
-void tcp_session::set_timeout(
-        uint64_t timeout)
+void tcp_session::handle_stagger(
+        const boost::system::error_code& error_code)
 {
-    LOG_DEBUG() << "session timeout=[" << config_.timeout_ << "]";
+    if (!error_code && connecting_ && next_candidate_ < candidates_.size())
+        start_attempt();
+}
 
-    timeout_timer_.expires_from_now(
-                boost::posix_time::microseconds(config_.timeout_));
+void tcp_session::handle_attempt(
+        const boost::system::error_code& error_code,
+        upstream_pool::socket_ptr socket)
+{
+    if (!connecting_)
+    {
+        boost::system::error_code ignored;
+        socket->close(ignored);
+        return;
+    }
 
-    timeout_timer_.cancel();
+    if (error_code)
+    {
+        LOG_DEBUG() << "connect failed ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+
+        ++failed_attempts_;
+
+        // a failure does not wait for the stagger period
+        if (next_candidate_ < candidates_.size())
+        {
+            start_attempt();
+        }
+        else if (failed_attempts_ == attempts_.size())
+        {
+            connecting_ = false;
+            cancel_attempts();
+            handle_connect(error_code);
+        }
 
-    timeout_timer_.async_wait(
+        return;
+    }
+
+    connecting_ = false;
+    client_ = std::move(*socket);
+    cancel_attempts();
+
+    handle_connect(error_code);
+}
+
+void tcp_session::handle_connect_timeout(
+        const boost::system::error_code& error_code)
+{
+    if (error_code || !connecting_)
+        return;
+
+    LOG_WARNING() << "connect timed out attempts=[" << attempts_.size()
+                  << "]";
+
+    connecting_ = false;
+    resolver_.cancel();
+    cancel_attempts();
+
+    handle_connect(boost::asio::error::timed_out);
+}
+
+void tcp_session::cancel_attempts()
+{
+    boost::system::error_code ignored;
+
+    stagger_timer_.cancel(ignored);
+    connect_timer_.cancel(ignored);
+
+    BOOST_FOREACH(upstream_pool::socket_ptr& socket, attempts_)
+    {
+        socket->close(ignored);
+    }
+
+    attempts_.clear();
+}
+
+void tcp_session::mark_active()
+{
+    last_activity_.store(
+                config_.idle_wheel_->get_tick(), boost::memory_order_relaxed);
+}
+
+uint64_t tcp_session::get_last_activity() const
+{
+    return last_activity_.load(boost::memory_order_relaxed);
+}
+
+void tcp_session::check_idle()
+{
+    strand_.dispatch(
                 boost::bind(
-                    &tcp_session::handle_timeout,
-                    this,
-                    boost::asio::placeholders::error));
+                    &tcp_session::handle_idle_check, shared_from_this()));
 }
 
-const std::string& tcp_session::get_id()
+tcp_session::id_type tcp_session::get_id()
 {
     return config_.id_;
 }
 
+const std::string& tcp_session::get_id_string()
+{
+    return id_string_;
+}
+
+std::string tcp_session::format_id(
+        id_type id)
+{
+    static const char DIGITS[] = "0123456789abcdef";
+
+    std::string text(2 * sizeof(id), '0');
+
+    for (size_t i = text.size(); i > 0; --i, id >>= 4)
+        text[i - 1] = DIGITS[id & 0xf];
+
+    return text;
+}
+
 const tcp_session::info& tcp_session::get_info()
 {
     return info_;
@@ -99,46 +475,93 @@ void tcp_session::handle_resolve(
         const boost::system::error_code& error_code,
         boost::asio::ip::tcp::resolver::iterator it)
 {
+    // the connect timed out or the session stopped meanwhile
+    if (!connecting_)
+        return;
+
     if (!error_code)
     {
         boost::asio::ip::tcp::resolver::iterator end;
-        if (it != end)
-        {
-            boost::asio::ip::tcp::endpoint ep(*it);
 
-            LOG_DEBUG() << "to endpoint=["
-                        << ep.address() << ":" << ep.port() << "]";
-
-            client_.async_connect(
-                        ep,
-                        boost::bind(
-                            &tcp_session::handle_connect,
-                            this,
-                            boost::asio::placeholders::error));
-        }
+        start_attempts(resolver_cache::endpoint_list(it, end));
     }
     else
     {
+        connecting_ = false;
+        cancel_attempts();
+
         LOG_ERROR() << "ec=[" << error_code << "] message=["
                     << error_code.message() << "]";
+
+        if (error_code != boost::asio::error::operation_aborted)
+        {
+            config_.metrics_->connect_failures_.fetch_add(
+                        1, boost::memory_order_relaxed);
+        }
+
+        stop();
     }
 
 }
 
-void tcp_session::handle_timeout(
-        const boost::system::error_code& error_code)
+void tcp_session::handle_idle_check()
 {
-    if (!error_code)
-    {
-        LOG_WARNING() << "timed out";
+    if (info_.status_ != running)
+        return;
 
-        stop();
-    }
-    else
+    // the relay does not report every transfer, so its counters are checked
+    // once per period instead
+    if (relay_flow_ && update_relay_totals())
+        mark_active();
+
+    const uint64_t last_activity = get_last_activity();
+
+    // the session may have been active since the wheel parked it
+    if (!config_.idle_wheel_->is_expired(last_activity))
     {
-        LOG_ERROR() << " ec=[" << error_code << "] message=["
-                    << error_code.message() << "]";
+        config_.idle_wheel_->update(idle_entry_, last_activity);
+        return;
     }
+
+    LOG_WARNING() << "timed out";
+
+    stop();
+}
+
+void tcp_session::handle_budget_retry(
+        const boost::system::error_code& error_code)
+{
+    budget_timer_armed_ = false;
+
+    if (error_code)
+        return;
+
+    start_read(server_direction_);
+    start_read(client_direction_);
+}
+
+void tcp_session::handle_shaping(
+        const boost::system::error_code& error_code,
+        direction& dir)
+{
+    dir.shaping_ = false;
+
+    if (!error_code)
+        start_read(dir);
+}
+
+uint64_t tcp_session::get_shaping_delay(
+        direction& dir)
+{
+    uint64_t delay = 0;
+
+    if (dir.shaper_)
+        delay = dir.shaper_->get_delay();
+
+    if (dir.aggregate_shaper_)
+        delay = std::max(delay, dir.aggregate_shaper_->get_delay());
+
+    return delay;
 }
 
 void tcp_session::handle_connect(
@@ -148,41 +571,74 @@ void tcp_session::handle_connect(
     {
         LOG_DEBUG() << "connected";
 
+        upstream_connected_ = true;
+
+        // a pooled connection was established before the session, so it
+        // is only counted by the pool hits
+        if (!pooled_)
+        {
+            config_.metrics_->connect_latency_.record(
+                        boost::chrono::duration_cast<
+                            boost::chrono::nanoseconds>(
+                                boost::chrono::steady_clock::now() -
+                                start_steady_time_).count());
+        }
+
         try
         {
-            sp_buffer buffer =
-                    std::make_pair(
-                        boost::make_shared<uint8_t[]>(config_.buffer_size_),
-                        config_.buffer_size_);
-
-            client_.async_read_some(
-                        boost::asio::buffer(
-                            buffer.first.get(), buffer.second),
-                        boost::bind(
-                            &tcp_session::handle_read, shared_from_this(),
-                            boost::asio::placeholders::error,
-                            boost::asio::placeholders::bytes_transferred,
-                            buffer,
-                            boost::ref(client_),
-                            boost::ref(server_),
-                            true));
-
-            buffer =
-                    std::make_pair(
-                        boost::make_shared<uint8_t[]>(config_.buffer_size_),
-                        config_.buffer_size_);
-
-            server_.async_read_some(
-                        boost::asio::buffer(
-                            buffer.first.get(), buffer.second),
-                        boost::bind(
-                            &tcp_session::handle_read, shared_from_this(),
-                            boost::asio::placeholders::error,
-                            boost::asio::placeholders::bytes_transferred,
-                            buffer,
-                            boost::ref(server_),
-                            boost::ref(client_),
-                            false));
+            if (config_.capture_)
+            {
+                boost::system::error_code ec;
+
+                capture_flow_.client_ = server_.remote_endpoint(ec);
+                capture_flow_.server_ = server_.local_endpoint(ec);
+
+                if (!ec)
+                    config_.capture_->write_open(capture_flow_, config_.id_);
+            }
+
+            // the relays move the bytes without looking at them
+            const bool opaque =
+                    config_.message_dump_ == none &&
+                    !config_.capture_ &&
+                    !config_.client_delay_ &&
+                    !config_.server_delay_ &&
+                    !server_direction_.shaper_ &&
+                    !server_direction_.aggregate_shaper_ &&
+                    !client_direction_.shaper_ &&
+                    !client_direction_.aggregate_shaper_;
+
+            if (opaque && config_.uring_relay_)
+            {
+                LOG_DEBUG() << "io_uring relay enabled";
+
+                relay_flow_ = config_.uring_relay_->start_relay(
+                            server_.native_handle(),
+                            client_.native_handle(),
+                            strand_.wrap(
+                                boost::bind(
+                                    &tcp_session::handle_relay_closed,
+                                    shared_from_this(),
+                                    boost::asio::placeholders::error)));
+
+                return;
+            }
+
+            if (opaque && config_.zero_copy_ && splice_pipe::is_supported())
+            {
+                LOG_DEBUG() << "zero-copy relay enabled";
+
+                server_pipe_.reset(new splice_pipe(config_.buffer_size_));
+                client_pipe_.reset(new splice_pipe(config_.buffer_size_));
+
+                start_splice(client_, server_, *server_pipe_, true);
+                start_splice(server_, client_, *client_pipe_, false);
+
+                return;
+            }
+
+            start_read(server_direction_);
+            start_read(client_direction_);
         }
         catch (std::exception& e)
         {
@@ -193,71 +649,394 @@ void tcp_session::handle_connect(
     {
         LOG_ERROR() << " ec=[" << error_code << "] message=["
                     << error_code.message() << "]";
+
+        if (error_code != boost::asio::error::operation_aborted)
+        {
+            config_.metrics_->connect_failures_.fetch_add(
+                        1, boost::memory_order_relaxed);
+        }
+
+        stop();
     }
 }
 
-void tcp_session::hexdump(
-        const uint8_t* buffer,
-        size_t size)
+void tcp_session::start_splice(
+        boost::asio::ip::tcp::socket& from,
+        boost::asio::ip::tcp::socket& to,
+        splice_pipe& pipe,
+        bool server_flag)
+{
+    from.non_blocking(true);
+    to.non_blocking(true);
+
+    from.async_read_some(
+                boost::asio::null_buffers(),
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_splice_read, shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::ref(from),
+                        boost::ref(to),
+                        boost::ref(pipe),
+                        server_flag)));
+}
+
+void tcp_session::handle_splice_read(
+        const boost::system::error_code& error_code,
+        boost::asio::ip::tcp::socket& from,
+        boost::asio::ip::tcp::socket& to,
+        splice_pipe& pipe,
+        bool server_flag)
 {
-    size_t i = 0;
-    uint32_t address = 0;
-    std::ostringstream out, hex_out, ascii_out;
+    if (error_code)
+    {
+        LOG_DEBUG() << "connection closed - "
+                    << (server_flag ? "server" : "client");
 
-    hex_out << '\n' << std::setfill('0') << std::setw(8) << address << "    ";
+        stop();
+        return;
+    }
 
-    while (i < size)
+    // bounds the work done per wakeup so that one busy session does not
+    // starve the others sharing the same thread
+    const int MAX_ROUNDS = 16;
+
+    for (int round = 0; round < MAX_ROUNDS; ++round)
     {
-        hex_out << std::hex << std::setw(2)
-                << static_cast<uint16_t>(buffer[i]) << ' ';
+        boost::system::error_code ec;
+        size_t bytes_transferred = pipe.fill(from.native_handle(), ec);
+
+        if (ec == boost::asio::error::would_block)
+            break;
+
+        if (ec || !bytes_transferred)
+        {
+            if (ec)
+            {
+                LOG_ERROR() << "ec=[" << ec << "] message=["
+                            << ec.message() << "]";
+            }
+            else
+            {
+                LOG_DEBUG() << "connection closed - "
+                            << (server_flag ? "server" : "client");
+            }
+
+            stop();
+            return;
+        }
+
+        if (config_.idle_wheel_)
+            mark_active();
+
+        if (server_flag)
+        {
+            info_.total_rx_ += bytes_transferred;
+            config_.metrics_->rx_bytes_.fetch_add(
+                        bytes_transferred, boost::memory_order_relaxed);
+        }
+        else
+        {
+            info_.total_tx_ += bytes_transferred;
+            config_.metrics_->tx_bytes_.fetch_add(
+                        bytes_transferred, boost::memory_order_relaxed);
+        }
+
+        LOG_TRACE() << (server_flag ? "server" : "client") << " spliced "
+                    << "bytes=[" << bytes_transferred << "]";
 
-        ascii_out << static_cast<char>(
-                         std::isgraph(buffer[i]) ? buffer[i] : '.');
+        direction& dir = server_flag ? server_direction_ : client_direction_;
+        dir.splice_time_ = boost::chrono::steady_clock::now();
 
-        ++i;
+        pipe.drain(to.native_handle(), ec);
 
-        if (!(i % 16))
+        if (ec == boost::asio::error::would_block)
         {
-            out << hex_out.str() << "   " << ascii_out.str() << '\n';
+            to.async_write_some(
+                        boost::asio::null_buffers(),
+                        strand_.wrap(
+                            boost::bind(
+                                &tcp_session::handle_splice_write,
+                                shared_from_this(),
+                                boost::asio::placeholders::error,
+                                boost::ref(from),
+                                boost::ref(to),
+                                boost::ref(pipe),
+                                server_flag)));
+            return;
+        }
 
-            ascii_out.str("");
-            hex_out.str("");
+        if (ec)
+        {
+            LOG_ERROR() << "ec=[" << ec << "] message=["
+                        << ec.message() << "]";
 
-            address += 16;
-            hex_out << std::setw(8) << address << "    ";
+            stop();
+            return;
         }
+
+        record_latency(dir, dir.splice_time_);
     }
 
-    if (i % 16)
+    from.async_read_some(
+                boost::asio::null_buffers(),
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_splice_read, shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::ref(from),
+                        boost::ref(to),
+                        boost::ref(pipe),
+                        server_flag)));
+}
+
+void tcp_session::handle_splice_write(
+        const boost::system::error_code& error_code,
+        boost::asio::ip::tcp::socket& from,
+        boost::asio::ip::tcp::socket& to,
+        splice_pipe& pipe,
+        bool server_flag)
+{
+    if (error_code)
+    {
+        LOG_DEBUG() << "connection closed - "
+                    << (server_flag ? "client" : "server");
+
+        stop();
+        return;
+    }
+
+    boost::system::error_code ec;
+    pipe.drain(to.native_handle(), ec);
+
+    if (ec == boost::asio::error::would_block)
+    {
+        to.async_write_some(
+                    boost::asio::null_buffers(),
+                    strand_.wrap(
+                        boost::bind(
+                            &tcp_session::handle_splice_write,
+                            shared_from_this(),
+                            boost::asio::placeholders::error,
+                            boost::ref(from),
+                            boost::ref(to),
+                            boost::ref(pipe),
+                            server_flag)));
+    }
+    else if (ec)
     {
-        while (i++ % 16)
+        LOG_ERROR() << "ec=[" << ec << "] message=[" << ec.message() << "]";
+
+        stop();
+    }
+    else
+    {
+        direction& dir = server_flag ? server_direction_ : client_direction_;
+        record_latency(dir, dir.splice_time_);
+
+        handle_splice_read(ec, from, to, pipe, server_flag);
+    }
+}
+
+void tcp_session::handle_relay_closed(
+        const boost::system::error_code& error_code)
+{
+    LOG_DEBUG() << "relay closed ec=[" << error_code << "] message=["
+                << error_code.message() << "]";
+
+    stop();
+}
+
+bool tcp_session::update_relay_totals()
+{
+    const uint64_t total_tx =
+            relay_flow_->bytes_[0].load(boost::memory_order_relaxed);
+    const uint64_t total_rx =
+            relay_flow_->bytes_[1].load(boost::memory_order_relaxed);
+
+    const bool moved =
+            total_tx != info_.total_tx_ || total_rx != info_.total_rx_;
+
+    info_.total_tx_ = total_tx;
+    info_.total_rx_ = total_rx;
+
+    return moved;
+}
+
+void tcp_session::apply_profile(
+        boost::asio::ip::tcp::socket& socket,
+        const socket_profile::ptr& profile)
+{
+    if (!profile)
+        return;
+
+    boost::system::error_code ec;
+    profile->apply(socket, ec);
+
+    if (ec)
+    {
+        LOG_WARNING() << "socket profile ec=[" << ec << "] message=["
+                      << ec.message() << "]";
+    }
+}
+
+void tcp_session::sample_tcp_info(
+        boost::asio::ip::tcp::socket& socket,
+        tcp_stats& stats)
+{
+#if defined(TCP_INFO)
+    if (!socket.is_open())
+        return;
+
+    struct tcp_info tcp_info;
+    socklen_t tcp_info_size = sizeof(tcp_info);
+
+    if (::getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_INFO,
+                     &tcp_info, &tcp_info_size))
+    {
+        return;
+    }
+
+    stats.rtt_.record(tcp_info.tcpi_rtt);
+    stats.cwnd_.record(tcp_info.tcpi_snd_cwnd);
+    stats.retransmits_.fetch_add(
+                tcp_info.tcpi_total_retrans, boost::memory_order_relaxed);
+#else
+    (void)socket;
+    (void)stats;
+#endif
+}
+
+void tcp_session::record_latency(
+        direction& dir,
+        const steady_time_point& read_time)
+{
+    dir.latency_->record(
+                boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+                    boost::chrono::steady_clock::now() - read_time).count());
+}
+
+tcp_session::sp_buffer tcp_session::acquire_buffer(
+        size_t size)
+{
+    sp_buffer buffer;
+
+    buffer.data_ = config_.buffer_pool_->acquire(size);
+    buffer.size_ = size;
+    buffer.capacity_ = config_.buffer_pool_->get_class_size(size);
+
+    return buffer;
+}
+
+void tcp_session::adapt_read_size(
+        direction& dir,
+        size_t bytes_transferred)
+{
+    const size_t previous = dir.read_size_;
+
+    if (bytes_transferred >= dir.read_size_)
+    {
+        dir.small_reads_ = 0;
+        dir.read_size_ =
+                config_.buffer_pool_->get_class_size(dir.read_size_ * 2);
+    }
+    else if (bytes_transferred < dir.read_size_ / 4)
+    {
+        // a single short read is common at the end of a burst, so only a
+        // run of them shrinks the buffer
+        if (++dir.small_reads_ >= SMALL_READS_TO_SHRINK)
         {
-            hex_out << "   ";
+            dir.small_reads_ = 0;
+            dir.read_size_ =
+                    config_.buffer_pool_->get_class_size(dir.read_size_ / 2);
         }
+    }
+    else
+    {
+        dir.small_reads_ = 0;
+    }
 
-        out << hex_out.str() << "   " << ascii_out.str();
+    if (dir.read_size_ != previous)
+    {
+        LOG_TRACE() << (dir.server_flag_ ? "server" : "client")
+                    << " read buffer resized from=[" << previous << "] "
+                    << "to=[" << dir.read_size_ << "]";
     }
+}
 
-    LOG_DEBUG() << out.str();
+void tcp_session::dump(
+        const uint8_t* buffer,
+        size_t size)
+{
+    if (!config_.message_dumper_->dump(
+                dump_channel_,
+                config_.message_dump_ == hex ?
+                    core::message_dumper::hex : core::message_dumper::ascii,
+                buffer,
+                size))
+    {
+        LOG_TRACE() << "dump dropped bytes=[" << size << "]";
+    }
 }
 
 void tcp_session::stop()
 {
-    boost::lock_guard<boost::mutex> lock(mutex_);
+    strand_.dispatch(
+                boost::bind(
+                    &tcp_session::handle_stop, shared_from_this()));
+}
 
+void tcp_session::handle_stop()
+{
     if (info_.status_ != stopped)
     {
-        timeout_timer_.cancel();
+        if (idle_linked_)
+        {
+            config_.idle_wheel_->remove(idle_entry_);
+            idle_linked_ = false;
+        }
+
         server_timer_.cancel();
         client_timer_.cancel();
+        budget_timer_.cancel();
+        server_shaping_timer_.cancel();
+        client_shaping_timer_.cancel();
+
+        // the relays may have shut the sockets down already, so their state
+        // does not tell whether they were ever connected
+        sample_tcp_info(server_, config_.metrics_->client_tcp_);
+
+        if (upstream_connected_)
+            sample_tcp_info(client_, config_.metrics_->upstream_tcp_);
+
+        if (relay_flow_)
+        {
+            config_.uring_relay_->stop_relay(relay_flow_);
+            update_relay_totals();
+        }
+
         server_.close();
         client_.close();
         info_.status_ = stopped;
 
+        connecting_ = false;
+        resolver_.cancel();
+        cancel_attempts();
+
+        if (backend_)
+        {
+            backend_->active_sessions_.fetch_sub(
+                        1, boost::memory_order_relaxed);
+        }
+
+        if (config_.capture_)
+            config_.capture_->write_close(capture_flow_);
+
         info_.stop_time_ = boost::chrono::system_clock::now();
 
         LOG_INFO() << "stats tx=[" << info_.total_tx_ << "] "
                    << "rx=[" << info_.total_rx_ << "] "
+                   << "read-pauses=[" << info_.read_pauses_ << "] "
                    << "elapsed=[" << boost::chrono::duration_cast<
                       boost::chrono::milliseconds>(
                           info_.stop_time_ - info_.start_time_)
@@ -269,38 +1048,212 @@ void tcp_session::stop()
     }
 }
 
+void tcp_session::start_read(
+        direction& dir)
+{
+    if (dir.reading_ || info_.status_ != running)
+        return;
+
+    if (dir.queued_bytes_ >= config_.high_watermark_)
+    {
+        if (!dir.paused_)
+        {
+            LOG_TRACE() << (dir.server_flag_ ? "server" : "client")
+                        << " reads paused queued=[" << dir.queued_bytes_
+                        << "]";
+
+            dir.paused_ = true;
+            ++info_.read_pauses_;
+        }
+
+        return;
+    }
+
+    dir.paused_ = false;
+
+    if (config_.budget_ && config_.budget_->is_buffer_full())
+    {
+        if (!budget_paused_)
+        {
+            LOG_TRACE() << "reads paused by the budget";
+
+            budget_paused_ = true;
+            config_.metrics_->budget_read_pauses_.fetch_add(
+                        1, boost::memory_order_relaxed);
+        }
+
+        // the bytes are released by other sessions as well, so there is no
+        // write of this one to resume the reads
+        if (!budget_timer_armed_)
+        {
+            budget_timer_armed_ = true;
+
+            budget_timer_.expires_from_now(
+                        boost::posix_time::milliseconds(BUDGET_RETRY_MS));
+            budget_timer_.async_wait(
+                        strand_.wrap(
+                            boost::bind(
+                                &tcp_session::handle_budget_retry,
+                                shared_from_this(),
+                                boost::asio::placeholders::error)));
+        }
+
+        return;
+    }
+
+    budget_paused_ = false;
+
+    if (dir.shaping_)
+        return;
+
+    const uint64_t shaping_delay = get_shaping_delay(dir);
+
+    if (shaping_delay)
+    {
+        dir.shaping_ = true;
+        config_.metrics_->shaping_waits_.fetch_add(
+                    1, boost::memory_order_relaxed);
+
+        dir.shaping_timer_->expires_from_now(
+                    boost::posix_time::microseconds(shaping_delay));
+        dir.shaping_timer_->async_wait(
+                    strand_.wrap(
+                        boost::bind(
+                            &tcp_session::handle_shaping, shared_from_this(),
+                            boost::asio::placeholders::error,
+                            boost::ref(dir))));
+        return;
+    }
+
+    dir.reading_ = true;
+
+    // a read larger than the burst would pass the burst through at once
+    size_t read_size = dir.read_size_;
+
+    if (dir.shaper_ && dir.shaper_->get_burst())
+        read_size = std::min<size_t>(read_size, dir.shaper_->get_burst());
+
+    if (dir.aggregate_shaper_ && dir.aggregate_shaper_->get_burst())
+    {
+        read_size = std::min<size_t>(
+                    read_size, dir.aggregate_shaper_->get_burst());
+    }
+
+    sp_buffer buffer = acquire_buffer(read_size);
+
+    config_.metrics_->read_buffer_size_.record(buffer.capacity_);
+
+    dir.from_->async_read_some(
+                boost::asio::buffer(
+                    buffer.data_.get(), buffer.size_),
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_read, shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred,
+                        buffer,
+                        boost::ref(dir))));
+}
+
+void tcp_session::start_write(
+        direction& dir)
+{
+    if (dir.writing_ || dir.queue_.empty() || info_.status_ != running)
+        return;
+
+    dir.writing_ = true;
+
+    // every message read while the previous write was in progress goes out
+    // in one vectored write
+    dir.gathered_ = std::min(dir.queue_.size(), MAX_GATHER_BUFFERS);
+    dir.gather_.clear();
+
+    for (size_t i = 0; i < dir.gathered_; ++i)
+    {
+        dir.gather_.push_back(
+                    boost::asio::buffer(
+                        dir.queue_[i].data_.get(), dir.queue_[i].size_));
+    }
+
+    config_.metrics_->write_queue_depth_.record(dir.queue_.size());
+    config_.metrics_->write_gather_size_.record(dir.gathered_);
+
+    // the writes leave in full segments while the queue is not empty
+    if (dir.to_profile_)
+        dir.to_profile_->cork(*dir.to_, true);
+
+    boost::asio::async_write(
+                *dir.to_,
+                dir.gather_,
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_send, shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred,
+                        boost::ref(dir))));
+}
+
+void tcp_session::start_delay(
+        direction& dir)
+{
+    if (dir.timer_armed_ || dir.delayed_.empty() || info_.status_ != running)
+        return;
+
+    dir.timer_armed_ = true;
+
+    dir.timer_->expires_at(dir.delayed_.front().first);
+    dir.timer_->async_wait(
+                strand_.wrap(
+                    boost::bind(
+                        &tcp_session::handle_delay, shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::ref(dir))));
+}
+
+void tcp_session::handle_delay(
+        const boost::system::error_code& error_code,
+        direction& dir)
+{
+    dir.timer_armed_ = false;
+
+    if (error_code)
+        return;
+
+    const boost::posix_time::ptime now =
+            boost::posix_time::microsec_clock::universal_time();
+
+    // every message has the same delay, so the queue is sorted by deadline
+    while (!dir.delayed_.empty() && dir.delayed_.front().first <= now)
+    {
+        dir.queue_.push_back(dir.delayed_.front().second);
+        dir.delayed_.pop_front();
+    }
+
+    start_write(dir);
+    start_delay(dir);
+}
+
 void tcp_session::handle_read(
         const boost::system::error_code& error_code,
         size_t bytes_transferred,
         sp_buffer buffer_read,
-        boost::asio::ip::tcp::socket& from,
-        boost::asio::ip::tcp::socket& to,
-        bool server_flag)
+        direction& dir)
 {
+    boost::asio::ip::tcp::socket& from = *dir.from_;
+    boost::asio::ip::tcp::socket& to = *dir.to_;
+
     if (!error_code && bytes_transferred)
     {
         try
         {
-            if (config_.timeout_)
-                set_timeout(config_.timeout_);
-
-            to.async_send(
-                        boost::asio::buffer(
-                            buffer_read.first.get(),
-                            bytes_transferred),
-                        boost::bind(
-                            &tcp_session::handle_send,
-                            shared_from_this(),
-                            boost::asio::placeholders::error,
-                            boost::asio::placeholders::bytes_transferred,
-                            buffer_read));
+            if (config_.idle_wheel_)
+                mark_active();
 
-            if (server_flag)
+            if (dir.server_flag_)
             {
-                boost::lock_guard<boost::mutex> lock(mutex_);
-
                 info_.total_rx_ += bytes_transferred;
-
+                config_.metrics_->rx_bytes_.fetch_add(
+                            bytes_transferred, boost::memory_order_relaxed);
 
                 LOG_DEBUG() << "server=[" << from.local_endpoint().address()
                             << ":" << from.local_endpoint().port() << "/"
@@ -311,17 +1264,12 @@ void tcp_session::handle_read(
                             << (to.local_endpoint().address().is_v4() ?
                                     "ipv4" : "ipv6") << "] "
                             << "bytes=[" << bytes_transferred << "]";
-
-                if (config_.server_delay_)
-                    boost::this_thread::sleep_for(
-                                boost::chrono::microseconds(
-                                    config_.server_delay_));
             }
             else
             {
-                boost::lock_guard<boost::mutex> lock(mutex_);
-
                 info_.total_tx_ += bytes_transferred;
+                config_.metrics_->tx_bytes_.fetch_add(
+                            bytes_transferred, boost::memory_order_relaxed);
 
                 LOG_DEBUG() << "client=[" << from.local_endpoint().address()
                             << ":" << from.local_endpoint().port() << "/"
@@ -333,38 +1281,60 @@ void tcp_session::handle_read(
                                     "ipv4" : "ipv6") << "] "
                             << "bytes=[" << bytes_transferred << "]";
 
-
-                if (config_.client_delay_)
-                    boost::this_thread::sleep_for(
-                                boost::chrono::microseconds(
-                                    config_.client_delay_));
             }
 
-            if (config_.message_dump_ == hex)
+            if (config_.message_dump_ != none)
+                dump(buffer_read.data_.get(), bytes_transferred);
+
+            if (config_.capture_)
             {
-                hexdump(buffer_read.first.get(), bytes_transferred);
+                config_.capture_->write_data(
+                            capture_flow_,
+                            !dir.server_flag_,
+                            buffer_read.data_.get(),
+                            bytes_transferred);
             }
-            else if (config_.message_dump_ == ascii)
+
+            buffer_read.size_ = bytes_transferred;
+
+            if (dir.from_profile_)
+                dir.from_profile_->quick_ack(from);
+
+            adapt_read_size(dir, bytes_transferred);
+
+            dir.read_times_.push_back(boost::chrono::steady_clock::now());
+
+            dir.reading_ = false;
+            dir.queued_bytes_ += bytes_transferred;
+
+            if (config_.budget_)
+                config_.budget_->add_buffered(bytes_transferred);
+
+            if (dir.shaper_)
+                dir.shaper_->consume(bytes_transferred);
+
+            if (dir.aggregate_shaper_)
+                dir.aggregate_shaper_->consume(bytes_transferred);
+
+            if (dir.delay_)
             {
-                LOG_DEBUG() << "message=[" << buffer_read.first.get() << "]";
+                dir.delayed_.push_back(
+                            std::make_pair(
+                                boost::posix_time::microsec_clock::
+                                universal_time() +
+                                boost::posix_time::microseconds(dir.delay_),
+                                buffer_read));
+
+                start_delay(dir);
             }
+            else
+            {
+                dir.queue_.push_back(buffer_read);
 
-            sp_buffer buffer =
-                    std::make_pair(
-                        boost::make_shared<uint8_t[]>(config_.buffer_size_),
-                        config_.buffer_size_);
+                start_write(dir);
+            }
 
-            from.async_read_some(
-                        boost::asio::buffer(
-                            buffer.first.get(), buffer.second),
-                        boost::bind(
-                            &tcp_session::handle_read, shared_from_this(),
-                            boost::asio::placeholders::error,
-                            boost::asio::placeholders::bytes_transferred,
-                            buffer,
-                            boost::ref(from),
-                            boost::ref(to),
-                            server_flag));
+            start_read(dir);
         }
         catch (std::exception& e)
         {
@@ -373,6 +1343,9 @@ void tcp_session::handle_read(
     }
     else
     {
+        config_.buffer_pool_->release(
+                    buffer_read.data_, buffer_read.capacity_);
+
         if (!error_code)
         {
             LOG_ERROR() << "ec=[" << error_code << "] message=["
@@ -381,7 +1354,7 @@ void tcp_session::handle_read(
         else
         {
             LOG_DEBUG() << "connection closed - "
-                       << (server_flag ? "server" : "client");
+                       << (dir.server_flag_ ? "server" : "client");
         }
 
         stop();
@@ -392,7 +1365,7 @@ void tcp_session::handle_read(
 void tcp_session::handle_send(
         const boost::system::error_code& error_code,
         size_t bytes_transferred,
-        sp_buffer)
+        direction& dir)
 {
     LOG_TRACE() << "bytes sent: " << bytes_transferred;
 
@@ -400,5 +1373,34 @@ void tcp_session::handle_send(
     {
         LOG_ERROR() << "ec=[" << error_code << "] message=["
                     << error_code.message() << "]";
+
+        stop();
+        return;
+    }
+
+    dir.writing_ = false;
+
+    if (config_.budget_)
+        config_.budget_->remove_buffered(bytes_transferred);
+
+    dir.queued_bytes_ -= bytes_transferred;
+
+    for (; dir.gathered_ && !dir.queue_.empty(); --dir.gathered_)
+    {
+        config_.buffer_pool_->release(
+                    dir.queue_.front().data_, dir.queue_.front().capacity_);
+        dir.queue_.pop_front();
+
+        record_latency(dir, dir.read_times_.front());
+        dir.read_times_.pop_front();
     }
+
+    // the tail of the last write only leaves once nothing else is queued
+    if (dir.to_profile_ && dir.queue_.empty())
+        dir.to_profile_->cork(*dir.to_, false);
+
+    start_write(dir);
+
+    if (dir.paused_ && dir.queued_bytes_ <= config_.low_watermark_)
+        start_read(dir);
 }
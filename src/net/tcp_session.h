@@ -7,14 +7,28 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
+#include <vector>
 
-#include <boost/thread/mutex.hpp>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/chrono.hpp>
 #include <boost/signals2.hpp>
 
+#include "net/splice_pipe.h"
+#include "net/uring_relay.h"
+#include "net/socket_profile.h"
+#include "net/idle_wheel.h"
+#include "net/pcapng_writer.h"
+#include "net/proxy_metrics.h"
+#include "net/load_balancer.h"
+#include "net/admission_budget.h"
+#include "core/buffer_pool.h"
+#include "core/token_bucket.h"
+#include "core/message_dumper.h"
 #include "core/log.h"
 
 ///
@@ -56,21 +70,205 @@ public:
     ///
     typedef boost::shared_ptr<tcp_session> ptr;
 
+    ///
+    /// @brief Defines the type of the session identifier.
+    ///
+    typedef uint32_t id_type;
+
     ///
     /// @brief Defines a signal to handle session stop events.
     ///
     boost::signals2::signal<void(tcp_session::ptr)> signal_stopped_;
 
     ///
-    /// @brief Defines a buffer type which combines the buffer and its size.
+    /// @brief This structure combines a buffer borrowed from the buffer pool
+    /// with its sizes.
     ///
-    typedef std::pair<boost::shared_ptr<uint8_t[]>, size_t> sp_buffer;
+    typedef struct sp_buffer_
+    {
+        ///
+        /// @brief Holds the buffer.
+        ///
+        core::buffer_pool::buffer_ptr data_;
+
+        ///
+        /// @brief Holds the amount of bytes to be read or written.
+        ///
+        size_t size_;
+
+        ///
+        /// @brief Holds the size the buffer was borrowed with.
+        ///
+        size_t capacity_;
+
+    } sp_buffer;
 
     ///
     /// @brief Defines the type of time_point used by the session.
     ///
     typedef boost::chrono::system_clock::time_point time_point;
 
+    ///
+    /// @brief Defines the type of time_point used to measure latencies.
+    ///
+    typedef boost::chrono::steady_clock::time_point steady_time_point;
+
+    ///
+    /// @brief Defines a buffer held by the delay queue along with the time it
+    /// must be released.
+    ///
+    typedef std::pair<boost::posix_time::ptime, sp_buffer> delayed_buffer;
+
+    ///
+    /// @brief This structure holds the state of one direction of the buffered
+    /// relay.
+    ///
+    typedef struct direction_
+    {
+        ///
+        /// @brief Holds the socket the messages are read from.
+        ///
+        boost::asio::ip::tcp::socket* from_;
+
+        ///
+        /// @brief Holds the socket the messages are written to.
+        ///
+        boost::asio::ip::tcp::socket* to_;
+
+        ///
+        /// @brief Flag indicating whether it is the server direction.
+        ///
+        bool server_flag_;
+
+        ///
+        /// @brief Holds the socket profile of the side the messages are read
+        /// from. It may be null.
+        ///
+        const socket_profile* from_profile_;
+
+        ///
+        /// @brief Holds the socket profile of the side the messages are
+        /// written to. It may be null.
+        ///
+        const socket_profile* to_profile_;
+
+        ///
+        /// @brief Holds the period of time, in microseconds, the messages are
+        /// held before being written.
+        ///
+        uint64_t delay_;
+
+        ///
+        /// @brief Holds the timer used to release the delayed messages.
+        ///
+        boost::asio::deadline_timer* timer_;
+
+        ///
+        /// @brief Flag indicating whether the delay timer is armed.
+        ///
+        bool timer_armed_;
+
+        ///
+        /// @brief Holds the messages waiting for their delay to expire, in
+        /// arrival order.
+        ///
+        std::deque<delayed_buffer> delayed_;
+
+        ///
+        /// @brief Holds the messages waiting to be written. The front ones
+        /// are being written.
+        ///
+        std::deque<sp_buffer> queue_;
+
+        ///
+        /// @brief Holds the number of messages being written, gathered from
+        /// the front of the queue into a single write.
+        ///
+        size_t gathered_;
+
+        ///
+        /// @brief Holds the buffers of the write in progress. It is reused by
+        /// every write to avoid reallocating it.
+        ///
+        std::vector<boost::asio::const_buffer> gather_;
+
+        ///
+        /// @brief Holds the time each message waiting to be written, delayed
+        /// or not, was read, in arrival order.
+        ///
+        std::deque<steady_time_point> read_times_;
+
+        ///
+        /// @brief Holds the time the bytes held by the zero-copy pipe were
+        /// read.
+        ///
+        steady_time_point splice_time_;
+
+        ///
+        /// @brief Holds the histogram of the relay latency.
+        ///
+        core::histogram* latency_;
+
+        ///
+        /// @brief Holds the amount of bytes waiting to be written, including
+        /// the delayed ones.
+        ///
+        size_t queued_bytes_;
+
+        ///
+        /// @brief Flag indicating whether there is a read in progress.
+        ///
+        bool reading_;
+
+        ///
+        /// @brief Flag indicating whether there is a write in progress.
+        ///
+        bool writing_;
+
+        ///
+        /// @brief Flag indicating whether reads are paused because the
+        /// queued bytes reached the high watermark.
+        ///
+        bool paused_;
+
+        ///
+        /// @brief Holds the size of the next read buffer. It doubles after a
+        /// read fills the buffer and halves after a run of reads filling less
+        /// than a quarter of it.
+        ///
+        size_t read_size_;
+
+        ///
+        /// @brief Holds the number of consecutive reads filling less than a
+        /// quarter of the buffer.
+        ///
+        unsigned small_reads_;
+
+        ///
+        /// @brief Holds the rate limit of the direction in this session. It
+        /// is empty when there is no limit.
+        ///
+        core::token_bucket::ptr shaper_;
+
+        ///
+        /// @brief Holds the rate limit of the direction shared by all
+        /// sessions of the proxy. It is empty when there is no limit.
+        ///
+        core::token_bucket::ptr aggregate_shaper_;
+
+        ///
+        /// @brief Holds the timer used to resume the reads once the rate
+        /// limits allow it.
+        ///
+        boost::asio::deadline_timer* shaping_timer_;
+
+        ///
+        /// @brief Flag indicating whether the shaping timer is armed.
+        ///
+        bool shaping_;
+
+    } direction;
+
     ///
     /// @brief This structure defines counters and time points for collecting
     /// statistical information.
@@ -102,6 +300,12 @@ public:
         ///
         uint64_t total_rx_;
 
+        ///
+        /// @brief Holds how many times reads were paused because the peer was
+        /// not draining the written bytes fast enough.
+        ///
+        uint64_t read_pauses_;
+
     } info;
 
     ///
@@ -111,10 +315,10 @@ public:
     typedef struct config_
     {
         ///
-        /// @brief Holds the session identified. A key composed by eight
-        /// hexadecimal characters.
+        /// @brief Holds the session identifier. It is unique within the proxy
+        /// and logged as eight hexadecimal characters.
         ///
-        std::string id_;
+        id_type id_;
 
         ///
         /// @brief Holds the session name.
@@ -122,17 +326,9 @@ public:
         std::string type_;
 
         ///
-        /// @brief Holds the destination hostname or address.
-        ///
-        std::string host_;
-
-        ///
-        /// @brief Holds the destination por or service name.
-        ///
-        std::string port_;
-
-        ///
-        /// @brief Holds the buffer size used by this session.
+        /// @brief Holds the initial size of the read buffers and the size of
+        /// the zero-copy pipes. The read buffers are adapted within the sizes
+        /// of the buffer pool.
         ///
         size_t buffer_size_;
 
@@ -148,17 +344,146 @@ public:
         ///
         uint64_t server_delay_;
 
+        ///
+        /// @brief Holds the rate limit, in bytes per second, of the messages
+        /// from client in this session (0 - unlimited).
+        ///
+        uint64_t client_rate_;
+
+        ///
+        /// @brief Holds the burst size, in bytes, of the client rate limit.
+        ///
+        uint64_t client_burst_;
+
+        ///
+        /// @brief Holds the rate limit, in bytes per second, of the messages
+        /// from server in this session (0 - unlimited).
+        ///
+        uint64_t server_rate_;
+
+        ///
+        /// @brief Holds the burst size, in bytes, of the server rate limit.
+        ///
+        uint64_t server_burst_;
+
         ///
         /// @brief Holds the timeout period used by the connection drop. It is
         /// expressed in microseconds.
         ///
         uint64_t timeout_;
 
+        ///
+        /// @brief Holds the wheel that drops the idle sessions of the proxy.
+        /// It is empty when the timeout is disabled.
+        ///
+        idle_wheel::ptr idle_wheel_;
+
+        ///
+        /// @brief Holds the period of time, in microseconds, the connect
+        /// to the destination may take before the session is stopped
+        /// (0 - disabled).
+        ///
+        uint64_t connect_timeout_;
+
+        ///
+        /// @brief Holds the period of time, in microseconds, after which the
+        /// connect to the next endpoint starts while the previous ones are
+        /// still pending.
+        ///
+        uint64_t connect_stagger_;
+
+        ///
+        /// @brief Holds the amount of bytes waiting to be written above which
+        /// the reads on the same direction are paused.
+        ///
+        size_t high_watermark_;
+
+        ///
+        /// @brief Holds the amount of bytes waiting to be written below which
+        /// the paused reads are resumed.
+        ///
+        size_t low_watermark_;
+
         ///
         /// @brief Holds the message dump type.
         ///
         message_dump message_dump_;
 
+        ///
+        /// @brief Enables the zero-copy relay. It is only used when there is
+        /// no message dump and no delays.
+        ///
+        bool zero_copy_;
+
+        ///
+        /// @brief Holds the pool used to borrow the read buffers. It is shared
+        /// by all sessions of the same proxy.
+        ///
+        core::buffer_pool::ptr buffer_pool_;
+
+        ///
+        /// @brief Holds the dumper that formats and logs the messages off the
+        /// io threads. It is only used when there is a message dump.
+        ///
+        core::message_dumper::ptr message_dumper_;
+
+        ///
+        /// @brief Holds the writer that records the traffic to a pcapng file.
+        /// It is shared by all sessions of the same proxy and is empty when
+        /// the capture is disabled.
+        ///
+        pcapng_writer::ptr capture_;
+
+        ///
+        /// @brief Holds the live counters of the proxy.
+        ///
+        proxy_metrics::ptr metrics_;
+
+        ///
+        /// @brief Holds the balancer that selects the destination backend,
+        /// along with its endpoint cache and connection pool. It is shared
+        /// by all sessions of the same proxy.
+        ///
+        load_balancer::ptr balancer_;
+
+        ///
+        /// @brief Holds the budget of the buffered bytes. It is shared by all
+        /// sessions of the same proxy. The bytes held by the zero-copy pipes
+        /// and the io_uring relay are not accounted.
+        ///
+        admission_budget::ptr budget_;
+
+        ///
+        /// @brief Holds the io_uring relay of the proxy. It takes precedence
+        /// over the zero-copy relay and has the same restrictions (empty -
+        /// disabled).
+        ///
+        uring_relay::ptr uring_relay_;
+
+        ///
+        /// @brief Holds the socket options of the connection from the client.
+        /// It is shared by all sessions of the same proxy.
+        ///
+        socket_profile::ptr client_socket_;
+
+        ///
+        /// @brief Holds the socket options of the connection to the server.
+        /// It is shared by all sessions of the same proxy.
+        ///
+        socket_profile::ptr upstream_socket_;
+
+        ///
+        /// @brief Holds the rate limit of the messages from client shared by
+        /// all sessions of the proxy (empty - unlimited).
+        ///
+        core::token_bucket::ptr client_shaper_;
+
+        ///
+        /// @brief Holds the rate limit of the messages from server shared by
+        /// all sessions of the proxy (empty - unlimited).
+        ///
+        core::token_bucket::ptr server_shaper_;
+
     } config;
 
     ///
@@ -190,7 +515,9 @@ public:
 
     ///
     /// @brief Stops all connections and asynchronous operations. After that, a
-    /// stopped signal will be emited to his proxy owner.
+    /// stopped signal will be emited to his proxy owner. The work is
+    /// dispatched to the session strand, so it is safe to call this method
+    /// from any thread.
     ///
     virtual void stop();
 
@@ -199,7 +526,24 @@ public:
     ///
     /// @return The session identifier.
     ///
-    virtual const std::string& get_id();
+    virtual id_type get_id();
+
+    ///
+    /// @brief Gets the textual representation of the session identifier.
+    ///
+    /// @return The session identifier as eight hexadecimal characters.
+    ///
+    virtual const std::string& get_id_string();
+
+    ///
+    /// @brief Formats a session identifier as eight hexadecimal characters.
+    ///
+    /// @param id The session identifier.
+    ///
+    /// @return The formatted identifier.
+    ///
+    static std::string format_id(
+            id_type id);
 
     ///
     /// @brief Gets statistical information.
@@ -209,8 +553,85 @@ public:
     ///
     virtual const info& get_info();
 
+    ///
+    /// @brief Gets the tick of the idle wheel at the last activity of the
+    /// session. It is safe to call this method from any thread.
+    ///
+    /// @return The tick.
+    ///
+    uint64_t get_last_activity() const;
+
+    ///
+    /// @brief Checks whether the session is still idle, stopping it if so.
+    /// It is called by the idle wheel once the timeout expires and the work
+    /// is dispatched to the session strand.
+    ///
+    void check_idle();
+
 protected:
 
+    ///
+    /// @brief Handles a stop request inside the session strand.
+    ///
+    virtual void handle_stop();
+
+    ///
+    /// @brief Connects to the destination, straight to the cached endpoints
+    /// when there are some, or after resolving it otherwise.
+    ///
+    virtual void start_connect();
+
+    ///
+    /// @brief Races the connects to a list of endpoints. They start one at a
+    /// time, alternating the address families, and the next one starts
+    /// whenever the stagger period expires or the previous one fails. The
+    /// first to succeed is kept and the others are closed.
+    ///
+    /// @param endpoints The endpoints.
+    ///
+    virtual void start_attempts(
+            const resolver_cache::endpoint_list& endpoints);
+
+    ///
+    /// @brief Starts the connect to the next endpoint.
+    ///
+    virtual void start_attempt();
+
+    ///
+    /// @brief This handler is invoked whenever a connect to one of the
+    /// endpoints has been completed.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// connect operation.
+    /// @param socket The socket of the connect.
+    ///
+    virtual void handle_attempt(
+            const boost::system::error_code& error_code,
+            upstream_pool::socket_ptr socket);
+
+    ///
+    /// @brief This handler is invoked whenever the stagger period expires.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    virtual void handle_stagger(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief This handler is invoked whenever the connect deadline expires.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    virtual void handle_connect_timeout(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Closes the pending connects and cancels their timers.
+    ///
+    virtual void cancel_attempts();
+
     ///
     /// @brief This handler is invoked whenever the source hostname resolution
     /// has been completed.
@@ -224,14 +645,43 @@ protected:
             boost::asio::ip::tcp::resolver::iterator it);
 
     ///
-    /// @brief Handles a timeout event.
+    /// @brief Handles an idle check inside the session strand.
+    ///
+    virtual void handle_idle_check();
+
+    ///
+    /// @brief Handles the retry of the reads paused because the buffered
+    /// bytes reached the budget.
     ///
     /// @param error_code The error code which indicates the result of the
     /// async_wait operation.
     ///
-    virtual void handle_timeout(
+    void handle_budget_retry(
             const boost::system::error_code& error_code);
 
+    ///
+    /// @brief Handles the end of the wait imposed by the rate limits of a
+    /// direction.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// async_wait operation.
+    /// @param dir The direction whose reads are resumed.
+    ///
+    void handle_shaping(
+            const boost::system::error_code& error_code,
+            direction& dir);
+
+    ///
+    /// @brief Gets how long the next read of a direction must wait for its
+    /// rate limits.
+    ///
+    /// @param dir The direction.
+    ///
+    /// @return The period of time in microseconds (0 - no wait).
+    ///
+    uint64_t get_shaping_delay(
+            direction& dir);
+
     ///
     /// @brief Handles a connection event.
     ///
@@ -248,18 +698,13 @@ protected:
     /// read operation.
     /// @param bytes_transferred Total amount of bytes received.
     /// @param buffer Source buffer that contains the bytes received.
-    /// @param from Source socket.
-    /// @param to Destination socket.
-    /// @param server_flag Flag indicating whether it is a message from the
-    /// server.
+    /// @param dir The direction the message belongs to.
     ///
     virtual void handle_read(
             const boost::system::error_code& error_code,
             size_t bytes_transferred,
             sp_buffer buffer,
-            boost::asio::ip::tcp::socket& from,
-            boost::asio::ip::tcp::socket& to,
-            bool server_flag);
+            direction& dir);
 
     ///
     /// @brief Handles a send event.
@@ -267,29 +712,189 @@ protected:
     /// @param error_code The error code which indicates the result of the
     /// connect operation.
     /// @param bytes_transferred Total amount of bytes transmitted.
-    /// @param buffer Source buffer.
+    /// @param dir The direction the message belongs to.
     ///
     virtual void handle_send(
             const boost::system::error_code& error_code,
             size_t bytes_transferred,
-            sp_buffer buffer);
+            direction& dir);
+
+    ///
+    /// @brief Handles the expiration of a delay timer. Moves every message
+    /// whose delay expired to the write queue.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// async_wait operation.
+    /// @param dir The direction the timer belongs to.
+    ///
+    virtual void handle_delay(
+            const boost::system::error_code& error_code,
+            direction& dir);
+
+    ///
+    /// @brief Arms the delay timer of a direction for the oldest delayed
+    /// message. Must be called from the strand.
+    ///
+    /// @param dir The direction whose timer will be armed.
+    ///
+    virtual void start_delay(
+            direction& dir);
+
+    ///
+    /// @brief Starts a read on a direction unless there is already one in
+    /// progress or the queued bytes reached the high watermark. Must be called
+    /// from the strand.
+    ///
+    /// @param dir The direction to read from.
+    ///
+    virtual void start_read(
+            direction& dir);
+
+    ///
+    /// @brief Writes the queued messages of a direction, gathered into a
+    /// single write, unless there is already a write in progress. Must be
+    /// called from the strand.
+    ///
+    /// @param dir The direction to write to.
+    ///
+    virtual void start_write(
+            direction& dir);
+
+    ///
+    /// @brief Starts relaying one direction of the session with splice(2).
+    ///
+    /// @param from Source socket.
+    /// @param to Destination socket.
+    /// @param pipe Pipe used to move the bytes between both sockets.
+    /// @param server_flag Flag indicating whether it is the server direction.
+    ///
+    virtual void start_splice(
+            boost::asio::ip::tcp::socket& from,
+            boost::asio::ip::tcp::socket& to,
+            splice_pipe& pipe,
+            bool server_flag);
+
+    ///
+    /// @brief Handles a readiness event on the source socket of a zero-copy
+    /// relay. Moves the available bytes into the pipe and drains them to the
+    /// destination socket.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    /// @param from Source socket.
+    /// @param to Destination socket.
+    /// @param pipe Pipe used to move the bytes between both sockets.
+    /// @param server_flag Flag indicating whether it is the server direction.
+    ///
+    virtual void handle_splice_read(
+            const boost::system::error_code& error_code,
+            boost::asio::ip::tcp::socket& from,
+            boost::asio::ip::tcp::socket& to,
+            splice_pipe& pipe,
+            bool server_flag);
+
+    ///
+    /// @brief Handles a readiness event on the destination socket of a
+    /// zero-copy relay. Drains the bytes still held by the pipe.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    /// @param from Source socket.
+    /// @param to Destination socket.
+    /// @param pipe Pipe used to move the bytes between both sockets.
+    /// @param server_flag Flag indicating whether it is the server direction.
+    ///
+    virtual void handle_splice_write(
+            const boost::system::error_code& error_code,
+            boost::asio::ip::tcp::socket& from,
+            boost::asio::ip::tcp::socket& to,
+            splice_pipe& pipe,
+            bool server_flag);
+
+    ///
+    /// @brief This handler is invoked whenever the io_uring relay of the
+    /// session ends because a peer closed the connection or failed.
+    ///
+    /// @param error_code The error code which indicates why the relay ended.
+    ///
+    virtual void handle_relay_closed(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Copies the byte counters of the io_uring relay into the session
+    /// statistics.
+    ///
+    /// @return True if any byte was relayed since the last call.
+    ///
+    bool update_relay_totals();
+
+    ///
+    /// @brief Applies a socket profile, logging the options the kernel
+    /// rejects.
+    ///
+    /// @param socket The socket, which must be open.
+    /// @param profile The profile. Nothing is done if it is null.
+    ///
+    void apply_profile(
+            boost::asio::ip::tcp::socket& socket,
+            const socket_profile::ptr& profile);
+
+    ///
+    /// @brief Samples the kernel statistics of a connection about to close.
+    /// The connection must have been established.
+    ///
+    /// @param socket The connection.
+    /// @param stats The statistics of its side of the proxy.
+    ///
+    void sample_tcp_info(
+            boost::asio::ip::tcp::socket& socket,
+            tcp_stats& stats);
+
+    ///
+    /// @brief Borrows a read buffer from the proxy buffer pool.
+    ///
+    /// @param size The amount of bytes to be read.
+    ///
+    /// @return The buffer and its size.
+    ///
+    sp_buffer acquire_buffer(
+            size_t size);
+
+    ///
+    /// @brief Grows or shrinks the read buffer of a direction according to
+    /// how much of it the last read filled.
+    ///
+    /// @param dir The direction that was read.
+    /// @param bytes_transferred The amount of bytes read.
+    ///
+    void adapt_read_size(
+            direction& dir,
+            size_t bytes_transferred);
 
     ///
-    /// @brief Sets a session timeout. This is useful to drops inactive
-    /// connections.
+    /// @brief Records the current tick of the idle wheel as the last
+    /// activity of the session.
     ///
-    /// @param timeout Timeout expressed in microseconds.
+    void mark_active();
+
     ///
-    virtual void set_timeout(
-            uint64_t timeout);
+    /// @brief Records the time elapsed since a message was read in the
+    /// latency histogram of its direction.
+    ///
+    /// @param dir The direction of the message.
+    /// @param read_time The time the message was read.
+    ///
+    void record_latency(
+            direction& dir,
+            const steady_time_point& read_time);
 
     ///
-    /// @brief Prints the hexadecimal representation of a buffer.
+    /// @brief Queues a message to be dumped by the message dumper.
     ///
-    /// @param buffer Buffer that will be printed.
+    /// @param buffer Buffer that will be dumped.
     /// @param size Buffer size.
     ///
-    void hexdump(
+    void dump(
             const uint8_t* buffer,
             size_t size);
 
@@ -299,12 +904,28 @@ protected:
     ///
     core::logger_type logger_;
 
+    ///
+    /// @brief Holds the textual representation of the session identifier.
+    ///
+    std::string id_string_;
+
+    ///
+    /// @brief Holds the log channel of the message dumps.
+    ///
+    core::message_dumper::channel_ptr dump_channel_;
+
     ///
     /// @brief Holds the io_service reference used to process all asynchronous
     /// operations.
     ///
     boost::asio::io_service& io_service_;
 
+    ///
+    /// @brief Strand used to serialize all handlers of the session. Every
+    /// member below is only accessed from this strand.
+    ///
+    boost::asio::io_service::strand strand_;
+
     ///
     /// @brief Holds the socket from the client side.
     ///
@@ -321,14 +942,74 @@ protected:
     boost::asio::ip::tcp::resolver resolver_;
 
     ///
-    /// @brief Query used to resolve the destination service name.
+    /// @brief Holds the backend selected for this session.
     ///
-    boost::asio::ip::tcp::resolver::query to_;
+    load_balancer::backend::ptr backend_;
 
     ///
-    /// @brief Timer used to handle connection drop by timeout.
+    /// @brief Holds the endpoints being connected to, in the order the
+    /// connects start.
     ///
-    boost::asio::deadline_timer timeout_timer_;
+    resolver_cache::endpoint_list candidates_;
+
+    ///
+    /// @brief Holds the index of the next endpoint to connect to.
+    ///
+    size_t next_candidate_;
+
+    ///
+    /// @brief Holds the sockets of the connects started so far.
+    ///
+    std::vector<upstream_pool::socket_ptr> attempts_;
+
+    ///
+    /// @brief Holds the number of connects that failed so far.
+    ///
+    size_t failed_attempts_;
+
+    ///
+    /// @brief Flag indicating whether the connects are racing.
+    ///
+    bool connecting_;
+
+    ///
+    /// @brief Flag indicating whether the connection to the server has been
+    /// established.
+    ///
+    bool upstream_connected_;
+
+    ///
+    /// @brief Flag indicating whether the connection to the server was taken
+    /// from the upstream pool.
+    ///
+    bool pooled_;
+
+    ///
+    /// @brief Timer used to start the next connect.
+    ///
+    boost::asio::deadline_timer stagger_timer_;
+
+    ///
+    /// @brief Timer used to bound the connect time.
+    ///
+    boost::asio::deadline_timer connect_timer_;
+
+    ///
+    /// @brief Holds the tick of the idle wheel at the last activity. It is
+    /// written from the session strand and read by the wheel.
+    ///
+    boost::atomic<uint64_t> last_activity_;
+
+    ///
+    /// @brief Holds the entry of the session in the idle wheel.
+    ///
+    idle_wheel::handle idle_entry_;
+
+    ///
+    /// @brief Flag indicating whether the session has an entry in the idle
+    /// wheel.
+    ///
+    bool idle_linked_;
 
     ///
     /// @brief Timer used to handle server delays.
@@ -340,6 +1021,70 @@ protected:
     ///
     boost::asio::deadline_timer client_timer_;
 
+    ///
+    /// @brief Timer used to wait for the rate limits of the messages from
+    /// server.
+    ///
+    boost::asio::deadline_timer server_shaping_timer_;
+
+    ///
+    /// @brief Timer used to wait for the rate limits of the messages from
+    /// client.
+    ///
+    boost::asio::deadline_timer client_shaping_timer_;
+
+    ///
+    /// @brief Timer used to retry the reads paused by the budget.
+    ///
+    boost::asio::deadline_timer budget_timer_;
+
+    ///
+    /// @brief Flag indicating whether the budget timer is armed.
+    ///
+    bool budget_timer_armed_;
+
+    ///
+    /// @brief Flag indicating whether the reads are paused by the budget.
+    ///
+    bool budget_paused_;
+
+    ///
+    /// @brief Holds the state of the messages from server.
+    ///
+    direction server_direction_;
+
+    ///
+    /// @brief Holds the state of the messages from client.
+    ///
+    direction client_direction_;
+
+    ///
+    /// @brief Pipe used by the zero-copy relay for messages from server.
+    ///
+    boost::scoped_ptr<splice_pipe> server_pipe_;
+
+    ///
+    /// @brief Pipe used by the zero-copy relay for messages from client.
+    ///
+    boost::scoped_ptr<splice_pipe> client_pipe_;
+
+    ///
+    /// @brief Holds the session state within the io_uring relay. It is empty
+    /// when the session is relayed otherwise.
+    ///
+    uring_relay::flow::ptr relay_flow_;
+
+    ///
+    /// @brief Holds the state of the connection recorded by the capture.
+    ///
+    pcapng_writer::flow capture_flow_;
+
+    ///
+    /// @brief Holds the time the session was started, used to measure the
+    /// connect latency.
+    ///
+    steady_time_point start_steady_time_;
+
     ///
     /// @brief Holds the configuration.
     ///
@@ -350,11 +1095,6 @@ protected:
     ///
     config config_;
 
-    ///
-    /// @brief Mutex used to synchronize access to this class.
-    ///
-    boost::mutex mutex_;
-
 };
 
 } // namespace net
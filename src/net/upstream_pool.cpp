@@ -0,0 +1,317 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <cerrno>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "net/upstream_pool.h"
+using namespace net;
+
+upstream_pool::upstream_pool(
+        boost::asio::io_service& io_service,
+        const std::string& name,
+        const std::string& host,
+        const std::string& port,
+        size_t size,
+        uint64_t max_idle,
+        const resolver_cache::ptr& cache) :
+    logger_(boost::log::keywords::channel = "net.upstream_pool." + name),
+    io_service_(io_service),
+    strand_(io_service),
+    resolver_(io_service),
+    to_(host, port),
+    cache_(cache),
+    timer_(io_service),
+    size_(size),
+    max_idle_(max_idle),
+    stopping_(false)
+{
+    info_ = info();
+
+    LOG_TRACE() << "ctor";
+}
+
+upstream_pool::~upstream_pool()
+{
+    LOG_TRACE() << "dtor";
+}
+
+void upstream_pool::start()
+{
+    LOG_INFO() << "starting size=[" << size_ << "] "
+               << "max-idle=[" << max_idle_.count() << "]";
+
+    strand_.post(boost::bind(&upstream_pool::refill, shared_from_this()));
+
+    start_timer();
+}
+
+void upstream_pool::stop()
+{
+    strand_.dispatch(
+                boost::bind(&upstream_pool::handle_stop, shared_from_this()));
+}
+
+void upstream_pool::handle_stop()
+{
+    boost::system::error_code ignored;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        if (stopping_)
+            return;
+
+        stopping_ = true;
+
+        BOOST_FOREACH(idle_socket& idle, idle_)
+        {
+            idle.second->close(ignored);
+        }
+
+        idle_.clear();
+    }
+
+    // the connects in progress complete with operation_aborted
+    BOOST_FOREACH(const socket_ptr& socket, pending_)
+    {
+        socket->close(ignored);
+    }
+
+    resolver_.cancel();
+    timer_.cancel(ignored);
+
+    info pool_info = get_info();
+
+    LOG_INFO() << "stopped connects=[" << pool_info.connects_ << "] "
+               << "connect-failures=[" << pool_info.connect_failures_ << "] "
+               << "discards=[" << pool_info.discards_ << "]";
+}
+
+upstream_pool::socket_ptr upstream_pool::acquire()
+{
+    socket_ptr socket;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        if (stopping_)
+            return socket;
+
+        const time_point now = boost::chrono::steady_clock::now();
+
+        // the most recent connection is the least likely to be stale
+        while (!idle_.empty() && !socket)
+        {
+            if (is_usable(idle_.back(), now))
+                socket = idle_.back().second;
+
+            idle_.pop_back();
+        }
+    }
+
+    strand_.post(boost::bind(&upstream_pool::refill, shared_from_this()));
+
+    return socket;
+}
+
+upstream_pool::info upstream_pool::get_info()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    return info_;
+}
+
+void upstream_pool::refill()
+{
+    size_t missing = 0;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        if (stopping_)
+            return;
+
+        if (idle_.size() + pending_.size() < size_)
+            missing = size_ - idle_.size() - pending_.size();
+    }
+
+    for (size_t i = 0; i < missing; ++i)
+    {
+        socket_ptr socket =
+                boost::make_shared<boost::asio::ip::tcp::socket>(io_service_);
+
+        pending_.insert(socket);
+
+        resolver_cache::endpoints_ptr endpoints;
+
+        if (cache_)
+            endpoints = cache_->get_endpoints();
+
+        if (endpoints)
+        {
+            boost::asio::async_connect(
+                        *socket,
+                        endpoints->begin(),
+                        endpoints->end(),
+                        strand_.wrap(
+                            boost::bind(
+                                &upstream_pool::handle_connect,
+                                shared_from_this(),
+                                boost::asio::placeholders::error,
+                                socket,
+                                endpoints)));
+            continue;
+        }
+
+        resolver_.async_resolve(
+                    to_,
+                    strand_.wrap(
+                        boost::bind(
+                            &upstream_pool::handle_resolve,
+                            shared_from_this(),
+                            boost::asio::placeholders::error,
+                            boost::asio::placeholders::iterator,
+                            socket)));
+    }
+}
+
+void upstream_pool::handle_resolve(
+        const boost::system::error_code& error_code,
+        boost::asio::ip::tcp::resolver::iterator it,
+        socket_ptr socket)
+{
+    if (error_code)
+    {
+        handle_connect(error_code, socket, resolver_cache::endpoints_ptr());
+        return;
+    }
+
+    boost::asio::async_connect(
+                *socket,
+                it,
+                strand_.wrap(
+                    boost::bind(
+                        &upstream_pool::handle_connect,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        socket,
+                        resolver_cache::endpoints_ptr())));
+}
+
+void upstream_pool::handle_connect(
+        const boost::system::error_code& error_code,
+        socket_ptr socket,
+        resolver_cache::endpoints_ptr)
+{
+    pending_.erase(socket);
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    if (stopping_)
+    {
+        boost::system::error_code ignored;
+        socket->close(ignored);
+        return;
+    }
+
+    if (error_code)
+    {
+        // the periodic check retries, so an unreachable destination is not
+        // hammered
+        ++info_.connect_failures_;
+
+        LOG_WARNING() << "ec=[" << error_code << "] message=["
+                      << error_code.message() << "]";
+        return;
+    }
+
+    ++info_.connects_;
+
+    idle_.push_back(std::make_pair(boost::chrono::steady_clock::now(), socket));
+}
+
+void upstream_pool::start_timer()
+{
+    // checks twice per idle age, so no connection outlives it by more than
+    // a half, but not more often than every 100ms
+    uint64_t period = 1000000;
+
+    if (max_idle_.count())
+        period = std::max<uint64_t>(max_idle_.count() / 2, 100000);
+
+    timer_.expires_from_now(boost::posix_time::microseconds(period));
+
+    timer_.async_wait(
+                strand_.wrap(
+                    boost::bind(
+                        &upstream_pool::handle_timer,
+                        shared_from_this(),
+                        boost::asio::placeholders::error)));
+}
+
+void upstream_pool::handle_timer(
+        const boost::system::error_code& error_code)
+{
+    if (error_code)
+        return;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+
+        if (stopping_)
+            return;
+
+        const time_point now = boost::chrono::steady_clock::now();
+        std::deque<idle_socket> usable;
+
+        BOOST_FOREACH(const idle_socket& idle, idle_)
+        {
+            if (is_usable(idle, now))
+                usable.push_back(idle);
+        }
+
+        idle_.swap(usable);
+    }
+
+    refill();
+    start_timer();
+}
+
+bool upstream_pool::is_usable(
+        const idle_socket& idle,
+        const time_point& now)
+{
+    bool usable = !max_idle_.count() || now - idle.first < max_idle_;
+
+    if (usable)
+    {
+        // a connection closed by the destination reads as end of file, while
+        // a live one has nothing to read or a greeting waiting to be relayed
+        char byte;
+        ssize_t n = ::recv(idle.second->native_handle(), &byte, 1,
+                           MSG_PEEK | MSG_DONTWAIT);
+
+        usable = n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    if (!usable)
+    {
+        boost::system::error_code ignored;
+        idle.second->close(ignored);
+
+        ++info_.discards_;
+    }
+
+    return usable;
+}
@@ -0,0 +1,284 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "net/resolver_cache.h"
+#include "core/log.h"
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class keeps a number of connections to the destination open
+/// ahead of time, so the sessions can skip the upstream handshake.
+///
+/// A connection taken by a session is replaced right away. Idle connections
+/// older than the maximum idle age, or closed by the destination, are
+/// discarded and replaced by a periodic check, which also retries the failed
+/// connections.
+///
+class upstream_pool :
+        public boost::enable_shared_from_this<upstream_pool>
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<upstream_pool> ptr;
+
+    ///
+    /// @brief Defines a shared_ptr for the socket.
+    ///
+    typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+    ///
+    /// @brief Defines the type of time_point used by the pool.
+    ///
+    typedef boost::chrono::steady_clock::time_point time_point;
+
+    ///
+    /// @brief This structure holds the pool counters.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of connections established.
+        ///
+        uint64_t connects_;
+
+        ///
+        /// @brief Holds the number of connections that failed.
+        ///
+        uint64_t connect_failures_;
+
+        ///
+        /// @brief Holds the number of connections discarded because they
+        /// were idle for too long or closed by the destination.
+        ///
+        uint64_t discards_;
+
+    } info;
+
+    ///
+    /// @brief Constructor.
+    ///
+    /// @param io_service Reference to io_service.
+    /// @param name The proxy name, used by the logger.
+    /// @param host The destination hostname or address.
+    /// @param port The destination port or service name.
+    /// @param size The number of idle connections kept open.
+    /// @param max_idle The period of time, in microseconds, after which an
+    /// idle connection is replaced (0 - never).
+    /// @param cache The cache of the destination endpoints (empty - resolve
+    /// every connection).
+    ///
+    upstream_pool(
+            boost::asio::io_service& io_service,
+            const std::string& name,
+            const std::string& host,
+            const std::string& port,
+            size_t size,
+            uint64_t max_idle,
+            const resolver_cache::ptr& cache);
+
+    ///
+    /// @brief Destructor.
+    ///
+    virtual ~upstream_pool();
+
+    ///
+    /// @brief Starts filling the pool.
+    ///
+    void start();
+
+    ///
+    /// @brief Closes all connections and stops refilling the pool. It is
+    /// safe to call this method from any thread.
+    ///
+    void stop();
+
+    ///
+    /// @brief Takes an idle connection from the pool and starts its
+    /// replacement. It is safe to call this method from any thread.
+    ///
+    /// @return The connection or an empty pointer if there is none.
+    ///
+    socket_ptr acquire();
+
+    ///
+    /// @brief Gets the pool counters.
+    ///
+    /// @return The counters.
+    ///
+    info get_info();
+
+protected:
+
+    ///
+    /// @brief Defines an idle connection along with the time it was
+    /// established.
+    ///
+    typedef std::pair<time_point, socket_ptr> idle_socket;
+
+    ///
+    /// @brief Handles a stop request inside the pool strand.
+    ///
+    void handle_stop();
+
+    ///
+    /// @brief Starts as many connections as needed to reach the pool size.
+    /// It runs inside the pool strand.
+    ///
+    void refill();
+
+    ///
+    /// @brief This handler is invoked whenever the destination hostname
+    /// resolution has been completed.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// resolve operation.
+    /// @param it The iterator to the endpoint list.
+    /// @param socket The connection being established.
+    ///
+    void handle_resolve(
+            const boost::system::error_code& error_code,
+            boost::asio::ip::tcp::resolver::iterator it,
+            socket_ptr socket);
+
+    ///
+    /// @brief This handler is invoked whenever a connection has been
+    /// completed.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// connect operation.
+    /// @param socket The connection.
+    /// @param endpoints The cached endpoints being connected to, if any. They
+    /// are kept alive until the connect completes.
+    ///
+    void handle_connect(
+            const boost::system::error_code& error_code,
+            socket_ptr socket,
+            resolver_cache::endpoints_ptr endpoints);
+
+    ///
+    /// @brief Arms the timer of the periodic check.
+    ///
+    void start_timer();
+
+    ///
+    /// @brief This handler is invoked periodically to discard the stale
+    /// connections and refill the pool.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    void handle_timer(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Checks whether an idle connection can still be used. Must be
+    /// called with the mutex locked.
+    ///
+    /// @param idle The idle connection.
+    /// @param now The current time.
+    ///
+    /// @return True if it is young enough and not closed by the destination.
+    ///
+    bool is_usable(
+            const idle_socket& idle,
+            const time_point& now);
+
+    ///
+    /// @brief Holds the logger responsible for logging events from objects of
+    /// this class.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Holds the io_service reference used to process all asynchronous
+    /// operations.
+    ///
+    boost::asio::io_service& io_service_;
+
+    ///
+    /// @brief Strand used to serialize the connects, the timer and the stop.
+    ///
+    boost::asio::io_service::strand strand_;
+
+    ///
+    /// @brief Resolver used to resolve the destination hostname.
+    ///
+    boost::asio::ip::tcp::resolver resolver_;
+
+    ///
+    /// @brief Query used to resolve the destination hostname and service name.
+    ///
+    boost::asio::ip::tcp::resolver::query to_;
+
+    ///
+    /// @brief Holds the cache of the destination endpoints.
+    ///
+    resolver_cache::ptr cache_;
+
+    ///
+    /// @brief Holds the timer of the periodic check.
+    ///
+    boost::asio::deadline_timer timer_;
+
+    ///
+    /// @brief Holds the number of idle connections kept open.
+    ///
+    size_t size_;
+
+    ///
+    /// @brief Holds the maximum idle age (0 - unlimited).
+    ///
+    boost::chrono::microseconds max_idle_;
+
+    ///
+    /// @brief Holds the idle connections, the most recent at the back.
+    ///
+    std::deque<idle_socket> idle_;
+
+    ///
+    /// @brief Holds the connections being established. It is only accessed
+    /// from the pool strand.
+    ///
+    boost::unordered_set<socket_ptr> pending_;
+
+    ///
+    /// @brief Holds the pool counters.
+    ///
+    info info_;
+
+    ///
+    /// @brief Flag indicating whether the pool is stopping.
+    ///
+    bool stopping_;
+
+    ///
+    /// @brief Mutex used to synchronize the access to the idle connections,
+    /// the counters and the stopping flag.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace net
@@ -0,0 +1,1157 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#ifdef PROXY_HAS_IO_URING
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "net/uring_relay.h"
+using namespace net;
+
+#ifdef PROXY_HAS_IO_URING
+
+namespace {
+
+///
+/// @brief Defines the number of bits of the user data holding the operation.
+///
+const unsigned OPERATION_BITS = 3;
+
+///
+/// @brief Defines the identifier of the buffer group used by the receives.
+///
+const uint16_t BUFFER_GROUP = 0;
+
+///
+/// @brief Defines the largest buffer ring accepted by the kernel.
+///
+const unsigned MAX_BUFFERS = 32768;
+
+///
+/// @brief Defines the period of time, in milliseconds, after which the
+/// receives paused by the budget are retried.
+///
+const long BUDGET_RETRY_MS = 10;
+
+int io_uring_setup(
+        unsigned entries,
+        struct io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(
+        int fd,
+        unsigned to_submit,
+        unsigned min_complete,
+        unsigned flags)
+{
+    return static_cast<int>(
+                syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0));
+}
+
+int io_uring_register(
+        int fd,
+        unsigned opcode,
+        void* arg,
+        unsigned nr_args)
+{
+    return static_cast<int>(
+                syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+void throw_errno(
+        const char* what)
+{
+    throw boost::system::system_error(
+                boost::system::error_code(
+                    errno, boost::system::system_category()),
+                what);
+}
+
+uint64_t make_user_data(
+        uint64_t id,
+        unsigned op)
+{
+    return (id << OPERATION_BITS) | op;
+}
+
+} // namespace
+
+uring_relay::uring_relay(
+        boost::asio::io_service& io_service,
+        const std::string& name,
+        unsigned entries,
+        unsigned buffer_count,
+        size_t buffer_size,
+        size_t high_watermark,
+        size_t low_watermark,
+        const proxy_metrics::ptr& metrics,
+        const admission_budget::ptr& budget) :
+    logger_(boost::log::keywords::channel = "net.uring_relay." + name),
+    io_service_(io_service),
+    strand_(io_service),
+    event_(io_service),
+    event_value_(0),
+    ring_fd_(-1),
+    rings_(MAP_FAILED),
+    rings_size_(0),
+    sqes_(NULL),
+    sqes_size_(0),
+    to_submit_(0),
+    buffer_ring_(MAP_FAILED),
+    buffer_ring_size_(0),
+    buffer_count_(1),
+    buffer_size_(buffer_size),
+    buffer_tail_(0),
+    free_buffers_(0),
+    high_watermark_(high_watermark),
+    low_watermark_(low_watermark),
+    metrics_(metrics),
+    budget_(budget),
+    budget_timer_(io_service),
+    budget_timer_armed_(false),
+    next_id_(1),
+    stopping_(false)
+{
+    LOG_TRACE() << "ctor";
+
+    info_ = info();
+
+    while (buffer_count_ < buffer_count && buffer_count_ < MAX_BUFFERS)
+        buffer_count_ <<= 1;
+
+    try
+    {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        // leaves room for the completions of every multishot receive
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = 4 * entries;
+
+        ring_fd_ = io_uring_setup(entries, &params);
+
+        if (ring_fd_ < 0)
+            throw_errno("io_uring_setup");
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_NODROP))
+        {
+            throw boost::system::system_error(
+                        boost::asio::error::operation_not_supported,
+                        "io_uring features");
+        }
+
+        rings_size_ = std::max<size_t>(
+                    params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                    params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe));
+
+        rings_ = mmap(NULL, rings_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+
+        if (rings_ == MAP_FAILED)
+            throw_errno("mmap rings");
+
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd_,
+                          IORING_OFF_SQES);
+
+        if (sqes == MAP_FAILED)
+            throw_errno("mmap sqes");
+
+        sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+        uint8_t* rings = static_cast<uint8_t*>(rings_);
+
+        sq_head_ = reinterpret_cast<unsigned*>(rings + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(rings + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(
+                    rings + params.sq_off.ring_mask);
+        sq_flags_ = reinterpret_cast<unsigned*>(rings + params.sq_off.flags);
+        sq_array_ = reinterpret_cast<unsigned*>(rings + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+
+        cq_head_ = reinterpret_cast<unsigned*>(rings + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(rings + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(
+                    rings + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe*>(
+                    rings + params.cq_off.cqes);
+
+        // every entry keeps the same slot, so the index array is filled once
+        for (unsigned i = 0; i < sq_entries_; ++i)
+            sq_array_[i] = i;
+
+        buffer_ring_size_ = buffer_count_ * sizeof(struct io_uring_buf);
+
+        buffer_ring_ = mmap(NULL, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buffer_ring_ == MAP_FAILED)
+            throw_errno("mmap buffer ring");
+
+        struct io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+
+        reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        reg.ring_entries = buffer_count_;
+        reg.bgid = BUFFER_GROUP;
+
+        if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1))
+            throw_errno("io_uring_register buffer ring");
+
+        buffers_.resize(buffer_count_ * buffer_size_);
+
+        for (unsigned bid = 0; bid < buffer_count_; ++bid)
+            recycle(static_cast<uint16_t>(bid));
+
+        int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (event_fd < 0)
+            throw_errno("eventfd");
+
+        event_.assign(event_fd);
+
+        if (io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd, 1))
+            throw_errno("io_uring_register eventfd");
+    }
+    catch (...)
+    {
+        close_ring();
+        throw;
+    }
+}
+
+uring_relay::~uring_relay()
+{
+    LOG_TRACE() << "dtor";
+
+    close_ring();
+}
+
+bool uring_relay::is_supported()
+{
+    static const bool supported = probe();
+
+    return supported;
+}
+
+bool uring_relay::probe()
+{
+    try
+    {
+        boost::asio::io_service io_service;
+        uring_relay relay(io_service, "probe", 4, 1, 64, 0, 0,
+                          proxy_metrics::ptr(), admission_budget::ptr());
+
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+            return false;
+
+        // older kernels accept the buffer ring but reject the multishot
+        // receives, so one is tried on a socket pair
+        struct io_uring_sqe* sqe = relay.get_sqe();
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fds[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = make_user_data(1, receive_client);
+
+        bool supported = false;
+
+        if (write(fds[1], "x", 1) == 1 &&
+            io_uring_enter(relay.ring_fd_, relay.to_submit_, 1,
+                           IORING_ENTER_GETEVENTS) == 1)
+        {
+            const struct io_uring_cqe& cqe =
+                    relay.cqes_[*relay.cq_head_ & relay.cq_mask_];
+
+            supported = cqe.res == 1 &&
+                    (cqe.flags & IORING_CQE_F_BUFFER) &&
+                    (cqe.flags & IORING_CQE_F_MORE);
+        }
+
+        close(fds[0]);
+        close(fds[1]);
+
+        return supported;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+void uring_relay::start()
+{
+    LOG_INFO() << "starting entries=[" << sq_entries_ << "] "
+               << "buffers=[" << buffer_count_ << "] "
+               << "buffer-size=[" << buffer_size_ << "]";
+
+    strand_.post(boost::bind(&uring_relay::start_wait, shared_from_this()));
+}
+
+void uring_relay::stop()
+{
+    strand_.dispatch(
+                boost::bind(&uring_relay::handle_stop, shared_from_this()));
+}
+
+void uring_relay::handle_stop()
+{
+    if (stopping_)
+        return;
+
+    stopping_ = true;
+
+    // copies the flows since the released ones are erased from the map
+    std::vector<flow::ptr> flows;
+
+    BOOST_FOREACH(flow_map::value_type& entry, flows_)
+    {
+        flows.push_back(entry.second);
+    }
+
+    BOOST_FOREACH(flow::ptr& relay_flow, flows)
+    {
+        close_flow(*relay_flow, boost::asio::error::operation_aborted);
+    }
+
+    submit();
+
+    boost::system::error_code ignored;
+    event_.cancel(ignored);
+    budget_timer_.cancel(ignored);
+
+    info relay_info = get_info();
+
+    LOG_INFO() << "stopped enters=[" << relay_info.enters_ << "] "
+               << "submissions=[" << relay_info.submissions_ << "] "
+               << "completions=[" << relay_info.completions_ << "] "
+               << "buffer-exhaustions=["
+               << relay_info.buffer_exhaustions_ << "]";
+}
+
+uring_relay::flow::ptr uring_relay::start_relay(
+        int client_fd,
+        int server_fd,
+        const close_handler& handler)
+{
+    flow::ptr relay_flow = boost::make_shared<flow>();
+
+    relay_flow->id_ = next_id_.fetch_add(1, boost::memory_order_relaxed);
+    relay_flow->fds_[0] = fcntl(client_fd, F_DUPFD_CLOEXEC, 0);
+    relay_flow->fds_[1] = fcntl(server_fd, F_DUPFD_CLOEXEC, 0);
+
+    if (relay_flow->fds_[0] < 0 || relay_flow->fds_[1] < 0)
+    {
+        const int error = errno;
+
+        for (int i = 0; i < 2; ++i)
+        {
+            if (relay_flow->fds_[i] >= 0)
+                close(relay_flow->fds_[i]);
+        }
+
+        errno = error;
+        throw_errno("dup");
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+        flow::half& half = relay_flow->halves_[i];
+
+        half.from_ = relay_flow->fds_[i];
+        half.to_ = relay_flow->fds_[1 - i];
+        half.queued_bytes_ = 0;
+        half.receiving_ = false;
+        half.sending_ = false;
+        half.paused_ = false;
+        half.budget_paused_ = false;
+        half.starved_ = false;
+        half.eof_ = false;
+
+        relay_flow->bytes_[i] = 0;
+    }
+
+    relay_flow->handler_ = handler;
+    relay_flow->pending_ = 0;
+    relay_flow->closing_ = false;
+
+    strand_.dispatch(
+                boost::bind(
+                    &uring_relay::handle_start_relay,
+                    shared_from_this(),
+                    relay_flow));
+
+    return relay_flow;
+}
+
+void uring_relay::stop_relay(
+        const flow::ptr& relay_flow)
+{
+    strand_.dispatch(
+                boost::bind(
+                    &uring_relay::handle_stop_relay,
+                    shared_from_this(),
+                    relay_flow));
+}
+
+uring_relay::info uring_relay::get_info()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    return info_;
+}
+
+void uring_relay::handle_start_relay(
+        flow::ptr relay_flow)
+{
+    flows_[relay_flow->id_] = relay_flow;
+
+    if (stopping_)
+    {
+        close_flow(*relay_flow, boost::asio::error::operation_aborted);
+        return;
+    }
+
+    start_receive(*relay_flow, 0);
+    start_receive(*relay_flow, 1);
+
+    submit();
+}
+
+void uring_relay::handle_stop_relay(
+        flow::ptr relay_flow)
+{
+    close_flow(*relay_flow, boost::system::error_code());
+
+    submit();
+}
+
+void uring_relay::start_wait()
+{
+    if (stopping_)
+        return;
+
+    event_.async_read_some(
+                boost::asio::buffer(&event_value_, sizeof(event_value_)),
+                strand_.wrap(
+                    boost::bind(
+                        &uring_relay::handle_wait,
+                        shared_from_this(),
+                        boost::asio::placeholders::error)));
+}
+
+void uring_relay::handle_wait(
+        const boost::system::error_code& error_code)
+{
+    if (stopping_ || error_code == boost::asio::error::operation_aborted)
+        return;
+
+    if (error_code)
+    {
+        LOG_ERROR() << "ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+        return;
+    }
+
+    reap();
+
+    submit();
+
+    start_wait();
+}
+
+void uring_relay::reap()
+{
+    uint64_t completions = 0;
+
+    for (;;)
+    {
+        unsigned head = *cq_head_;
+        const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+            break;
+
+        for (; head != tail; ++head)
+        {
+            const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+
+            const uint64_t user_data = cqe.user_data;
+            const int32_t result = cqe.res;
+            const uint32_t flags = cqe.flags;
+
+            // hands the slot back before the entry is processed, which may
+            // submit new operations
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+            ++completions;
+
+            const unsigned op = user_data & ((1 << OPERATION_BITS) - 1);
+
+            if (op == cancel)
+                continue;
+
+            flow_map::iterator it = flows_.find(user_data >> OPERATION_BITS);
+
+            if (it == flows_.end())
+            {
+                if (flags & IORING_CQE_F_BUFFER)
+                    recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+
+                continue;
+            }
+
+            // keeps the flow alive while it may be released
+            flow::ptr relay_flow = it->second;
+
+            if (op == receive_client || op == receive_server)
+                handle_receive(*relay_flow, op - receive_client, result, flags);
+            else
+                handle_send(*relay_flow, op - send_client, result);
+        }
+    }
+
+    // the buffers returned by the sends feed the receives that ran out
+    if (free_buffers_ && !starved_.empty())
+    {
+        std::vector<flow::ptr> starved;
+        starved.swap(starved_);
+
+        BOOST_FOREACH(flow::ptr& relay_flow, starved)
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                flow::half& half = relay_flow->halves_[i];
+
+                if (!half.starved_)
+                    continue;
+
+                half.starved_ = false;
+
+                if (!relay_flow->closing_ && !half.receiving_ &&
+                    !half.paused_ && !half.budget_paused_)
+                {
+                    start_receive(*relay_flow, i);
+                }
+            }
+        }
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    info_.completions_ += completions;
+}
+
+void uring_relay::handle_receive(
+        flow& relay_flow,
+        int index,
+        int32_t result,
+        uint32_t flags)
+{
+    flow::half& half = relay_flow.halves_[index];
+
+    const bool has_buffer = flags & IORING_CQE_F_BUFFER;
+    const uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (has_buffer)
+        --free_buffers_;
+
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        half.receiving_ = false;
+        --relay_flow.pending_;
+    }
+
+    if (relay_flow.closing_)
+    {
+        if (has_buffer)
+            recycle(bid);
+
+        release_flow(relay_flow);
+        return;
+    }
+
+    if (result > 0 && has_buffer)
+    {
+        flow::chunk chunk;
+
+        chunk.bid_ = bid;
+        chunk.offset_ = 0;
+        chunk.size_ = result;
+        chunk.read_time_ = boost::chrono::steady_clock::now();
+
+        half.queue_.push_back(chunk);
+        half.queued_bytes_ += result;
+
+        if (budget_)
+            budget_->add_buffered(result);
+
+        relay_flow.bytes_[index].fetch_add(
+                    result, boost::memory_order_relaxed);
+
+        if (metrics_)
+        {
+            (index ? metrics_->rx_bytes_ : metrics_->tx_bytes_).fetch_add(
+                        result, boost::memory_order_relaxed);
+        }
+
+        start_send(relay_flow, index);
+
+        if (half.queued_bytes_ > high_watermark_ && !half.paused_)
+        {
+            half.paused_ = true;
+
+            if (half.receiving_)
+            {
+                cancel_operation(
+                            make_user_data(
+                                relay_flow.id_, receive_client + index));
+            }
+        }
+
+        if (budget_ && budget_->is_buffer_full())
+            pause_for_budget(relay_flow, index);
+    }
+    else if (result == 0)
+    {
+        LOG_DEBUG() << "connection closed - "
+                    << (index ? "server" : "client");
+
+        half.eof_ = true;
+
+        // the bytes received so far are still delivered
+        if (half.queue_.empty())
+            close_flow(relay_flow, boost::asio::error::eof);
+
+        return;
+    }
+    else if (result == -ENOBUFS)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            ++info_.buffer_exhaustions_;
+        }
+
+        if (!half.starved_)
+        {
+            half.starved_ = true;
+            starved_.push_back(flows_[relay_flow.id_]);
+        }
+
+        return;
+    }
+    else if (result < 0 && result != -ECANCELED)
+    {
+        boost::system::error_code error_code(
+                    -result, boost::system::system_category());
+
+        LOG_DEBUG() << "receive failed ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+
+        close_flow(relay_flow, error_code);
+        return;
+    }
+
+    // the kernel may end a multishot receive at any time
+    if (!half.receiving_ && !half.paused_ && !half.budget_paused_ &&
+        !half.starved_)
+    {
+        start_receive(relay_flow, index);
+    }
+}
+
+void uring_relay::handle_send(
+        flow& relay_flow,
+        int index,
+        int32_t result)
+{
+    flow::half& half = relay_flow.halves_[index];
+
+    half.sending_ = false;
+    --relay_flow.pending_;
+
+    if (relay_flow.closing_)
+    {
+        release_flow(relay_flow);
+        return;
+    }
+
+    if (result < 0)
+    {
+        boost::system::error_code error_code(
+                    -result, boost::system::system_category());
+
+        LOG_DEBUG() << "send failed ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+
+        close_flow(relay_flow, error_code);
+        return;
+    }
+
+    flow::chunk& chunk = half.queue_.front();
+
+    chunk.offset_ += result;
+    chunk.size_ -= result;
+    half.queued_bytes_ -= result;
+
+    if (budget_)
+        budget_->remove_buffered(result);
+
+    if (!chunk.size_)
+    {
+        if (metrics_)
+        {
+            (index ? metrics_->rx_latency_ : metrics_->tx_latency_).record(
+                        boost::chrono::duration_cast<
+                            boost::chrono::nanoseconds>(
+                                boost::chrono::steady_clock::now() -
+                                chunk.read_time_).count());
+        }
+
+        recycle(chunk.bid_);
+        half.queue_.pop_front();
+    }
+
+    if (half.eof_ && half.queue_.empty())
+    {
+        close_flow(relay_flow, boost::asio::error::eof);
+        return;
+    }
+
+    start_send(relay_flow, index);
+
+    if (half.paused_ && half.queued_bytes_ <= low_watermark_)
+    {
+        half.paused_ = false;
+
+        if (!half.receiving_ && !half.budget_paused_ && !half.starved_)
+            start_receive(relay_flow, index);
+    }
+}
+
+void uring_relay::pause_for_budget(
+        flow& relay_flow,
+        int index)
+{
+    flow::half& half = relay_flow.halves_[index];
+
+    if (half.budget_paused_)
+        return;
+
+    LOG_TRACE() << "receives paused by the budget";
+
+    half.budget_paused_ = true;
+    budget_paused_.push_back(flows_[relay_flow.id_]);
+
+    if (metrics_)
+    {
+        metrics_->budget_read_pauses_.fetch_add(
+                    1, boost::memory_order_relaxed);
+    }
+
+    // a receive already cancelled by the watermark is not cancelled twice
+    if (half.receiving_ && !half.paused_)
+    {
+        cancel_operation(
+                    make_user_data(relay_flow.id_, receive_client + index));
+    }
+
+    if (!budget_timer_armed_)
+    {
+        budget_timer_armed_ = true;
+
+        budget_timer_.expires_from_now(
+                    boost::posix_time::milliseconds(BUDGET_RETRY_MS));
+        budget_timer_.async_wait(
+                    strand_.wrap(
+                        boost::bind(
+                            &uring_relay::handle_budget_retry,
+                            shared_from_this(),
+                            boost::asio::placeholders::error)));
+    }
+}
+
+void uring_relay::handle_budget_retry(
+        const boost::system::error_code& error_code)
+{
+    budget_timer_armed_ = false;
+
+    if (stopping_ || error_code == boost::asio::error::operation_aborted)
+        return;
+
+    std::vector<flow::ptr> paused;
+    paused.swap(budget_paused_);
+
+    BOOST_FOREACH(flow::ptr& relay_flow, paused)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            flow::half& half = relay_flow->halves_[i];
+
+            if (!half.budget_paused_)
+                continue;
+
+            half.budget_paused_ = false;
+
+            if (relay_flow->closing_)
+                continue;
+
+            // pauses the direction again and re-arms the timer
+            if (budget_->is_buffer_full())
+            {
+                pause_for_budget(*relay_flow, i);
+                continue;
+            }
+
+            if (!half.receiving_ && !half.paused_ && !half.starved_)
+                start_receive(*relay_flow, i);
+        }
+    }
+
+    submit();
+}
+
+void uring_relay::start_receive(
+        flow& relay_flow,
+        int index)
+{
+    flow::half& half = relay_flow.halves_[index];
+
+    struct io_uring_sqe* sqe = get_sqe();
+
+    if (!sqe)
+    {
+        close_flow(relay_flow, boost::asio::error::no_buffer_space);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = half.from_;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = make_user_data(relay_flow.id_, receive_client + index);
+
+    half.receiving_ = true;
+    ++relay_flow.pending_;
+}
+
+void uring_relay::start_send(
+        flow& relay_flow,
+        int index)
+{
+    flow::half& half = relay_flow.halves_[index];
+
+    // one send at a time keeps the bytes in order
+    if (half.sending_ || half.queue_.empty())
+        return;
+
+    const flow::chunk& chunk = half.queue_.front();
+
+    struct io_uring_sqe* sqe = get_sqe();
+
+    if (!sqe)
+    {
+        close_flow(relay_flow, boost::asio::error::no_buffer_space);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = half.to_;
+    sqe->addr = reinterpret_cast<uint64_t>(
+                &buffers_[chunk.bid_ * buffer_size_ + chunk.offset_]);
+    sqe->len = chunk.size_;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(relay_flow.id_, send_client + index);
+
+    half.sending_ = true;
+    ++relay_flow.pending_;
+}
+
+void uring_relay::close_flow(
+        flow& relay_flow,
+        const boost::system::error_code& error_code)
+{
+    if (relay_flow.closing_)
+        return;
+
+    relay_flow.closing_ = true;
+
+    close_handler handler;
+    handler.swap(relay_flow.handler_);
+
+    // the shutdown completes the pending operations right away, the
+    // cancellations are only a fallback
+    for (int i = 0; i < 2; ++i)
+    {
+        shutdown(relay_flow.fds_[i], SHUT_RDWR);
+
+        if (relay_flow.halves_[i].receiving_)
+        {
+            cancel_operation(
+                        make_user_data(relay_flow.id_, receive_client + i));
+        }
+
+        if (relay_flow.halves_[i].sending_)
+            cancel_operation(make_user_data(relay_flow.id_, send_client + i));
+    }
+
+    release_flow(relay_flow);
+
+    if (error_code && handler)
+        handler(error_code);
+}
+
+void uring_relay::release_flow(
+        flow& relay_flow)
+{
+    if (relay_flow.pending_)
+        return;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        BOOST_FOREACH(const flow::chunk& chunk, relay_flow.halves_[i].queue_)
+        {
+            recycle(chunk.bid_);
+        }
+
+        relay_flow.halves_[i].queue_.clear();
+
+        // the bytes never sent are given back to the budget
+        if (budget_)
+            budget_->remove_buffered(relay_flow.halves_[i].queued_bytes_);
+
+        relay_flow.halves_[i].queued_bytes_ = 0;
+
+        if (relay_flow.fds_[i] >= 0)
+        {
+            close(relay_flow.fds_[i]);
+            relay_flow.fds_[i] = -1;
+        }
+    }
+
+    flows_.erase(relay_flow.id_);
+}
+
+void uring_relay::cancel_operation(
+        uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = make_user_data(0, cancel);
+}
+
+struct io_uring_sqe* uring_relay::get_sqe()
+{
+    const unsigned tail = *sq_tail_;
+
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    {
+        submit();
+
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+        {
+            LOG_ERROR() << "submission queue full";
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+
+    return sqe;
+}
+
+void uring_relay::submit()
+{
+    if (!to_submit_)
+        return;
+
+    int submitted;
+
+    do
+    {
+        submitted = io_uring_enter(ring_fd_, to_submit_, 0, 0);
+    }
+    while (submitted < 0 && errno == EINTR);
+
+    if (submitted < 0)
+    {
+        boost::system::error_code error_code(
+                    errno, boost::system::system_category());
+
+        LOG_ERROR() << "io_uring_enter ec=[" << error_code << "] message=["
+                    << error_code.message() << "]";
+        return;
+    }
+
+    to_submit_ -= submitted;
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    ++info_.enters_;
+    info_.submissions_ += submitted;
+}
+
+void uring_relay::recycle(
+        uint16_t bid)
+{
+    struct io_uring_buf* bufs =
+            static_cast<struct io_uring_buf*>(buffer_ring_);
+
+    struct io_uring_buf& buf = bufs[buffer_tail_ & (buffer_count_ - 1)];
+
+    buf.addr = reinterpret_cast<uint64_t>(&buffers_[bid * buffer_size_]);
+    buf.len = static_cast<uint32_t>(buffer_size_);
+    buf.bid = bid;
+
+    ++buffer_tail_;
+    ++free_buffers_;
+
+    // the ring tail overlays the reserved field of the first entry
+    __atomic_store_n(
+                reinterpret_cast<uint16_t*>(
+                    static_cast<uint8_t*>(buffer_ring_) +
+                    offsetof(struct io_uring_buf, resv)),
+                buffer_tail_,
+                __ATOMIC_RELEASE);
+}
+
+void uring_relay::close_ring()
+{
+    BOOST_FOREACH(flow_map::value_type& entry, flows_)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (entry.second->fds_[i] >= 0)
+                close(entry.second->fds_[i]);
+        }
+    }
+
+    flows_.clear();
+    starved_.clear();
+
+    boost::system::error_code ignored;
+    event_.close(ignored);
+
+    // closing the ring cancels whatever is still in flight
+    if (ring_fd_ >= 0)
+        close(ring_fd_);
+
+    if (sqes_)
+        munmap(sqes_, sqes_size_);
+
+    if (rings_ != MAP_FAILED)
+        munmap(rings_, rings_size_);
+
+    if (buffer_ring_ != MAP_FAILED)
+        munmap(buffer_ring_, buffer_ring_size_);
+
+    ring_fd_ = -1;
+    sqes_ = NULL;
+    rings_ = MAP_FAILED;
+    buffer_ring_ = MAP_FAILED;
+}
+
+#else
+
+uring_relay::uring_relay(
+        boost::asio::io_service& io_service,
+        const std::string& name,
+        unsigned,
+        unsigned,
+        size_t,
+        size_t,
+        size_t,
+        const proxy_metrics::ptr&,
+        const admission_budget::ptr&) :
+    logger_(boost::log::keywords::channel = "net.uring_relay." + name),
+    io_service_(io_service),
+    strand_(io_service),
+    event_(io_service),
+    budget_timer_(io_service)
+{
+    throw boost::system::system_error(
+                boost::asio::error::operation_not_supported,
+                "io_uring not built");
+}
+
+uring_relay::~uring_relay()
+{
+}
+
+bool uring_relay::is_supported()
+{
+    return false;
+}
+
+bool uring_relay::probe()
+{
+    return false;
+}
+
+void uring_relay::start()
+{
+}
+
+void uring_relay::stop()
+{
+}
+
+uring_relay::flow::ptr uring_relay::start_relay(
+        int,
+        int,
+        const close_handler&)
+{
+    throw boost::system::system_error(
+                boost::asio::error::operation_not_supported,
+                "io_uring not built");
+}
+
+void uring_relay::stop_relay(
+        const flow::ptr&)
+{
+}
+
+uring_relay::info uring_relay::get_info()
+{
+    return info();
+}
+
+#endif
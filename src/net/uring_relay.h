@@ -0,0 +1,693 @@
+//
+//            Copyright (c) Marco Amorim 2017.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "net/admission_budget.h"
+#include "net/proxy_metrics.h"
+#include "core/log.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+///
+/// @brief This namespace is used by all classes related to networking.
+///
+namespace net {
+
+///
+/// @brief This class relays the sessions of a proxy through an io_uring
+/// instance instead of readiness events and one syscall per transfer.
+///
+/// Every direction of a session keeps a multishot receive armed, which picks
+/// its buffers from a ring of buffers registered with the kernel. A received
+/// buffer is sent to the other socket straight from the ring and returned to
+/// it once sent. The submissions of every wakeup are flushed with a single
+/// io_uring_enter(2) and the completions are signalled by an eventfd watched
+/// by the io_service, so the relay runs on the proxy threads.
+///
+/// The relay uses the raw syscalls and is only built on Linux with the
+/// io_uring headers. is_supported() also checks the running kernel.
+///
+class uring_relay :
+        public boost::enable_shared_from_this<uring_relay>
+{
+public:
+
+    ///
+    /// @brief Defines a shared_ptr for itself.
+    ///
+    typedef boost::shared_ptr<uring_relay> ptr;
+
+    ///
+    /// @brief Defines the handler invoked once when a relayed session ends
+    /// by itself, because a peer closed the connection or failed.
+    ///
+    typedef boost::function<void(const boost::system::error_code&)>
+        close_handler;
+
+    ///
+    /// @brief This structure holds the state of a relayed session, which is
+    /// only accessed from the relay strand except for the byte counters.
+    ///
+    typedef struct flow_ :
+            private boost::noncopyable
+    {
+        ///
+        /// @brief Defines a shared_ptr for itself.
+        ///
+        typedef boost::shared_ptr<flow_> ptr;
+
+        ///
+        /// @brief This structure holds a received buffer waiting to be sent.
+        ///
+        typedef struct chunk_
+        {
+            ///
+            /// @brief Holds the buffer identifier within the buffer ring.
+            ///
+            uint16_t bid_;
+
+            ///
+            /// @brief Holds the offset of the bytes not sent yet.
+            ///
+            uint32_t offset_;
+
+            ///
+            /// @brief Holds the amount of bytes not sent yet.
+            ///
+            uint32_t size_;
+
+            ///
+            /// @brief Holds the time the buffer was received.
+            ///
+            boost::chrono::steady_clock::time_point read_time_;
+
+        } chunk;
+
+        ///
+        /// @brief This structure holds the state of one direction.
+        ///
+        typedef struct half_
+        {
+            ///
+            /// @brief Holds the descriptor the bytes are received from.
+            ///
+            int from_;
+
+            ///
+            /// @brief Holds the descriptor the bytes are sent to.
+            ///
+            int to_;
+
+            ///
+            /// @brief Holds the received buffers in arrival order. The front
+            /// one is being sent.
+            ///
+            std::deque<chunk> queue_;
+
+            ///
+            /// @brief Holds the amount of bytes waiting to be sent.
+            ///
+            size_t queued_bytes_;
+
+            ///
+            /// @brief Flag indicating whether the multishot receive is armed.
+            ///
+            bool receiving_;
+
+            ///
+            /// @brief Flag indicating whether a send is in progress.
+            ///
+            bool sending_;
+
+            ///
+            /// @brief Flag indicating whether the receive was cancelled
+            /// because the queued bytes reached the high watermark.
+            ///
+            bool paused_;
+
+            ///
+            /// @brief Flag indicating whether the receive was cancelled
+            /// because the buffered bytes reached the budget.
+            ///
+            bool budget_paused_;
+
+            ///
+            /// @brief Flag indicating whether the receive is waiting for free
+            /// buffers.
+            ///
+            bool starved_;
+
+            ///
+            /// @brief Flag indicating whether the peer closed its side. The
+            /// session ends once the queued bytes are sent.
+            ///
+            bool eof_;
+
+        } half;
+
+        ///
+        /// @brief Holds the flow identifier, used to tag its operations.
+        ///
+        uint64_t id_;
+
+        ///
+        /// @brief Holds the client and server descriptors, duplicated so the
+        /// session closing its sockets never hands their numbers to another
+        /// connection while operations are pending.
+        ///
+        int fds_[2];
+
+        ///
+        /// @brief Holds the directions: 0 carries the messages from client
+        /// and 1 the messages from server.
+        ///
+        half halves_[2];
+
+        ///
+        /// @brief Holds the handler invoked when the flow ends by itself.
+        ///
+        close_handler handler_;
+
+        ///
+        /// @brief Holds the number of operations in flight.
+        ///
+        unsigned pending_;
+
+        ///
+        /// @brief Flag indicating whether the flow is closing.
+        ///
+        bool closing_;
+
+        ///
+        /// @brief Holds the bytes received from client and from server.
+        ///
+        boost::atomic<uint64_t> bytes_[2];
+
+    } flow;
+
+    ///
+    /// @brief This structure holds the relay counters.
+    ///
+    typedef struct info_
+    {
+        ///
+        /// @brief Holds the number of io_uring_enter(2) calls.
+        ///
+        uint64_t enters_;
+
+        ///
+        /// @brief Holds the number of operations submitted.
+        ///
+        uint64_t submissions_;
+
+        ///
+        /// @brief Holds the number of completions processed.
+        ///
+        uint64_t completions_;
+
+        ///
+        /// @brief Holds how many times a receive found no free buffer.
+        ///
+        uint64_t buffer_exhaustions_;
+
+    } info;
+
+    ///
+    /// @brief Constructor. Sets up the ring and registers the buffers.
+    ///
+    /// @param io_service Reference to io_service.
+    /// @param name The proxy name, used by the logger.
+    /// @param entries The number of submission queue entries.
+    /// @param buffer_count The number of registered buffers. It is rounded
+    /// up to a power of two.
+    /// @param buffer_size The size in bytes of every buffer.
+    /// @param high_watermark The amount of bytes waiting to be sent above
+    /// which a direction stops receiving.
+    /// @param low_watermark The amount of bytes waiting to be sent below
+    /// which a direction resumes receiving.
+    /// @param metrics The live counters of the proxy.
+    /// @param budget The budget of the buffered bytes, shared with the other
+    /// sessions of the proxy (empty - no budget).
+    ///
+    /// @throw boost::system::system_error If the ring can not be set up.
+    ///
+    uring_relay(
+            boost::asio::io_service& io_service,
+            const std::string& name,
+            unsigned entries,
+            unsigned buffer_count,
+            size_t buffer_size,
+            size_t high_watermark,
+            size_t low_watermark,
+            const proxy_metrics::ptr& metrics,
+            const admission_budget::ptr& budget);
+
+    ///
+    /// @brief Destructor. Closes the ring and the remaining descriptors.
+    ///
+    virtual ~uring_relay();
+
+    ///
+    /// @brief Checks whether the relay is built and supported by the running
+    /// kernel.
+    ///
+    /// @return True if multishot receives from a buffer ring are available.
+    ///
+    static bool is_supported();
+
+    ///
+    /// @brief Starts watching the completions.
+    ///
+    void start();
+
+    ///
+    /// @brief Cancels every flow and stops watching the completions. It is
+    /// safe to call this method from any thread.
+    ///
+    void stop();
+
+    ///
+    /// @brief Starts relaying a session. It is safe to call this method from
+    /// any thread.
+    ///
+    /// @param client_fd The socket connected to the client.
+    /// @param server_fd The socket connected to the server.
+    /// @param handler The handler invoked if the flow ends by itself.
+    ///
+    /// @return The flow.
+    ///
+    /// @throw boost::system::system_error If the descriptors can not be
+    /// duplicated.
+    ///
+    flow::ptr start_relay(
+            int client_fd,
+            int server_fd,
+            const close_handler& handler);
+
+    ///
+    /// @brief Stops relaying a session without invoking its handler. It is
+    /// safe to call this method from any thread.
+    ///
+    /// @param relay_flow The flow returned by start_relay().
+    ///
+    void stop_relay(
+            const flow::ptr& relay_flow);
+
+    ///
+    /// @brief Gets the relay counters.
+    ///
+    /// @return The counters.
+    ///
+    info get_info();
+
+protected:
+
+    ///
+    /// @brief Defines the operations tagged in the user data.
+    ///
+    typedef enum operation_
+    {
+        receive_client,     ///< Multishot receive of the client half.
+        receive_server,     ///< Multishot receive of the server half.
+        send_client,        ///< Send of the client half.
+        send_server,        ///< Send of the server half.
+        cancel              ///< Cancellation, not tied to a flow.
+    } operation;
+
+    ///
+    /// @brief Tries a multishot receive on a socket pair with a small ring.
+    ///
+    /// @return True if it completed as expected.
+    ///
+    static bool probe();
+
+    ///
+    /// @brief Registers a flow inside the relay strand.
+    ///
+    void handle_start_relay(
+            flow::ptr relay_flow);
+
+    ///
+    /// @brief Closes a flow inside the relay strand.
+    ///
+    void handle_stop_relay(
+            flow::ptr relay_flow);
+
+    ///
+    /// @brief Handles a stop request inside the relay strand.
+    ///
+    void handle_stop();
+
+    ///
+    /// @brief Arms the read of the completion eventfd.
+    ///
+    void start_wait();
+
+    ///
+    /// @brief This handler is invoked whenever there are completions.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// read operation.
+    ///
+    void handle_wait(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Cancels the receive of a direction while the buffered bytes
+    /// are over the budget.
+    ///
+    void pause_for_budget(
+            flow& relay_flow,
+            int index);
+
+    ///
+    /// @brief This handler is invoked when the receives paused by the
+    /// budget are retried.
+    ///
+    /// @param error_code The error code which indicates the result of the
+    /// wait operation.
+    ///
+    void handle_budget_retry(
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Processes every completion in the queue.
+    ///
+    void reap();
+
+    ///
+    /// @brief Processes a completion of a receive.
+    ///
+    void handle_receive(
+            flow& relay_flow,
+            int index,
+            int32_t result,
+            uint32_t flags);
+
+    ///
+    /// @brief Processes a completion of a send.
+    ///
+    void handle_send(
+            flow& relay_flow,
+            int index,
+            int32_t result);
+
+    ///
+    /// @brief Arms the multishot receive of a direction.
+    ///
+    void start_receive(
+            flow& relay_flow,
+            int index);
+
+    ///
+    /// @brief Sends the front buffer of a direction unless a send is in
+    /// progress.
+    ///
+    void start_send(
+            flow& relay_flow,
+            int index);
+
+    ///
+    /// @brief Starts closing a flow, cancelling its operations.
+    ///
+    /// @param relay_flow The flow.
+    /// @param error_code The reason handed to its handler (success - do not
+    /// invoke the handler).
+    ///
+    void close_flow(
+            flow& relay_flow,
+            const boost::system::error_code& error_code);
+
+    ///
+    /// @brief Releases a closing flow once it has no operation in flight.
+    ///
+    void release_flow(
+            flow& relay_flow);
+
+    ///
+    /// @brief Queues a cancellation of an operation.
+    ///
+    void cancel_operation(
+            uint64_t user_data);
+
+    ///
+    /// @brief Gets a free submission queue entry, flushing the queue if it
+    /// is full.
+    ///
+    struct io_uring_sqe* get_sqe();
+
+    ///
+    /// @brief Submits the queued entries.
+    ///
+    void submit();
+
+    ///
+    /// @brief Returns a buffer to the buffer ring.
+    ///
+    void recycle(
+            uint16_t bid);
+
+    ///
+    /// @brief Closes the ring, the eventfd and the descriptors of the
+    /// remaining flows.
+    ///
+    void close_ring();
+
+    ///
+    /// @brief Holds the logger responsible for logging events from objects of
+    /// this class.
+    ///
+    core::logger_type logger_;
+
+    ///
+    /// @brief Holds the io_service reference used to process all asynchronous
+    /// operations.
+    ///
+    boost::asio::io_service& io_service_;
+
+    ///
+    /// @brief Strand used to serialize every access to the ring.
+    ///
+    boost::asio::io_service::strand strand_;
+
+    ///
+    /// @brief Holds the eventfd signalled by the completions.
+    ///
+    boost::asio::posix::stream_descriptor event_;
+
+    ///
+    /// @brief Holds the value read from the eventfd.
+    ///
+    uint64_t event_value_;
+
+    ///
+    /// @brief Holds the ring descriptor.
+    ///
+    int ring_fd_;
+
+    ///
+    /// @brief Holds the mapped submission and completion rings.
+    ///
+    void* rings_;
+
+    ///
+    /// @brief Holds the size of the mapped rings.
+    ///
+    size_t rings_size_;
+
+    ///
+    /// @brief Holds the mapped submission queue entries.
+    ///
+    struct io_uring_sqe* sqes_;
+
+    ///
+    /// @brief Holds the size of the mapped submission queue entries.
+    ///
+    size_t sqes_size_;
+
+    ///
+    /// @brief Holds the submission queue head, written by the kernel.
+    ///
+    unsigned* sq_head_;
+
+    ///
+    /// @brief Holds the submission queue tail.
+    ///
+    unsigned* sq_tail_;
+
+    ///
+    /// @brief Holds the submission queue mask.
+    ///
+    unsigned sq_mask_;
+
+    ///
+    /// @brief Holds the submission queue flags, written by the kernel.
+    ///
+    unsigned* sq_flags_;
+
+    ///
+    /// @brief Holds the submission queue index array.
+    ///
+    unsigned* sq_array_;
+
+    ///
+    /// @brief Holds the number of submission queue entries.
+    ///
+    unsigned sq_entries_;
+
+    ///
+    /// @brief Holds the completion queue head.
+    ///
+    unsigned* cq_head_;
+
+    ///
+    /// @brief Holds the completion queue tail, written by the kernel.
+    ///
+    unsigned* cq_tail_;
+
+    ///
+    /// @brief Holds the completion queue mask.
+    ///
+    unsigned cq_mask_;
+
+    ///
+    /// @brief Holds the completion queue entries.
+    ///
+    struct io_uring_cqe* cqes_;
+
+    ///
+    /// @brief Holds the number of entries queued and not submitted yet.
+    ///
+    unsigned to_submit_;
+
+    ///
+    /// @brief Holds the buffer ring shared with the kernel.
+    ///
+    void* buffer_ring_;
+
+    ///
+    /// @brief Holds the size of the buffer ring.
+    ///
+    size_t buffer_ring_size_;
+
+    ///
+    /// @brief Holds the memory of the buffers.
+    ///
+    std::vector<uint8_t> buffers_;
+
+    ///
+    /// @brief Holds the number of buffers.
+    ///
+    unsigned buffer_count_;
+
+    ///
+    /// @brief Holds the size of every buffer.
+    ///
+    size_t buffer_size_;
+
+    ///
+    /// @brief Holds the buffer ring tail, published to the kernel whenever a
+    /// buffer is returned.
+    ///
+    uint16_t buffer_tail_;
+
+    ///
+    /// @brief Holds the number of buffers owned by the kernel.
+    ///
+    unsigned free_buffers_;
+
+    ///
+    /// @brief Holds the amount of bytes waiting to be sent above which a
+    /// direction stops receiving.
+    ///
+    size_t high_watermark_;
+
+    ///
+    /// @brief Holds the amount of bytes waiting to be sent below which a
+    /// direction resumes receiving.
+    ///
+    size_t low_watermark_;
+
+    ///
+    /// @brief Holds the live counters of the proxy.
+    ///
+    proxy_metrics::ptr metrics_;
+
+    ///
+    /// @brief Holds the budget of the buffered bytes.
+    ///
+    admission_budget::ptr budget_;
+
+    ///
+    /// @brief Timer used to retry the receives paused by the budget, since
+    /// the bytes are released by the other sessions as well.
+    ///
+    boost::asio::deadline_timer budget_timer_;
+
+    ///
+    /// @brief Flag indicating whether the budget timer is armed.
+    ///
+    bool budget_timer_armed_;
+
+    ///
+    /// @brief Defines the flows indexed by their identifiers.
+    ///
+    typedef boost::unordered_map<uint64_t, flow::ptr> flow_map;
+
+    ///
+    /// @brief Holds the flows not released yet.
+    ///
+    flow_map flows_;
+
+    ///
+    /// @brief Holds the flows waiting for free buffers.
+    ///
+    std::vector<flow::ptr> starved_;
+
+    ///
+    /// @brief Holds the flows paused by the budget.
+    ///
+    std::vector<flow::ptr> budget_paused_;
+
+    ///
+    /// @brief Holds the identifier of the next flow.
+    ///
+    boost::atomic<uint64_t> next_id_;
+
+    ///
+    /// @brief Holds the relay counters.
+    ///
+    info info_;
+
+    ///
+    /// @brief Flag indicating whether the relay is stopping.
+    ///
+    bool stopping_;
+
+    ///
+    /// @brief Mutex used to synchronize the access to the counters.
+    ///
+    boost::mutex mutex_;
+};
+
+} // namespace net